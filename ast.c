@@ -18,6 +18,12 @@
 #include "lib.h"
 #include "lexer.h"
 #include "parser.h"
+#include "compiler.h"
+#include "program.h"
+#include "optimizer.h"
+#include "strbuf.h"
+#include "memo.h"
+#include "region.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,9 +31,6 @@
 #include <string.h>
 #include <math.h>
 
-static size_t ut_ext_types_count = 0;
-static struct ut_extended_type *ut_ext_types = NULL;
-
 struct ut_op *
 ut_get_op(struct ut_state *s, uint32_t off)
 {
@@ -48,11 +51,44 @@ ut_get_child(struct ut_state *s, uint32_t off, int n)
 	return ut_get_op(s, op->tree.operand[n]);
 }
 
+/*
+ * Labels of the same name share one string object, along with the hash of
+ * the name, so property and variable lookups never have to hash it again.
+ */
+static struct json_object *
+ut_intern_label(struct ut_state *s, struct json_object *val, unsigned long *hash)
+{
+	const char *key = json_object_get_string(val);
+	struct lh_table *t;
+	struct lh_entry *e;
+
+	if (!s->labels)
+		s->labels = json_object_new_object();
+
+	if (!s->labels)
+		return val;
+
+	t = json_object_get_object(s->labels);
+	*hash = lh_get_hash(t, key);
+	e = lh_table_lookup_entry_w_hash(t, key, *hash);
+
+	if (e) {
+		json_object_put(val);
+
+		return json_object_get(lh_entry_v(e));
+	}
+
+	json_object_object_add(s->labels, key, json_object_get(val));
+
+	return val;
+}
+
 uint32_t
 ut_new_op(struct ut_state *s, int type, struct json_object *val, ...)
 {
 	struct ut_op *newop, *pool;
 	uint32_t child;
+	size_t cap;
 	int n_op = 0;
 	va_list ap;
 
@@ -61,21 +97,41 @@ ut_new_op(struct ut_state *s, int type, struct json_object *val, ...)
 		exit(127);
 	}
 
-	pool = realloc(s->pool, (s->poolsize + 1) * sizeof(*newop));
+	/* grow geometrically, the capacity is kept across ut_parse() calls */
+	if (s->poolsize >= s->poolcap) {
+		cap = s->poolcap ? s->poolcap * 2 : 256;
 
-	if (!pool) {
-		fprintf(stderr, "Out of memory\n");
-		exit(127);
+		if (cap >= UINT32_MAX || cap < s->poolcap)
+			cap = UINT32_MAX - 1;
+
+		/* contexts leave the ops of their shared program untouched */
+		if (s->prog && s->pool == s->prog->state->pool) {
+			pool = malloc(cap * sizeof(*newop));
+
+			if (pool)
+				memcpy(pool, s->pool, s->poolsize * sizeof(*newop));
+		}
+		else {
+			pool = realloc(s->pool, cap * sizeof(*newop));
+		}
+
+		if (!pool) {
+			fprintf(stderr, "Out of memory\n");
+			exit(127);
+		}
+
+		s->pool = pool;
+		s->poolcap = cap;
 	}
 
-	newop = &pool[s->poolsize];
+	newop = &s->pool[s->poolsize];
 	memset(newop, 0, sizeof(*newop));
 
 	newop->is_first = !s->poolsize;
 	newop->is_op = true;
 	newop->off = s->off;
 	newop->type = type;
-	newop->val = val;
+	newop->val = (type == T_LABEL && val) ? ut_intern_label(s, val, &newop->hash) : val;
 
 	va_start(ap, val);
 
@@ -84,7 +140,6 @@ ut_new_op(struct ut_state *s, int type, struct json_object *val, ...)
 
 	va_end(ap);
 
-	s->pool = pool;
 	s->poolsize++;
 
 	return s->poolsize;
@@ -111,13 +166,16 @@ ut_wrap_op(struct ut_state *s, uint32_t parent, ...)
 uint32_t
 ut_append_op(struct ut_state *s, uint32_t a, uint32_t b)
 {
-	struct ut_op *tail = ut_get_op(s, a);
-
-	while (tail && tail->tree.next)
-		tail = ut_get_op(s, tail->tree.next);
+	struct ut_op *head = ut_get_op(s, a);
+	struct ut_op *tail = ut_get_op(s, head->tree.tail ? head->tree.tail : a);
+	struct ut_op *last = ut_get_op(s, b);
 
+	/* the head of a list remembers its last element to make appends O(1) */
 	tail->tree.next = b;
 
+	if (last)
+		head->tree.tail = last->tree.tail ? last->tree.tail : b;
+
 	return a;
 }
 
@@ -164,24 +222,34 @@ ut_new_null(void)
 	return d;
 }
 
+/* tags of values created at runtime come from the region of the state */
+static struct ut_op *
+ut_new_tag(struct ut_state *s)
+{
+	if (!s->tags)
+		s->tags = ut_region_new(sizeof(struct ut_op));
+
+	return s->tags ? ut_region_alloc(s->tags) : NULL;
+}
+
 static void
 obj_free(struct json_object *v, void *ud)
 {
 	struct ut_op *op = json_object_get_userdata(v);
 
 	json_object_put(op->tag.proto);
-	free(ud);
+	ut_region_release(ud);
 }
 
 struct json_object *
-ut_new_object(struct json_object *proto) {
+ut_new_object(struct ut_state *s, struct json_object *proto) {
 	struct json_object *val = json_object_new_object();
 	struct ut_op *op;
 
 	if (!val)
 		return NULL;
 
-	op = calloc(1, sizeof(*op));
+	op = ut_new_tag(s);
 
 	if (!op) {
 		json_object_put(val);
@@ -228,7 +296,7 @@ func_to_string(struct json_object *v, struct printbuf *pb, int level, int flags)
 }
 
 struct json_object *
-ut_new_func(struct ut_op *decl)
+ut_new_func(struct ut_state *s, uint32_t decl)
 {
 	struct json_object *val = json_object_new_object();
 	struct ut_op *op;
@@ -236,7 +304,7 @@ ut_new_func(struct ut_op *decl)
 	if (!val)
 		return NULL;
 
-	op = calloc(1, sizeof(*op));
+	op = ut_new_tag(s);
 
 	if (!op) {
 		json_object_put(val);
@@ -244,9 +312,11 @@ ut_new_func(struct ut_op *decl)
 		return NULL;
 	}
 
+	/* invocations use the offset, the pointer is only used for printing */
 	op->val = val;
 	op->type = T_FUNC;
-	op->tag.data = decl;
+	op->tag.decl = decl;
+	op->tag.data = ut_get_op(s, decl);
 
 	json_object_set_serializer(val, func_to_string, op, obj_free);
 
@@ -270,26 +340,80 @@ ut_reset(struct ut_state *s)
 void
 ut_free(struct ut_state *s)
 {
-	size_t n;
+	struct ut_extended_type *et;
+	size_t n, base;
 
 	if (s) {
 		while (s->stack.off > 0)
 			json_object_put(s->stack.scope[--s->stack.off]);
 
+		while (s->stack.nspare > 0)
+			json_object_put(s->stack.spare[--s->stack.nspare]);
+
 		free(s->stack.scope);
+		free(s->stack.frames);
 
-		for (n = 0; n < s->poolsize; n++)
+		s->ctx = NULL;
+
+		json_object_put(s->modules);
+		s->modules = NULL;
+
+		json_object_put(s->labels);
+		s->labels = NULL;
+
+		ut_output_free(&s->output);
+
+		/* contexts only own the ops they added to the program */
+		base = s->prog ? s->prog->state->poolsize : 0;
+
+		for (n = base; n < s->poolsize; n++)
 			json_object_put(s->pool[n].val);
 
-		free(s->pool);
+		if (s->consts)
+			for (n = 0; n < base; n++)
+				json_object_put(s->consts[n]);
+
+		if (!s->prog || s->pool != s->prog->state->pool)
+			free(s->pool);
+
+		free(s->consts);
+
+		for (n = 0; n < s->formats.size; n++)
+			free(s->formats.cache[n]);
+
+		free(s->formats.cache);
+		ut_strbuf_put(s->formats.buf);
+
+		free(s->propcache.entries);
+		ut_memo_free(s);
+
+		ut_compiler_free(s);
+		ut_program_put(s->prog);
 
 		s->pool = NULL;
 		s->poolsize = 0;
+		s->poolcap = 0;
+		s->consts = NULL;
+		s->prog = NULL;
 
 		ut_reset(s);
+
+		while (s->types) {
+			et = s->types;
+			s->types = et->next;
+			json_object_put(et->proto);
+
+			/* ressources outliving the state still need their type */
+			if (et->live)
+				et->orphaned = true;
+			else
+				free(et);
+		}
+
+		ut_region_put(s->tags);
+		s->tags = NULL;
 	}
 
-	free(ut_ext_types);
 	free(s);
 }
 
@@ -334,26 +458,45 @@ ut_parse(struct ut_state *s, const char *expr)
 
 	Parse(pParser, 0, 0, s);
 
+	if (!s->error.code)
+		ut_optimize(s, s->main);
+
 out:
 	ParseFree(pParser, free);
 
 	return s->error.code;
 }
 
+/*
+ * Takes over the given prototype object. Prototypes are kept per state since
+ * the json-c reference counts taken by each new instance are not atomic.
+ */
 bool
-ut_register_extended_type(const char *name, void (*freefn)(void *))
+ut_register_extended_type(struct ut_state *s, const char *name, struct json_object *proto, void (*freefn)(void *))
 {
-	struct ut_extended_type *tmp;
+	struct ut_extended_type *et;
+
+	for (et = s->types; et; et = et->next) {
+		if (!strcmp(et->name, name)) {
+			json_object_put(proto);
+
+			return true;
+		}
+	}
 
-	tmp = realloc(ut_ext_types, (ut_ext_types_count + 1) * sizeof(*tmp));
+	et = calloc(1, sizeof(*et));
+
+	if (!et) {
+		json_object_put(proto);
 
-	if (!tmp)
 		return false;
+	}
 
-	ut_ext_types = tmp;
-	ut_ext_types[ut_ext_types_count].name = name;
-	ut_ext_types[ut_ext_types_count].free = freefn;
-	ut_ext_types_count++;
+	et->name = name;
+	et->proto = proto;
+	et->free = freefn;
+	et->next = s->types;
+	s->types = et;
 
 	return true;
 }
@@ -367,7 +510,7 @@ ut_extended_type_to_string(struct json_object *v, struct printbuf *pb, int level
 	if (!op)
 		return 0;
 
-	et = &ut_ext_types[op->tag.type - 1];
+	et = op->tag.type;
 
 	return sprintbuf(pb, "%s<%s %p>%s", level ? "\"" : "", et->name, op->tag.data, level ? "\"" : "");
 }
@@ -381,44 +524,44 @@ ut_extended_type_free(struct json_object *v, void *ud)
 	if (!op)
 		return;
 
-	et = &ut_ext_types[op->tag.type - 1];
+	et = op->tag.type;
 
 	if (et->free && op->tag.data)
 		et->free(op->tag.data);
 
 	json_object_put(op->tag.proto);
-	free(ud);
+	ut_region_release(ud);
+
+	if (--et->live == 0 && et->orphaned)
+		free(et);
 }
 
 struct json_object *
-ut_set_extended_type(struct json_object *v, struct json_object *proto, const char *name, void *data)
+ut_set_extended_type(struct ut_state *s, struct json_object *v, const char *name, void *data)
 {
-	struct ut_extended_type *et = NULL;
+	struct ut_extended_type *et;
 	struct ut_op *op;
-	size_t n;
 
-	for (n = 0; n < ut_ext_types_count; n++) {
-		if (!strcmp(name, ut_ext_types[n].name)) {
-			et = &ut_ext_types[n];
+	for (et = s->types; et; et = et->next)
+		if (!strcmp(name, et->name))
 			break;
-		}
-	}
 
 	if (!et)
 		return NULL;
 
-	op = calloc(1, sizeof(*op));
+	op = ut_new_tag(s);
 
 	if (!op)
 		return NULL;
 
 	op->val = v;
 	op->type = T_RESSOURCE;
-	op->tag.proto = json_object_get(proto);
-	op->tag.type = n + 1;
+	op->tag.proto = json_object_get(et->proto);
+	op->tag.type = et;
 	op->tag.data = data;
 
 	json_object_set_serializer(op->val, ut_extended_type_to_string, op, ut_extended_type_free);
+	et->live++;
 
 	return op->val;
 }
@@ -427,13 +570,12 @@ void **
 ut_get_extended_type(struct json_object *v, const char *name)
 {
 	struct ut_op *op = json_object_get_userdata(v);
-	size_t n = op ? op->tag.type : 0;
 	struct ut_extended_type *et;
 
-	if (!op || op->type != T_RESSOURCE || n == 0 || n > ut_ext_types_count)
+	if (!op || op->type != T_RESSOURCE)
 		return NULL;
 
-	et = &ut_ext_types[n - 1];
+	et = op->tag.type;
 
 	if (name && strcmp(et->name, name))
 		return NULL;
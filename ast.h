@@ -20,6 +20,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 #ifdef JSONC
 	#include <json.h>
@@ -27,8 +28,14 @@
 	#include <json-c/json.h>
 #endif
 
+#include "output.h"
+
 #define UT_ERRMSG_OOM "Runtime error: Memory allocation failure"
 
+#define UT_DEFAULT_MAXDEPTH 255
+#define UT_STACK_RESERVE (128 * 1024)
+#define UT_SCOPE_POOLSIZE 16
+
 enum ut_error_type {
 	UT_ERROR_NO_ERROR,
 	UT_ERROR_OUT_OF_MEMORY,
@@ -59,28 +66,55 @@ struct ut_op {
 	uint16_t is_for_in:1;
 	uint32_t off;
 	struct json_object *val;
+	unsigned long hash;
 	union {
 		struct {
 			struct json_object *proto;
-			size_t type;
+			union {
+				struct ut_extended_type *type;
+				uint32_t decl;
+			};
 			void *data;
 		} tag;
 		struct {
 			uint32_t next;
+			uint32_t tail;
 			uint32_t operand[4];
 		} tree;
 	};
 };
 
+struct ut_function;
+struct ut_frame;
+struct ut_program;
+struct ut_profile;
+struct ut_format;
+struct ut_strbuf;
+struct ut_propcache;
+struct ut_region;
+
+struct ut_extended_type {
+	const char *name;
+	struct json_object *proto;
+	void (*free)(void *);
+	size_t live;
+	bool orphaned;
+	struct ut_extended_type *next;
+};
+
 struct ut_state {
 	struct ut_op *pool;
 	uint32_t poolsize;
+	uint32_t poolcap;
 	uint32_t main;
 	uint8_t semicolon_emitted:1;
 	uint8_t start_tag_seen:1;
 	uint8_t srand_called:1;
 	uint8_t trim_blocks:1;
 	uint8_t lstrip_blocks:1;
+	uint8_t walk_ast:1;
+	uint8_t memo_persist:1;
+	const char *cache_dir;
 	size_t off;
 	enum ut_block_type blocktype;
 	struct {
@@ -92,15 +126,49 @@ struct ut_state {
 	} error;
 	struct {
 		struct json_object **scope;
-		uint8_t size;
-		uint8_t off;
+		uint32_t size;
+		uint32_t off;
+		struct ut_frame **frames;
+		uint32_t nframes;
+		uint32_t framesize;
+		struct json_object *spare[UT_SCOPE_POOLSIZE];
+		uint8_t nspare;
+		uintptr_t limit;
+		pthread_t thread;
 	} stack;
+	uint32_t maxdepth;
 	struct json_object *ctx;
-};
-
-struct ut_extended_type {
-	const char *name;
-	void (*free)(void *);
+	struct json_object *modules;
+	struct ut_output output;
+	struct ut_extended_type *types;
+	struct ut_op exception_tag;
+	struct ut_region *tags;
+	struct ut_program *prog;
+	struct ut_profile *profile;
+	struct json_object **consts;
+	struct json_object *labels;
+	struct {
+		struct ut_format **cache;
+		uint32_t size;
+		struct ut_strbuf *buf;
+	} formats;
+	struct {
+		struct ut_propcache *entries;
+		uint32_t size;
+	} propcache;
+	struct {
+		struct json_object **tables;
+		uint32_t size;
+		uint32_t base;
+	} memo;
+	struct {
+		struct ut_function *funcs;
+		struct json_object *symbols;
+		uint32_t *index;
+		uint32_t nfuncs;
+		uint32_t ncaches;
+		uint32_t size;
+	} code;
 };
 
 struct ut_op *ut_get_op(struct ut_state *s, uint32_t off);
@@ -110,6 +178,21 @@ static inline uint32_t ut_get_off(struct ut_state *s, struct ut_op *op) {
 	return op ? (op - s->pool + 1) : 0;
 };
 
+/* limit of nested function calls, zero selects the default */
+static inline uint32_t ut_get_maxdepth(struct ut_state *s) {
+	return s->maxdepth ? s->maxdepth : UT_DEFAULT_MAXDEPTH;
+};
+
+/*
+ * Calls recurse on the C stack, so regardless of the configured depth they
+ * must stop when less than the reserve plus the given amount of it is left.
+ */
+static inline bool ut_stack_exhausted(struct ut_state *s, size_t need) {
+	char here;
+
+	return (s->stack.limit && (uintptr_t)&here < s->stack.limit + need);
+};
+
 static inline bool ut_is_type(struct json_object *val, int type) {
 	struct ut_op *tag = json_object_get_userdata(val);
 
@@ -122,13 +205,13 @@ uint32_t ut_append_op(struct ut_state *s, uint32_t a, uint32_t b);
 enum ut_error_type ut_parse(struct ut_state *s, const char *expr);
 void ut_free(struct ut_state *s);
 
-struct json_object *ut_new_func(struct ut_op *decl);
-struct json_object *ut_new_object(struct json_object *proto);
+struct json_object *ut_new_func(struct ut_state *s, uint32_t decl);
+struct json_object *ut_new_object(struct ut_state *s, struct json_object *proto);
 struct json_object *ut_new_double(double v);
 struct json_object *ut_new_null(void);
 
-bool ut_register_extended_type(const char *name, void (*freefn)(void *));
-struct json_object *ut_set_extended_type(struct json_object *v, struct json_object *proto, const char *name, void *data);
+bool ut_register_extended_type(struct ut_state *s, const char *name, struct json_object *proto, void (*freefn)(void *));
+struct json_object *ut_set_extended_type(struct ut_state *s, struct json_object *v, const char *name, void *data);
 void **ut_get_extended_type(struct json_object *val, const char *name);
 
 void *ParseAlloc(void *(*mfunc)(size_t));
@@ -0,0 +1,356 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "batch.h"
+#include "program.h"
+#include "eval.h"
+#include "lib.h"
+#include "cache.h"
+
+struct ut_batch_template {
+	struct ut_batch_template *next;
+	struct ut_program *prog;
+	char *path;
+	char *source;
+	size_t index;
+};
+
+struct ut_batch_job {
+	struct ut_batch_template *tpl;
+	struct json_object *context;
+	const char *output;
+};
+
+struct ut_batch {
+	struct ut_batch_template *templates;
+	struct ut_batch_job *jobs;
+	size_t ntemplates;
+	size_t njobs;
+	size_t next;
+	size_t failed;
+	mode_t mode;
+};
+
+static void
+job_error(const char *name, const char *fmt, ...)
+{
+	char *msg = NULL;
+	va_list ap;
+
+	va_start(ap, fmt);
+
+	if (vasprintf(&msg, fmt, ap) < 0)
+		msg = NULL;
+
+	va_end(ap);
+
+	/* a single call, so that messages of different workers do not mix */
+	fprintf(stderr, "%s: %s\n", name, msg ? msg : UT_ERRMSG_OOM);
+	free(msg);
+}
+
+static struct ut_batch_template *
+template_load(struct ut_state *opts, struct ut_batch *b, const char *name)
+{
+	struct ut_batch_template *tpl;
+	struct ut_state *s = NULL;
+	char path[PATH_MAX], *msg;
+	struct stat st;
+	uint32_t base;
+	FILE *fp;
+
+	if (!realpath(name, path) || stat(path, &st)) {
+		job_error(name, "Failed to open template: %s", strerror(errno));
+
+		return NULL;
+	}
+
+	for (tpl = b->templates; tpl; tpl = tpl->next)
+		if (!strcmp(tpl->path, path))
+			return tpl->prog ? tpl : NULL;
+
+	tpl = calloc(1, sizeof(*tpl));
+
+	if (!tpl || !(tpl->path = strdup(path)))
+		goto oom;
+
+	/* failed templates stay on the list so that they are reported once */
+	tpl->index = b->ntemplates++;
+	tpl->next = b->templates;
+	b->templates = tpl;
+
+	fp = fopen(path, "r");
+
+	if (!fp) {
+		job_error(name, "Failed to open template: %s", strerror(errno));
+
+		return NULL;
+	}
+
+	tpl->source = ut_read_file(fp, NULL);
+	fclose(fp);
+
+	if (!tpl->source)
+		goto oom;
+
+	s = calloc(1, sizeof(*s));
+
+	if (!s)
+		goto oom;
+
+	s->lstrip_blocks = opts->lstrip_blocks;
+	s->trim_blocks = opts->trim_blocks;
+	s->cache_dir = opts->cache_dir;
+	s->maxdepth = opts->maxdepth;
+
+	if (!ut_cache_load(s, path, &st)) {
+		base = s->poolsize;
+
+		if (ut_parse(s, tpl->source)) {
+			msg = ut_format_error(s, tpl->source);
+			job_error(name, "%s", msg);
+			free(msg);
+			ut_free(s);
+
+			return NULL;
+		}
+
+		ut_cache_store(s, path, &st, base);
+	}
+
+	tpl->prog = ut_program_new(s);
+
+	if (!tpl->prog)
+		goto oom;
+
+	return tpl;
+
+oom:
+	job_error(name, "%s", UT_ERRMSG_OOM);
+
+	if (tpl && !tpl->path)
+		free(tpl);
+
+	ut_free(s);
+
+	return NULL;
+}
+
+static bool
+job_render(struct ut_batch *b, struct ut_batch_job *job, struct ut_state *s)
+{
+	char *tmp, *msg;
+	bool ok;
+	int fd;
+
+	if (asprintf(&tmp, "%s.XXXXXX", job->output) < 0) {
+		job_error(job->output, "%s", UT_ERRMSG_OOM);
+
+		return false;
+	}
+
+	fd = mkostemp(tmp, O_CLOEXEC);
+
+	if (fd == -1) {
+		job_error(job->output, "Unable to create temporary file: %s", strerror(errno));
+		free(tmp);
+
+		return false;
+	}
+
+	fchmod(fd, b->mode);
+	ut_output_fd(&s->output, fd);
+
+	if (ut_run(s, job->context)) {
+		msg = ut_format_error(s, job->tpl->source);
+		job_error(job->output, "%s", msg);
+		free(msg);
+		ok = false;
+	}
+	else if (!ut_output_flush(&s->output) || close(fd)) {
+		job_error(job->output, "Unable to write file: %s", strerror(errno));
+		ok = false;
+		fd = -1;
+	}
+	else if (rename(tmp, job->output)) {
+		job_error(job->output, "Unable to replace file: %s", strerror(errno));
+		ok = false;
+	}
+	else {
+		ok = true;
+		fd = -1;
+	}
+
+	ut_output_free(&s->output);
+
+	if (!ok) {
+		if (fd != -1)
+			close(fd);
+
+		unlink(tmp);
+	}
+
+	free(tmp);
+
+	return ok;
+}
+
+/*
+ * Jobs are handed out through a shared counter, so a worker stuck with a
+ * slow template never holds back other jobs. Each worker keeps one context
+ * per template, which retains the modules it loaded across jobs.
+ */
+static void *
+worker(void *arg)
+{
+	struct ut_batch *b = arg;
+	struct ut_batch_job *job;
+	struct ut_state **ctxs;
+	size_t i;
+
+	ctxs = calloc(b->ntemplates, sizeof(*ctxs));
+
+	while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->njobs) {
+		job = &b->jobs[i];
+
+		if (!job->tpl)
+			continue;
+
+		if (!ctxs || (!ctxs[job->tpl->index] &&
+		              !(ctxs[job->tpl->index] = ut_context_new(job->tpl->prog)))) {
+			job_error(job->output, "%s", UT_ERRMSG_OOM);
+			__atomic_add_fetch(&b->failed, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		if (!job_render(b, job, ctxs[job->tpl->index]))
+			__atomic_add_fetch(&b->failed, 1, __ATOMIC_RELAXED);
+	}
+
+	for (i = 0; ctxs && i < b->ntemplates; i++)
+		ut_free(ctxs[i]);
+
+	free(ctxs);
+
+	return NULL;
+}
+
+int
+ut_batch_run(struct ut_state *opts, const char *manifest, unsigned int nthreads)
+{
+	struct json_object *jobs, *job, *tpl, *ctx, *out;
+	struct ut_batch_template *t;
+	struct ut_batch b = { 0 };
+	pthread_t *threads;
+	unsigned int n;
+	size_t i;
+	long ncpu;
+
+	jobs = json_object_from_file(manifest);
+
+	if (!json_object_is_type(jobs, json_type_array)) {
+		fprintf(stderr, "%s: Expecting an array of jobs\n", manifest);
+		json_object_put(jobs);
+
+		return UT_ERROR_EXCEPTION;
+	}
+
+	b.njobs = json_object_array_length(jobs);
+	b.jobs = calloc(b.njobs ? b.njobs : 1, sizeof(*b.jobs));
+	b.mode = umask(0);
+	umask(b.mode);
+	b.mode = 0666 & ~b.mode;
+
+	if (!b.jobs) {
+		fprintf(stderr, "%s\n", UT_ERRMSG_OOM);
+		json_object_put(jobs);
+
+		return UT_ERROR_OUT_OF_MEMORY;
+	}
+
+	/* parse all templates upfront, programs are immutable when shared */
+	for (i = 0; i < b.njobs; i++) {
+		job = json_object_array_get_idx(jobs, i);
+
+		if (!json_object_object_get_ex(job, "template", &tpl) ||
+		    !json_object_is_type(tpl, json_type_string) ||
+		    !json_object_object_get_ex(job, "output", &out) ||
+		    !json_object_is_type(out, json_type_string)) {
+			fprintf(stderr, "%s: Job #%zu lacks a template or output path\n", manifest, i + 1);
+			b.failed++;
+			continue;
+		}
+
+		if (!json_object_object_get_ex(job, "context", &ctx))
+			ctx = NULL;
+
+		b.jobs[i].output = json_object_get_string(out);
+		b.jobs[i].context = ctx;
+		b.jobs[i].tpl = template_load(opts, &b, json_object_get_string(tpl));
+
+		if (!b.jobs[i].tpl)
+			b.failed++;
+	}
+
+	if (!nthreads) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = (ncpu > 0) ? ncpu : 1;
+	}
+
+	if (nthreads > b.njobs)
+		nthreads = b.njobs ? b.njobs : 1;
+
+	threads = calloc(nthreads, sizeof(*threads));
+
+	for (n = 0; threads && n < nthreads; n++)
+		if (pthread_create(&threads[n], NULL, worker, &b))
+			break;
+
+	/* render on the calling thread if no worker could be started */
+	if (n == 0)
+		worker(&b);
+
+	while (n > 0)
+		pthread_join(threads[--n], NULL);
+
+	free(threads);
+
+	while (b.templates) {
+		t = b.templates;
+		b.templates = t->next;
+		ut_program_put(t->prog);
+		free(t->source);
+		free(t->path);
+		free(t);
+	}
+
+	free(b.jobs);
+	json_object_put(jobs);
+
+	return b.failed ? UT_ERROR_EXCEPTION : 0;
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __BATCH_H_
+#define __BATCH_H_
+
+#include "ast.h"
+
+/*
+ * Renders the jobs listed in the given manifest file, a JSON array of
+ * objects like
+ *
+ *   { "template": "/path/to/file", "context": { ... }, "output": "/path" }
+ *
+ * on the given number of worker threads, or one per CPU if zero. Every
+ * template is parsed once and shared by all of its jobs; each output file
+ * is replaced atomically once its rendering succeeded. The lexer and
+ * runtime options are taken from the given state.
+ */
+int ut_batch_run(struct ut_state *opts, const char *manifest, unsigned int nthreads);
+
+#endif /* __BATCH_H_ */
@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Lexer micro benchmark: tokenizes the given files the given amount of
+ * times without parsing them and reports the throughput.
+ *
+ *   ./lexbench [-n iterations] [-v] file...
+ *
+ * With -v, the token stream of each file is printed instead, which is
+ * useful to verify that changes to the lexer do not alter its output.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "../ast.h"
+#include "../lexer.h"
+
+static char *
+read_file(const char *path, size_t *len)
+{
+	char buf[1024], *tmp, *data = NULL;
+	size_t rlen;
+	FILE *fp;
+
+	*len = 0;
+	fp = fopen(path, "r");
+
+	if (!fp)
+		return NULL;
+
+	while ((rlen = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		tmp = realloc(data, *len + rlen + 1);
+
+		if (!tmp) {
+			free(data);
+			fclose(fp);
+
+			return NULL;
+		}
+
+		data = tmp;
+		memcpy(data + *len, buf, rlen);
+		*len += rlen;
+		data[*len] = 0;
+	}
+
+	fclose(fp);
+
+	return data;
+}
+
+static size_t
+tokenize(const char *source, bool verbose)
+{
+	struct ut_state *s = calloc(1, sizeof(*s));
+	const char *ptr = source;
+	int len = strlen(source);
+	size_t ntokens = 0;
+	struct ut_op *op;
+	int mlen = 0;
+	uint32_t off;
+
+	if (!s)
+		return 0;
+
+	s->lstrip_blocks = 1;
+	s->trim_blocks = 1;
+
+	while (len > 0) {
+		off = ut_get_token(s, ptr, &mlen);
+		op = ut_get_op(s, off);
+
+		if (mlen < 0 || s->error.code) {
+			if (verbose)
+				printf("error %d at %zu\n", mlen < 0 ? -mlen : s->error.code, s->off);
+
+			break;
+		}
+
+		if (op) {
+			if (verbose)
+				printf("%zu %s %s\n", (size_t)op->off,
+				       (op->type < __T_MAX && tokennames[op->type]) ? tokennames[op->type] : "?",
+				       op->val ? json_object_to_json_string(op->val) : "");
+
+			ntokens++;
+		}
+
+		len -= mlen;
+		ptr += mlen;
+	}
+
+	ut_free(s);
+
+	return ntokens;
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t i, len, nbytes = 0, ntokens = 0, iterations = 1000;
+	struct timespec start, end;
+	bool verbose = false;
+	char **sources;
+	double elapsed;
+	int opt, n;
+
+	while ((opt = getopt(argc, argv, "n:v")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'v':
+			verbose = true;
+			iterations = 1;
+			break;
+
+		default:
+			fprintf(stderr, "Usage: %s [-n iterations] [-v] file...\n", argv[0]);
+
+			return 1;
+		}
+	}
+
+	sources = calloc(argc, sizeof(*sources));
+
+	if (!sources)
+		return 1;
+
+	for (n = optind; n < argc; n++) {
+		sources[n] = read_file(argv[n], &len);
+
+		if (!sources[n]) {
+			fprintf(stderr, "Unable to read %s\n", argv[n]);
+
+			return 1;
+		}
+
+		nbytes += len;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < iterations; i++) {
+		for (n = optind; n < argc; n++) {
+			if (verbose)
+				printf("# %s\n", argv[n]);
+
+			ntokens += tokenize(sources[n], verbose);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	if (!verbose)
+		printf("%zu iterations, %zu bytes, %zu tokens in %.3fs: %.2f MB/s, %.1f ns/token\n",
+		       iterations, nbytes * iterations, ntokens, elapsed,
+		       (nbytes * iterations) / elapsed / 1e6,
+		       ntokens ? elapsed * 1e9 / ntokens : 0.0);
+
+	for (n = optind; n < argc; n++)
+		free(sources[n]);
+
+	free(sources);
+
+	return 0;
+}
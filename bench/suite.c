@@ -0,0 +1,526 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Benchmark suite: times the lexer, the parser and the execution of a set
+ * of representative workloads, including the fs and uci modules, and
+ * prints one JSON object per benchmark to stdout.
+ *
+ *   ./utplbench [-w] [-t seconds] [-L libdir] [name...]
+ *
+ * Each benchmark runs in a forked child so that its peak RSS can be told
+ * apart. Iterations are calibrated to take roughly the given time, one
+ * second by default. Besides the time and allocations per run, the amount
+ * of items a run produced is reported: tokens of the lexer, ops of the
+ * parser and output bytes of the workloads. With -w, workloads are run by the AST walker rather
+ * than the VM. Benchmarks are selected by name prefix, all by default.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "../ast.h"
+#include "../lexer.h"
+#include "../eval.h"
+#include "../lib.h"
+
+#define BENCH_ITEMS 5000
+
+struct bench {
+	const char *name;
+	bool (*setup)(struct bench *b);
+	size_t (*run)(struct bench *b);
+	const char *source;
+	struct ut_state *state;
+	char *template;
+	char *error;
+};
+
+static bool walk_ast;
+static const char *libdir = "./lib";
+static char tmpdir[] = "/tmp/utplbench.XXXXXX";
+static struct json_object *env;
+
+/*
+ * Count allocations by interposing the allocator, the libraries resolve
+ * malloc() and friends to these definitions as well.
+ */
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+static uint64_t nallocs;
+
+void *
+malloc(size_t size)
+{
+	nallocs++;
+
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	nallocs++;
+
+	return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	nallocs++;
+
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct ut_state *
+new_state(void)
+{
+	struct ut_state *s = calloc(1, sizeof(*s));
+
+	if (!s)
+		return NULL;
+
+	s->lstrip_blocks = 1;
+	s->trim_blocks = 1;
+	s->walk_ast = walk_ast;
+
+	return s;
+}
+
+/* a large template mixing text, expressions and statements */
+static bool
+setup_template(struct bench *b)
+{
+	/* the chunks are no format strings, the template is full of '%' */
+	const char *head =
+		"<tr class=\"{{ odd ? 'odd' : 'even' }}\">\n"
+		"  {% for (local i = 0; i < length(cols); i++): %}\n"
+		"    <td>{{ cols[i].name }}: {{ sprintf('%05d', cols[i].value * 2 + 1) }}</td>\n"
+		"  {% endfor %}\n"
+		"</tr>\n"
+		"{# a comment #}\n"
+		"{%\n"
+		"  function row_";
+	const char *tail =
+		"(a, b) {\n"
+		"    local x = { key: \"value\", list: [ 1, 2.5, true, null ] };\n"
+		"    if (a > b && !x.list[2]) return a - b; else return (a << 2) | b;\n"
+		"  }\n"
+		"%}\n";
+	size_t i, len = 0, size = strlen(head) + strlen(tail) + 16;
+	struct ut_state *s;
+
+	b->template = malloc(size * 500 + 1);
+
+	if (!b->template)
+		return false;
+
+	for (i = 0; i < 500; i++)
+		len += snprintf(b->template + len, size * 500 + 1 - len, "%s%zu%s", head, i, tail);
+
+	/* a template failing to parse would only measure the syntax error */
+	s = new_state();
+
+	if (!s || ut_parse(s, b->template)) {
+		b->error = s ? ut_format_error(s, b->template) : NULL;
+		ut_free(s);
+
+		return false;
+	}
+
+	ut_free(s);
+
+	return true;
+}
+
+static size_t
+run_lex(struct bench *b)
+{
+	struct ut_state *s = new_state();
+	const char *ptr = b->template;
+	int len = strlen(b->template);
+	size_t ntokens = 0;
+	int mlen = 0;
+	uint32_t off;
+
+	if (!s)
+		return 0;
+
+	while (len > 0) {
+		off = ut_get_token(s, ptr, &mlen);
+
+		if (mlen < 0 || s->error.code) {
+			fprintf(stderr, "%s: lexing failed at offset %zu\n",
+			        b->name, (size_t)(ptr - b->template));
+			exit(1);
+		}
+
+		if (off)
+			ntokens++;
+
+		len -= mlen;
+		ptr += mlen;
+	}
+
+	ut_free(s);
+
+	return ntokens;
+}
+
+static size_t
+run_parse(struct bench *b)
+{
+	struct ut_state *s = new_state();
+	size_t nops = 0;
+
+	if (!s || ut_parse(s, b->template) != UT_ERROR_NO_ERROR) {
+		fprintf(stderr, "%s: parsing failed\n", b->name);
+		exit(1);
+	}
+
+	nops = s->poolsize;
+	ut_free(s);
+
+	return nops;
+}
+
+static bool
+setup_script(struct bench *b)
+{
+	char *res = NULL;
+	size_t len;
+
+	b->state = new_state();
+
+	if (!b->state)
+		return false;
+
+	/* the first run compiles the functions and loads the modules */
+	if (ut_parse(b->state, b->source) || ut_render(b->state, env, &res, &len)) {
+		b->error = ut_format_error(b->state, b->source);
+		free(res);
+
+		return false;
+	}
+
+	free(res);
+
+	return true;
+}
+
+/* module benchmarks are reported as skipped if the module was not built */
+static bool
+setup_module(struct bench *b)
+{
+	const char *name = strchr(b->name, '.') + 1;
+	char path[512];
+
+	snprintf(path, sizeof(path), "%s/%s.so", libdir, name);
+
+	if (access(path, R_OK)) {
+		if (asprintf(&b->error, "module %s not available: %s", path, strerror(errno)) < 0)
+			b->error = NULL;
+
+		return false;
+	}
+
+	return setup_script(b);
+}
+
+static size_t
+run_script(struct bench *b)
+{
+	char *res = NULL;
+	size_t len = 0;
+
+	ut_render(b->state, env, &res, &len);
+	free(res);
+
+	return len;
+}
+
+static struct bench benchmarks[] = {
+	{ "lex.template", setup_template, run_lex },
+	{ "parse.template", setup_template, run_parse },
+	{ "run.arith", setup_script, run_script,
+		"{% local x = 0; for (local i = 0; i < 100000; i++) x = (x + i * 3) % 1000003; print(x); %}" },
+	{ "run.concat", setup_script, run_script,
+		"{% local s = ''; for (local i = 0; i < 10000; i++) s += 'item' + i + ','; print(length(s)); %}" },
+	{ "run.forin_object", setup_script, run_script,
+		"{%\n"
+		"  local o = {}, n = 0;\n"
+		"  for (local i = 0; i < 5000; i++) o['key' + i] = i;\n"
+		"  for (local r = 0; r < 10; r++) for (local k in o) n += o[k];\n"
+		"  print(n);\n"
+		"%}" },
+	{ "run.recursion", setup_script, run_script,
+		"{% function fib(n) { return n < 2 ? n : fib(n - 1) + fib(n - 2); } print(fib(20)); %}" },
+	{ "run.callbacks", setup_script, run_script,
+		"{%\n"
+		"  local a = [];\n"
+		"  for (local i = 0; i < 5000; i++) push(a, (i * 7919) % 5003);\n"
+		"  sort(a, function(x, y) { return x - y; });\n"
+		"  a = map(a, function(v) { return v * 2; });\n"
+		"  a = filter(a, function(v) { return v % 3; });\n"
+		"  print(length(a));\n"
+		"%}" },
+	{ "run.sprintf", setup_script, run_script,
+		"{% for (local i = 0; i < 2000; i++): %}"
+		"<td>{{ sprintf('%-10s %5d %8.2f %x', 'row' + i, i, i / 3.0, i) }}</td>\n"
+		"{% endfor %}" },
+	{ "module.fs", setup_module, run_script,
+		"{%\n"
+		"  local fs = require('fs'), n = 0;\n"
+		"  for (local l in fs.lines(BENCH_FILE)) n++;\n"
+		"  n += length(fs.readfile(BENCH_FILE));\n"
+		"  local f = fs.open(BENCH_FILE), d;\n"
+		"  while (length(d = f.read(4096)) > 0) n += length(d);\n"
+		"  f.close();\n"
+		"  print(n);\n"
+		"%}" },
+	{ "module.uci", setup_module, run_script,
+		"{%\n"
+		"  local uci = require('uci'), n = 0;\n"
+		"  local c = uci.cursor(BENCH_CONFDIR);\n"
+		"  for (local r = 0; r < 10; r++) {\n"
+		"    c.foreach('bench', 'item', function(s) { n += +s.value; });\n"
+		"    n += length(c.get_all('bench'));\n"
+		"    n += +c.get('bench', 's100', 'value');\n"
+		"  }\n"
+		"  c.unload('bench');\n"
+		"  print(n);\n"
+		"%}" },
+};
+
+/* a data file for the fs benchmark and a config for the uci one */
+static bool
+setup_env(void)
+{
+	struct json_object *path;
+	char buf[512];
+	FILE *fp;
+	int i;
+
+	if (!mkdtemp(tmpdir))
+		return false;
+
+	snprintf(buf, sizeof(buf), "%s/data", tmpdir);
+	fp = fopen(buf, "w");
+
+	if (!fp)
+		return false;
+
+	for (i = 0; i < BENCH_ITEMS; i++)
+		fprintf(fp, "line %d of the benchmark data with some padding text\n", i);
+
+	fclose(fp);
+
+	env = json_object_new_object();
+	json_object_object_add(env, "BENCH_FILE", json_object_new_string(buf));
+
+	snprintf(buf, sizeof(buf), "%s/bench", tmpdir);
+	fp = fopen(buf, "w");
+
+	if (!fp)
+		return false;
+
+	for (i = 0; i < BENCH_ITEMS / 10; i++)
+		fprintf(fp, "config item 's%d'\n\toption value '%d'\n\tlist tags 'a'\n\tlist tags 'b'\n\n", i, i);
+
+	fclose(fp);
+
+	json_object_object_add(env, "BENCH_CONFDIR", json_object_new_string(tmpdir));
+
+	snprintf(buf, sizeof(buf), "%s/*.so", libdir);
+	path = json_object_new_array();
+	json_object_array_add(path, json_object_new_string(buf));
+	json_object_object_add(env, "REQUIRE_SEARCH_PATH", path);
+
+	return true;
+}
+
+static void
+cleanup_env(void)
+{
+	char buf[512];
+
+	snprintf(buf, sizeof(buf), "%s/data", tmpdir);
+	unlink(buf);
+
+	snprintf(buf, sizeof(buf), "%s/bench", tmpdir);
+	unlink(buf);
+
+	rmdir(tmpdir);
+	json_object_put(env);
+}
+
+static void
+run_bench(struct bench *b, double seconds)
+{
+	struct json_object *res = json_object_new_object();
+	uint64_t start, elapsed, allocs = 0;
+	size_t i, n, items = 0;
+	struct rusage ru;
+
+	json_object_object_add(res, "name", json_object_new_string(b->name));
+	json_object_object_add(res, "mode", json_object_new_string(walk_ast ? "ast" : "vm"));
+
+	if (!b->setup(b)) {
+		json_object_object_add(res, "skipped",
+			json_object_new_string(b->error ? b->error : "setup failed"));
+
+		goto out;
+	}
+
+	/* calibrate on a single run, which also warms up the caches */
+	start = now();
+	b->run(b);
+	elapsed = now() - start;
+
+	n = elapsed ? (seconds * 1e9) / elapsed : 1000000;
+	n = n ? (n < 1000000 ? n : 1000000) : 1;
+
+#ifdef __GLIBC__
+	allocs = nallocs;
+#endif
+
+	start = now();
+
+	for (i = 0; i < n; i++)
+		items += b->run(b);
+
+	elapsed = now() - start;
+
+#ifdef __GLIBC__
+	allocs = nallocs - allocs;
+#endif
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	json_object_object_add(res, "iterations", json_object_new_int64(n));
+	json_object_object_add(res, "ns_per_op", json_object_new_int64(elapsed / n));
+	json_object_object_add(res, "items_per_op", json_object_new_int64(items / n));
+#ifdef __GLIBC__
+	json_object_object_add(res, "mallocs_per_op", json_object_new_int64(allocs / n));
+#endif
+	json_object_object_add(res, "peak_rss_kb", json_object_new_int64(ru.ru_maxrss));
+
+out:
+	printf("%s\n", json_object_to_json_string(res));
+	fflush(stdout);
+
+	json_object_put(res);
+	ut_free(b->state);
+	free(b->template);
+	free(b->error);
+}
+
+static bool
+selected(struct bench *b, int argc, char **argv)
+{
+	int i;
+
+	if (optind >= argc)
+		return true;
+
+	for (i = optind; i < argc; i++)
+		if (!strncmp(b->name, argv[i], strlen(argv[i])))
+			return true;
+
+	return false;
+}
+
+int
+main(int argc, char **argv)
+{
+	double seconds = 1.0;
+	int opt, status, rv = 0;
+	size_t i;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "wt:L:")) != -1) {
+		switch (opt) {
+		case 'w':
+			walk_ast = true;
+			break;
+
+		case 't':
+			seconds = strtod(optarg, NULL);
+			break;
+
+		case 'L':
+			libdir = optarg;
+			break;
+
+		default:
+			fprintf(stderr, "Usage: %s [-w] [-t seconds] [-L libdir] [name...]\n", argv[0]);
+
+			return 1;
+		}
+	}
+
+	if (!setup_env()) {
+		fprintf(stderr, "Unable to set up benchmark data in %s\n", tmpdir);
+		cleanup_env();
+
+		return 1;
+	}
+
+	for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+		if (!selected(&benchmarks[i], argc, argv))
+			continue;
+
+		pid = fork();
+
+		if (pid == 0) {
+			run_bench(&benchmarks[i], seconds);
+			_exit(0);
+		}
+
+		if (pid == -1 || waitpid(pid, &status, 0) == -1 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, "Benchmark %s failed\n", benchmarks[i].name);
+			rv = 1;
+		}
+	}
+
+	cleanup_env();
+
+	return rv;
+}
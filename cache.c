@@ -0,0 +1,423 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "cache.h"
+#include "lexer.h"
+#include "parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+
+/* bump whenever the layout of the AST produced by the parser changes */
+#define UT_CACHE_VERSION 1
+
+#define UT_CACHE_ALIGN(x) (((x) + 7) & ~7)
+
+enum ut_cache_val {
+	UT_CACHE_VAL_NONE,
+	UT_CACHE_VAL_STRING,
+	UT_CACHE_VAL_INT,
+	UT_CACHE_VAL_DOUBLE,
+	UT_CACHE_VAL_BOOL
+};
+
+enum ut_cache_op_flag {
+	UT_CACHE_OP_IS_OP       = (1 << 0),
+	UT_CACHE_OP_IS_OVERFLOW = (1 << 1),
+	UT_CACHE_OP_IS_POSTFIX  = (1 << 2),
+	UT_CACHE_OP_IS_FOR_IN   = (1 << 3)
+};
+
+enum ut_cache_flag {
+	UT_CACHE_LSTRIP_BLOCKS  = (1 << 0),
+	UT_CACHE_TRIM_BLOCKS    = (1 << 1)
+};
+
+/*
+ * File layout: header, source path padded to 8 bytes, op records and the
+ * string data referenced by them. All offsets between ops are relative to
+ * the first op of the cached program and get relocated on load.
+ */
+struct ut_cache_header {
+	char magic[4];
+	uint32_t version;
+	uint64_t tokens;
+	uint64_t size;
+	int64_t mtime;
+	int64_t mtime_nsec;
+	uint32_t flags;
+	uint32_t pathlen;
+	uint32_t nops;
+	uint32_t main;
+	uint64_t datalen;
+};
+
+struct ut_cache_op {
+	uint16_t type;
+	uint8_t flags;
+	uint8_t valtype;
+	uint32_t off;
+	uint32_t next;
+	uint32_t tail;
+	uint32_t operand[4];
+	union {
+		int64_t n;
+		double d;
+		struct {
+			uint32_t off;
+			uint32_t len;
+		} str;
+	} val;
+};
+
+/* fingerprint of the token numbering, which changes with the grammar */
+static uint64_t
+ut_cache_tokens(void)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	const char *p;
+	int i;
+
+	for (i = 0; i < __T_MAX; i++) {
+		h = (h ^ i) * 0x100000001b3ULL;
+
+		for (p = tokennames[i]; p && *p; p++)
+			h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+static uint32_t
+ut_cache_flags(struct ut_state *s)
+{
+	return (s->lstrip_blocks ? UT_CACHE_LSTRIP_BLOCKS : 0) |
+	       (s->trim_blocks ? UT_CACHE_TRIM_BLOCKS : 0);
+}
+
+static char *
+ut_cache_file(struct ut_state *s, const char *path, char **realp)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	char *file = NULL;
+	const char *p;
+
+	*realp = realpath(path, NULL);
+
+	if (!*realp)
+		return NULL;
+
+	for (p = *realp; *p; p++)
+		h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
+
+	if (asprintf(&file, "%s/%016" PRIx64 ".utplc", s->cache_dir, h) < 0) {
+		free(*realp);
+		*realp = NULL;
+
+		return NULL;
+	}
+
+	return file;
+}
+
+static bool
+ut_cache_check(struct ut_state *s, const char *map, size_t len, const char *realp,
+               const struct stat *st)
+{
+	const struct ut_cache_header *hdr = (const struct ut_cache_header *)map;
+	const struct ut_cache_op *ops;
+	uint32_t i, n, ref, *refs;
+	bool rv = false;
+	size_t opsoff;
+
+	if (len < sizeof(*hdr) ||
+	    memcmp(hdr->magic, "UTPC", 4) ||
+	    hdr->version != UT_CACHE_VERSION ||
+	    hdr->tokens != ut_cache_tokens() ||
+	    hdr->size != st->st_size ||
+	    hdr->mtime != st->st_mtim.tv_sec ||
+	    hdr->mtime_nsec != st->st_mtim.tv_nsec ||
+	    hdr->flags != ut_cache_flags(s) ||
+	    hdr->pathlen != strlen(realp) ||
+	    hdr->nops == 0 || hdr->main == 0 || hdr->main > hdr->nops)
+		return false;
+
+	opsoff = sizeof(*hdr) + UT_CACHE_ALIGN(hdr->pathlen);
+
+	if (len != opsoff + (size_t)hdr->nops * sizeof(*ops) + hdr->datalen ||
+	    memcmp(map + sizeof(*hdr), realp, hdr->pathlen))
+		return false;
+
+	ops = (const struct ut_cache_op *)(map + opsoff);
+
+	/* every op may be linked at most once and main not at all, so that
+	 * whatever is reachable from main is a tree and cannot loop */
+	refs = calloc(hdr->nops + 1, sizeof(*refs));
+
+	if (!refs)
+		return false;
+
+	refs[hdr->main] = 1;
+
+	for (i = 0; i < hdr->nops; i++) {
+		if (ops[i].type >= __T_MAX || ops[i].tail > hdr->nops)
+			goto out;
+
+		for (n = 0; n < 5; n++) {
+			ref = n ? ops[i].operand[n - 1] : ops[i].next;
+
+			if (ref > hdr->nops || (ref && refs[ref]++))
+				goto out;
+		}
+
+		if (ops[i].valtype > UT_CACHE_VAL_BOOL)
+			goto out;
+
+		if (ops[i].valtype == UT_CACHE_VAL_STRING &&
+		    (uint64_t)ops[i].val.str.off + ops[i].val.str.len > hdr->datalen)
+			goto out;
+	}
+
+	rv = true;
+
+out:
+	free(refs);
+
+	return rv;
+}
+
+static struct json_object *
+ut_cache_val(const struct ut_cache_op *cop, const char *data)
+{
+	switch (cop->valtype) {
+	case UT_CACHE_VAL_STRING:
+		return json_object_new_string_len(data + cop->val.str.off, cop->val.str.len);
+
+	case UT_CACHE_VAL_INT:
+		return json_object_new_int64(cop->val.n);
+
+	case UT_CACHE_VAL_DOUBLE:
+		return ut_new_double(cop->val.d);
+
+	case UT_CACHE_VAL_BOOL:
+		return json_object_new_boolean(cop->val.n);
+
+	default:
+		return NULL;
+	}
+}
+
+static uint32_t
+ut_cache_reloc(uint32_t off, uint32_t base)
+{
+	return off ? off + base : 0;
+}
+
+bool
+ut_cache_load(struct ut_state *s, const char *path, const struct stat *st)
+{
+	const struct ut_cache_header *hdr;
+	const struct ut_cache_op *ops;
+	char *file, *realp, *map;
+	uint32_t base, i, n;
+	struct stat cst;
+	bool rv = false;
+	struct ut_op *op;
+	int fd;
+
+	if (!s->cache_dir)
+		return false;
+
+	file = ut_cache_file(s, path, &realp);
+
+	if (!file)
+		return false;
+
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+
+	if (fd == -1 || fstat(fd, &cst) || cst.st_size == 0)
+		goto out;
+
+	map = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if (map == MAP_FAILED)
+		goto out;
+
+	if (ut_cache_check(s, map, cst.st_size, realp, st)) {
+		hdr = (const struct ut_cache_header *)map;
+		ops = (const struct ut_cache_op *)(map + sizeof(*hdr) + UT_CACHE_ALIGN(hdr->pathlen));
+		base = s->poolsize;
+
+		for (i = 0; i < hdr->nops; i++) {
+			op = ut_get_op(s, ut_new_op(s, ops[i].type,
+				ut_cache_val(&ops[i], (const char *)&ops[hdr->nops]), UINT32_MAX));
+
+			op->is_op = !!(ops[i].flags & UT_CACHE_OP_IS_OP);
+			op->is_overflow = !!(ops[i].flags & UT_CACHE_OP_IS_OVERFLOW);
+			op->is_postfix = !!(ops[i].flags & UT_CACHE_OP_IS_POSTFIX);
+			op->is_for_in = !!(ops[i].flags & UT_CACHE_OP_IS_FOR_IN);
+			op->off = ops[i].off;
+			op->tree.next = ut_cache_reloc(ops[i].next, base);
+			op->tree.tail = ut_cache_reloc(ops[i].tail, base);
+
+			for (n = 0; n < 4; n++)
+				op->tree.operand[n] = ut_cache_reloc(ops[i].operand[n], base);
+		}
+
+		s->main = hdr->main + base;
+		rv = true;
+	}
+
+	munmap(map, cst.st_size);
+
+out:
+	if (fd != -1)
+		close(fd);
+
+	free(realp);
+	free(file);
+
+	return rv;
+}
+
+static bool
+ut_cache_write(FILE *fp, const void *buf, size_t len)
+{
+	return (fwrite(buf, 1, len, fp) == len);
+}
+
+void
+ut_cache_store(struct ut_state *s, const char *path, const struct stat *st, uint32_t base)
+{
+	struct ut_cache_header hdr = { .magic = { 'U', 'T', 'P', 'C' }, .version = UT_CACHE_VERSION };
+	struct ut_cache_op cop;
+	char *file, *tmp = NULL, *realp;
+	const char pad[8] = { 0 };
+	struct json_object *val;
+	uint32_t i, n, dataoff = 0;
+	struct ut_op *op;
+	bool ok = true;
+	FILE *fp;
+
+	if (!s->cache_dir || s->main <= base)
+		return;
+
+	file = ut_cache_file(s, path, &realp);
+
+	if (!file)
+		return;
+
+	if (asprintf(&tmp, "%s.%d", file, (int)getpid()) < 0) {
+		tmp = NULL;
+		goto out;
+	}
+
+	mkdir(s->cache_dir, 0700);
+
+	fp = fopen(tmp, "w");
+
+	if (!fp)
+		goto out;
+
+	hdr.tokens = ut_cache_tokens();
+	hdr.size = st->st_size;
+	hdr.mtime = st->st_mtim.tv_sec;
+	hdr.mtime_nsec = st->st_mtim.tv_nsec;
+	hdr.flags = ut_cache_flags(s);
+	hdr.pathlen = strlen(realp);
+	hdr.nops = s->poolsize - base;
+	hdr.main = s->main - base;
+
+	for (i = base; i < s->poolsize; i++)
+		if (json_object_is_type(s->pool[i].val, json_type_string))
+			hdr.datalen += json_object_get_string_len(s->pool[i].val);
+
+	ok = ut_cache_write(fp, &hdr, sizeof(hdr)) &&
+	     ut_cache_write(fp, realp, hdr.pathlen) &&
+	     ut_cache_write(fp, pad, UT_CACHE_ALIGN(hdr.pathlen) - hdr.pathlen);
+
+	for (i = base; ok && i < s->poolsize; i++) {
+		op = &s->pool[i];
+		val = op->val;
+
+		memset(&cop, 0, sizeof(cop));
+
+		cop.type = op->type;
+		cop.flags = (op->is_op ? UT_CACHE_OP_IS_OP : 0) |
+		            (op->is_overflow ? UT_CACHE_OP_IS_OVERFLOW : 0) |
+		            (op->is_postfix ? UT_CACHE_OP_IS_POSTFIX : 0) |
+		            (op->is_for_in ? UT_CACHE_OP_IS_FOR_IN : 0);
+		cop.off = op->off;
+		cop.next = op->tree.next ? op->tree.next - base : 0;
+		cop.tail = op->tree.tail ? op->tree.tail - base : 0;
+
+		for (n = 0; n < 4; n++)
+			cop.operand[n] = op->tree.operand[n] ? op->tree.operand[n] - base : 0;
+
+		switch (val ? json_object_get_type(val) : json_type_null) {
+		case json_type_null:
+			cop.valtype = UT_CACHE_VAL_NONE;
+			break;
+
+		case json_type_string:
+			cop.valtype = UT_CACHE_VAL_STRING;
+			cop.val.str.off = dataoff;
+			cop.val.str.len = json_object_get_string_len(val);
+			dataoff += cop.val.str.len;
+			break;
+
+		case json_type_int:
+			cop.valtype = UT_CACHE_VAL_INT;
+			cop.val.n = json_object_get_int64(val);
+			break;
+
+		case json_type_double:
+			cop.valtype = UT_CACHE_VAL_DOUBLE;
+			cop.val.d = json_object_get_double(val);
+			break;
+
+		case json_type_boolean:
+			cop.valtype = UT_CACHE_VAL_BOOL;
+			cop.val.n = json_object_get_boolean(val);
+			break;
+
+		default:
+			ok = false;
+			break;
+		}
+
+		ok = ok && ut_cache_write(fp, &cop, sizeof(cop));
+	}
+
+	for (i = base; ok && i < s->poolsize; i++)
+		if (json_object_is_type(s->pool[i].val, json_type_string))
+			ok = ut_cache_write(fp, json_object_get_string(s->pool[i].val),
+			                    json_object_get_string_len(s->pool[i].val));
+
+	if (fclose(fp) || !ok || rename(tmp, file))
+		unlink(tmp);
+
+out:
+	free(realp);
+	free(file);
+	free(tmp);
+}
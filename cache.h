@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __CACHE_H_
+#define __CACHE_H_
+
+#include <sys/stat.h>
+
+#include "ast.h"
+
+/*
+ * Parsed programs are cached in the directory pointed to by s->cache_dir,
+ * one file per source path, and are valid as long as size and mtime of the
+ * source and the lexer options match.
+ */
+bool ut_cache_load(struct ut_state *s, const char *path, const struct stat *st);
+void ut_cache_store(struct ut_state *s, const char *path, const struct stat *st, uint32_t base);
+
+#endif /* __CACHE_H_ */
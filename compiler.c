@@ -0,0 +1,924 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "compiler.h"
+#include "parser.h"
+#include "program.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define UT_INSN_EFFECT(name, effect) effect,
+
+static const int8_t insn_effect[] = {
+	UT_INSNS(UT_INSN_EFFECT)
+};
+
+struct ut_loop {
+	struct ut_loop *parent;
+	uint32_t breaks;
+	uint32_t conts;
+};
+
+struct ut_compiler {
+	struct ut_state *s;
+	struct ut_insn *insns;
+	uint32_t ninsns;
+	uint32_t size;
+	int depth;
+	int maxdepth;
+	uint16_t iters;
+	uint16_t maxiters;
+	uint32_t *symbols;
+	uint16_t nslots;
+	uint16_t slotsize;
+	struct ut_loop *loop;
+	bool oom;
+};
+
+static void
+compile_expr(struct ut_compiler *c, uint32_t off);
+
+static void
+compile_block(struct ut_compiler *c, uint32_t off);
+
+static uint32_t
+emit(struct ut_compiler *c, enum ut_opcode code, uint8_t n, uint32_t arg, uint32_t off)
+{
+	struct ut_insn *tmp;
+
+	if (c->ninsns >= c->size) {
+		tmp = realloc(c->insns, (c->size ? c->size * 2 : 32) * sizeof(*tmp));
+
+		if (!tmp) {
+			c->oom = true;
+
+			return 0;
+		}
+
+		c->insns = tmp;
+		c->size = c->size ? c->size * 2 : 32;
+	}
+
+	c->insns[c->ninsns].code = code;
+	c->insns[c->ninsns].n = n;
+	c->insns[c->ninsns].slot = UT_NOSLOT;
+	c->insns[c->ninsns].arg = arg;
+	c->insns[c->ninsns].off = off;
+
+	c->depth += insn_effect[code];
+
+	if (c->depth > c->maxdepth)
+		c->maxdepth = c->depth;
+
+	return c->ninsns++;
+}
+
+static uint32_t
+symbol(struct ut_compiler *c, struct json_object *name)
+{
+	struct ut_state *ps = c->s->prog ? c->s->prog->state : NULL;
+	struct json_object *id;
+	uint32_t n;
+
+	if (!c->s->code.symbols) {
+		c->s->code.symbols = json_object_new_object();
+
+		if (!c->s->code.symbols) {
+			c->oom = true;
+
+			return 0;
+		}
+
+		/* functions compiled by a context must agree with the program on
+		 * the symbol numbering */
+		if (ps && ps->code.symbols) {
+			json_object_object_foreach(ps->code.symbols, k, v) {
+				if (json_object_object_add(c->s->code.symbols, k,
+				                           json_object_new_int64(json_object_get_int64(v))))
+					c->oom = true;
+			}
+		}
+	}
+
+	if (json_object_object_get_ex(c->s->code.symbols, json_object_get_string(name), &id))
+		return json_object_get_int64(id);
+
+	n = json_object_object_length(c->s->code.symbols);
+
+	if (json_object_object_add(c->s->code.symbols, json_object_get_string(name),
+	                           json_object_new_int64(n)))
+		c->oom = true;
+
+	return n;
+}
+
+static uint16_t
+slot_find(struct ut_compiler *c, uint32_t sym)
+{
+	uint16_t n;
+
+	for (n = 0; n < c->nslots; n++)
+		if (c->symbols[n] == sym)
+			return n;
+
+	return UT_NOSLOT;
+}
+
+static uint16_t
+slot_add(struct ut_compiler *c, struct ut_op *label)
+{
+	uint32_t sym = symbol(c, label->val);
+	uint16_t n = slot_find(c, sym);
+	uint32_t *tmp;
+
+	if (n != UT_NOSLOT)
+		return n;
+
+	if (c->nslots >= UT_NOSLOT - 1) {
+		c->oom = true;
+
+		return 0;
+	}
+
+	if (c->nslots >= c->slotsize) {
+		tmp = realloc(c->symbols, (c->slotsize ? c->slotsize * 2 : 8) * sizeof(*tmp));
+
+		if (!tmp) {
+			c->oom = true;
+
+			return 0;
+		}
+
+		c->symbols = tmp;
+		c->slotsize = c->slotsize ? c->slotsize * 2 : 8;
+	}
+
+	c->symbols[c->nslots] = sym;
+
+	return c->nslots++;
+}
+
+/* emit a variable access, resolving the label to a slot of the current frame */
+static uint32_t
+emit_var(struct ut_compiler *c, enum ut_opcode code, uint32_t label, uint32_t off)
+{
+	uint32_t sym = symbol(c, ut_get_op(c->s, label)->val);
+	uint32_t insn = emit(c, code, 0, sym, off);
+
+	if (!c->oom)
+		c->insns[insn].slot = slot_find(c, sym);
+
+	return insn;
+}
+
+/*
+ * Assign frame slots to all names declared by the function: parameters,
+ * local declarations, local for-in variables and named inner functions.
+ * Bodies of inner functions are not descended into since they get their
+ * own frame.
+ */
+static void
+collect_slots(struct ut_compiler *c, uint32_t off)
+{
+	struct ut_op *op, *as;
+	size_t i;
+
+	for (op = ut_get_op(c->s, off); op; op = ut_get_op(c->s, op->tree.next)) {
+		switch (op->type) {
+		case T_FUNC:
+			if (op->tree.operand[0])
+				slot_add(c, ut_get_op(c->s, op->tree.operand[0]));
+
+			continue;
+
+		case T_LOCAL:
+			for (as = ut_get_op(c->s, op->tree.operand[0]); as; as = ut_get_op(c->s, as->tree.next))
+				if ((as->type == T_ASSIGN || as->type == T_IN) &&
+				    ut_get_child(c->s, ut_get_off(c->s, as), 0) &&
+				    ut_get_child(c->s, ut_get_off(c->s, as), 0)->type == T_LABEL)
+					slot_add(c, ut_get_child(c->s, ut_get_off(c->s, as), 0));
+
+			break;
+
+		case T_TEXT:
+		case T_LABEL:
+		case T_STRING:
+		case T_NUMBER:
+		case T_DOUBLE:
+		case T_BOOL:
+			continue;
+		}
+
+		for (i = 0; i < sizeof(op->tree.operand) / sizeof(op->tree.operand[0]); i++)
+			if (op->tree.operand[i])
+				collect_slots(c, op->tree.operand[i]);
+	}
+}
+
+static void
+patch(struct ut_compiler *c, uint32_t insn)
+{
+	if (!c->oom)
+		c->insns[insn].arg = c->ninsns;
+}
+
+/* pending break and continue jumps are chained through their argument */
+static void
+patch_chain(struct ut_compiler *c, uint32_t chain, uint32_t target)
+{
+	uint32_t next;
+
+	while (chain && !c->oom) {
+		next = c->insns[chain - 1].arg;
+		c->insns[chain - 1].arg = target;
+		chain = next;
+	}
+}
+
+static enum ut_opcode
+binop_insn(int type)
+{
+	switch (type) {
+	case T_ADD:    return I_ADD;
+	case T_SUB:    return I_SUB;
+	case T_MUL:    return I_MUL;
+	case T_DIV:    return I_DIV;
+	case T_MOD:    return I_MOD;
+	case T_LSHIFT: return I_LSHIFT;
+	case T_RSHIFT: return I_RSHIFT;
+	case T_BAND:   return I_BAND;
+	case T_BXOR:   return I_BXOR;
+	case T_BOR:    return I_BOR;
+	case T_LT:     return I_LT;
+	case T_LE:     return I_LE;
+	case T_GT:     return I_GT;
+	case T_GE:     return I_GE;
+	case T_EQ:     return I_EQ;
+	case T_NE:     return I_NE;
+	case T_EQS:    return I_EQS;
+	case T_NES:    return I_NES;
+	default:       return I_IN;
+	}
+}
+
+/* compile a comma separated sequence, leaving the value of the last
+ * expression or the first exception on the stack */
+static void
+compile_seq(struct ut_compiler *c, uint32_t off)
+{
+	struct ut_op *op = ut_get_op(c->s, off);
+	uint32_t chain = 0, j;
+
+	if (!op) {
+		emit(c, I_NULL, 0, 0, 0);
+
+		return;
+	}
+
+	while (op) {
+		compile_expr(c, off);
+
+		off = op->tree.next;
+		op = ut_get_op(c->s, off);
+
+		if (op) {
+			j = emit(c, I_JEXC, 0, chain, 0);
+			chain = j + 1;
+			emit(c, I_POP, 0, 0, 0);
+		}
+	}
+
+	patch_chain(c, chain, c->ninsns);
+}
+
+static void
+compile_assign(struct ut_compiler *c, struct ut_op *op)
+{
+	uint32_t label = op->tree.operand[0];
+	uint32_t value = op->tree.operand[1];
+	struct ut_op *lhs = ut_get_op(c->s, label);
+	uint32_t j;
+
+	switch (lhs ? lhs->type : 0) {
+	case T_LABEL:
+		compile_expr(c, value);
+		emit_var(c, I_STORE, label, label);
+		break;
+
+	case T_DOT:
+		compile_expr(c, lhs->tree.operand[0]);
+		j = emit(c, I_CHKREF, 0, 0, label);
+		compile_expr(c, value);
+		emit(c, I_SETPROP, 0, 0, label);
+		patch(c, j);
+		break;
+
+	case T_LBRACK:
+		if (lhs->is_postfix) {
+			compile_expr(c, lhs->tree.operand[1]);
+			compile_expr(c, lhs->tree.operand[0]);
+			j = emit(c, I_CHKREF, 1, 0, label);
+			compile_expr(c, value);
+			emit(c, I_SETIDX, 0, 0, label);
+			patch(c, j);
+			break;
+		}
+
+		/* fall through */
+
+	default:
+		emit(c, I_RAISE, UT_RAISE_LHS, 0, label);
+		break;
+	}
+}
+
+static void
+compile_inc_dec(struct ut_compiler *c, uint32_t off, struct ut_op *op)
+{
+	uint32_t label = op->tree.operand[0];
+	struct ut_op *lhs = ut_get_op(c->s, label);
+
+	switch (lhs ? lhs->type : 0) {
+	case T_LABEL:
+		emit_var(c, I_INCDEC, label, off);
+		break;
+
+	case T_DOT:
+		compile_expr(c, lhs->tree.operand[0]);
+		emit(c, I_INCDEC_PROP, 0, 0, off);
+		break;
+
+	case T_LBRACK:
+		if (lhs->is_postfix) {
+			compile_expr(c, lhs->tree.operand[1]);
+			compile_expr(c, lhs->tree.operand[0]);
+			emit(c, I_INCDEC_IDX, 0, 0, off);
+			break;
+		}
+
+		/* fall through */
+
+	default:
+		emit(c, I_RAISE, UT_RAISE_LHS, 0, label);
+		break;
+	}
+}
+
+static void
+compile_local(struct ut_compiler *c, struct ut_op *op)
+{
+	struct ut_op *as = ut_get_op(c->s, op->tree.operand[0]);
+	bool pushed = false;
+
+	for (; as; as = ut_get_op(c->s, as->tree.next)) {
+		if (!as->tree.operand[0])
+			continue;
+
+		if (pushed)
+			emit(c, I_POP, 0, 0, 0);
+
+		compile_expr(c, as->tree.operand[1]);
+		emit_var(c, I_DECLARE, as->tree.operand[0], as->tree.operand[0]);
+		pushed = true;
+	}
+
+	if (!pushed)
+		emit(c, I_NULL, 0, 0, 0);
+}
+
+static void
+compile_expr(struct ut_compiler *c, uint32_t off)
+{
+	struct ut_op *op = ut_get_op(c->s, off);
+	struct ut_op *op1, *key, *val;
+	uint32_t j, j2;
+	bool method;
+	int depth;
+
+	if (!op) {
+		emit(c, I_NULL, 0, 0, 0);
+
+		return;
+	}
+
+	switch (op->type) {
+	case T_NUMBER:
+	case T_DOUBLE:
+	case T_BOOL:
+	case T_STRING:
+	case T_NULL:
+		emit(c, I_CONST, 0, 0, off);
+		break;
+
+	case T_THIS:
+		emit(c, I_THIS, 0, 0, off);
+		break;
+
+	case T_FUNC:
+		if (op->tree.operand[0])
+			emit_var(c, I_FUNC, op->tree.operand[0], off);
+		else
+			emit(c, I_FUNC, 0, 0, off);
+
+		break;
+
+	case T_LABEL:
+		emit_var(c, I_LOAD, off, off);
+		break;
+
+	case T_DOT:
+		compile_expr(c, op->tree.operand[0]);
+		emit(c, I_GETPROP, 0, c->s->code.ncaches++, off);
+		break;
+
+	case T_LBRACK:
+		if (op->is_postfix) {
+			compile_expr(c, op->tree.operand[1]);
+			compile_expr(c, op->tree.operand[0]);
+			emit(c, I_GETIDX, 0, 0, off);
+			break;
+		}
+
+		emit(c, I_ARRAY, 0, 0, off);
+
+		for (op1 = ut_get_op(c->s, op->tree.operand[0]); op1; op1 = ut_get_op(c->s, op1->tree.next)) {
+			compile_expr(c, ut_get_off(c->s, op1));
+			emit(c, I_APPEND, 0, 0, 0);
+		}
+
+		break;
+
+	case T_LBRACE:
+		emit(c, I_OBJECT, 0, 0, off);
+
+		for (key = ut_get_child(c->s, off, 0), val = ut_get_op(c->s, key ? key->tree.next : 0);
+		     key != NULL && val != NULL;
+		     key = ut_get_op(c->s, val->tree.next), val = ut_get_op(c->s, key ? key->tree.next : 0)) {
+			compile_expr(c, ut_get_off(c->s, val));
+			emit(c, I_SETKEY, 0, 0, ut_get_off(c->s, key));
+		}
+
+		break;
+
+	case T_ASSIGN:
+		compile_assign(c, op);
+		break;
+
+	case T_LOCAL:
+		compile_local(c, op);
+		break;
+
+	case T_INC:
+	case T_DEC:
+		compile_inc_dec(c, off, op);
+		break;
+
+	case T_LPAREN:
+		op1 = ut_get_op(c->s, op->tree.operand[0]);
+		method = (op1 && (op1->type == T_DOT || (op1->type == T_LBRACK && op1->is_postfix)));
+
+		/* only calls observe the object a member was read from */
+		if (method && op1->type == T_DOT) {
+			compile_expr(c, op1->tree.operand[0]);
+			emit(c, I_GETMETHOD, 0, c->s->code.ncaches++, op->tree.operand[0]);
+		}
+		else if (method) {
+			compile_expr(c, op1->tree.operand[1]);
+			compile_expr(c, op1->tree.operand[0]);
+			emit(c, I_GETMETHOD_IDX, 0, 0, op->tree.operand[0]);
+		}
+		else {
+			compile_expr(c, op->tree.operand[0]);
+		}
+
+		emit(c, I_ARRAY, 0, 0, off);
+
+		for (op1 = ut_get_op(c->s, op->tree.operand[1]); op1; op1 = ut_get_op(c->s, op1->tree.next)) {
+			compile_expr(c, ut_get_off(c->s, op1));
+			emit(c, I_APPEND, 0, 0, 0);
+		}
+
+		emit(c, method ? I_CALL_METHOD : I_CALL, 0, 0, off);
+		break;
+
+	case T_AND:
+	case T_OR:
+		compile_expr(c, op->tree.operand[0]);
+		j = emit(c, (op->type == T_OR) ? I_JTRUE_KEEP : I_JFALSE_KEEP, 0, 0, off);
+		compile_expr(c, op->tree.operand[1]);
+		patch(c, j);
+		break;
+
+	case T_QMARK:
+		compile_seq(c, op->tree.operand[0]);
+		j = emit(c, I_JFALSE, 0, 0, off);
+		depth = c->depth;
+		compile_seq(c, op->tree.operand[1]);
+		j2 = emit(c, I_JMP, 0, 0, off);
+		patch(c, j);
+		c->depth = depth;
+
+		if (op->tree.operand[2])
+			compile_seq(c, op->tree.operand[2]);
+		else
+			emit(c, I_NULL, 0, 0, 0);
+
+		patch(c, j2);
+		break;
+
+	case T_ADD:
+	case T_SUB:
+		if (!op->tree.operand[1]) {
+			op1 = ut_get_child(c->s, off, 0);
+			compile_expr(c, op->tree.operand[0]);
+			emit(c, (op->type == T_SUB) ? I_MINUS : I_PLUS, op1 ? op1->is_overflow : 0, 0, off);
+			break;
+		}
+
+		/* fall through */
+
+	case T_MUL:
+	case T_DIV:
+	case T_MOD:
+	case T_LSHIFT:
+	case T_RSHIFT:
+	case T_BAND:
+	case T_BXOR:
+	case T_BOR:
+	case T_LT:
+	case T_LE:
+	case T_GT:
+	case T_GE:
+	case T_EQ:
+	case T_NE:
+	case T_EQS:
+	case T_NES:
+	case T_IN:
+		compile_expr(c, op->tree.operand[0]);
+		compile_expr(c, op->tree.operand[1]);
+		emit(c, binop_insn(op->type), 0, 0, off);
+		break;
+
+	case T_COMPL:
+		compile_expr(c, op->tree.operand[0]);
+		emit(c, I_COMPL, 0, 0, off);
+		break;
+
+	case T_NOT:
+		compile_seq(c, op->tree.operand[0]);
+		emit(c, I_NOT, 0, 0, off);
+		break;
+
+	default:
+		emit(c, I_RAISE, UT_RAISE_OPCODE, 0, off);
+		break;
+	}
+}
+
+static void
+compile_loop_end(struct ut_compiler *c, struct ut_loop *loop, uint32_t cont)
+{
+	patch_chain(c, loop->conts, cont);
+	patch_chain(c, loop->breaks, c->ninsns);
+
+	c->loop = loop->parent;
+}
+
+static void
+compile_for_in(struct ut_compiler *c, uint32_t off, struct ut_op *op)
+{
+	struct ut_op *init = ut_get_child(c->s, off, 0);
+	struct ut_loop loop = { .parent = c->loop };
+	struct ut_op *ivar;
+	bool local = false;
+	uint32_t next, j;
+	uint16_t iter;
+
+	if (init && init->type == T_LOCAL) {
+		local = true;
+		init = ut_get_op(c->s, init->tree.operand[0]);
+	}
+
+	if (!init || init->type != T_IN) {
+		emit(c, I_RAISE, UT_RAISE_FORIN_INIT, 0, ut_get_off(c->s, init));
+		emit(c, I_STMT, 0, 0, 0);
+
+		return;
+	}
+
+	ivar = ut_get_op(c->s, init->tree.operand[0]);
+
+	if (!ivar || ivar->type != T_LABEL) {
+		emit(c, I_RAISE, UT_RAISE_FORIN_LHS, 0, ut_get_off(c->s, init));
+		emit(c, I_STMT, 0, 0, 0);
+
+		return;
+	}
+
+	compile_expr(c, init->tree.operand[1]);
+
+	iter = c->iters++;
+
+	if (c->iters > c->maxiters)
+		c->maxiters = c->iters;
+
+	emit_var(c, local ? I_FORIN_LOCAL : I_FORIN, init->tree.operand[0], init->tree.operand[0]);
+
+	if (!c->oom)
+		c->insns[c->ninsns - 1].n = iter;
+
+	next = c->ninsns;
+	j = emit(c, I_NEXT, iter, 0, off);
+
+	c->loop = &loop;
+	compile_block(c, op->tree.operand[3]);
+	emit(c, I_JMP, 0, next, 0);
+
+	patch(c, j);
+	compile_loop_end(c, &loop, next);
+
+	emit(c, I_FOREND, iter, 0, off);
+	emit(c, I_CLEAR, 0, 0, 0);
+
+	c->iters--;
+}
+
+static void
+compile_for(struct ut_compiler *c, uint32_t off, struct ut_op *op)
+{
+	struct ut_loop loop = { .parent = c->loop };
+	uint32_t test, cont, j = 0;
+
+	if (op->is_for_in) {
+		compile_for_in(c, off, op);
+
+		return;
+	}
+
+	if (op->tree.operand[0]) {
+		compile_seq(c, op->tree.operand[0]);
+		emit(c, I_POP, 0, 0, 0);
+	}
+
+	test = c->ninsns;
+
+	if (op->tree.operand[1]) {
+		compile_seq(c, op->tree.operand[1]);
+		j = emit(c, I_JFALSE, 0, 0, off) + 1;
+	}
+
+	c->loop = &loop;
+	compile_block(c, op->tree.operand[3]);
+
+	cont = c->ninsns;
+
+	if (op->tree.operand[2]) {
+		compile_seq(c, op->tree.operand[2]);
+		emit(c, I_POP, 0, 0, 0);
+	}
+
+	emit(c, I_JMP, 0, test, 0);
+
+	if (j)
+		patch(c, j - 1);
+
+	compile_loop_end(c, &loop, cont);
+	emit(c, I_CLEAR, 0, 0, 0);
+}
+
+static void
+compile_while(struct ut_compiler *c, uint32_t off, struct ut_op *op)
+{
+	struct ut_loop loop = { .parent = c->loop };
+	uint32_t test = c->ninsns, j = 0;
+
+	if (op->tree.operand[0]) {
+		compile_seq(c, op->tree.operand[0]);
+		j = emit(c, I_JFALSE, 0, 0, off) + 1;
+	}
+
+	c->loop = &loop;
+	compile_block(c, op->tree.operand[1]);
+	emit(c, I_JMP, 0, test, 0);
+
+	if (j)
+		patch(c, j - 1);
+
+	compile_loop_end(c, &loop, test);
+	emit(c, I_CLEAR, 0, 0, 0);
+}
+
+static void
+compile_stmt(struct ut_compiler *c, uint32_t off)
+{
+	struct ut_op *op = ut_get_op(c->s, off);
+	uint32_t j, j2;
+
+	switch (op->type) {
+	case T_TEXT:
+		emit(c, I_TEXT, 0, 0, off);
+		break;
+
+	case T_LEXP:
+		compile_seq(c, op->tree.operand[0]);
+		emit(c, I_PRINT, 0, 0, off);
+		break;
+
+	case T_IF:
+		compile_seq(c, op->tree.operand[0]);
+		j = emit(c, I_JFALSE, 0, 0, off);
+
+		if (op->tree.operand[1])
+			compile_block(c, op->tree.operand[1]);
+		else
+			emit(c, I_CLEAR, 0, 0, 0);
+
+		j2 = emit(c, I_JMP, 0, 0, off);
+		patch(c, j);
+
+		if (op->tree.operand[2])
+			compile_block(c, op->tree.operand[2]);
+		else
+			emit(c, I_CLEAR, 0, 0, 0);
+
+		patch(c, j2);
+		break;
+
+	case T_FOR:
+		compile_for(c, off, op);
+		break;
+
+	case T_WHILE:
+		compile_while(c, off, op);
+		break;
+
+	case T_RETURN:
+		compile_expr(c, op->tree.operand[0]);
+		emit(c, I_RETURN, 0, 0, off);
+		break;
+
+	case T_BREAK:
+	case T_CONTINUE:
+		if (c->loop) {
+			if (op->type == T_BREAK) {
+				j = emit(c, I_JMP, 0, c->loop->breaks, off);
+				c->loop->breaks = j + 1;
+			}
+			else {
+				j = emit(c, I_JMP, 0, c->loop->conts, off);
+				c->loop->conts = j + 1;
+			}
+
+			break;
+		}
+
+		emit(c, I_RAISE, UT_RAISE_LOOPCTL, 0, off);
+		emit(c, I_STMT, 0, 0, off);
+		break;
+
+	default:
+		compile_expr(c, off);
+		emit(c, I_STMT, 0, 0, off);
+		break;
+	}
+}
+
+static void
+compile_block(struct ut_compiler *c, uint32_t off)
+{
+	struct ut_op *op;
+
+	if (!off) {
+		emit(c, I_CLEAR, 0, 0, 0);
+
+		return;
+	}
+
+	while (off) {
+		compile_stmt(c, off);
+
+		op = ut_get_op(c->s, off);
+		off = op->tree.next;
+	}
+}
+
+struct ut_function *
+ut_compile(struct ut_state *s, uint32_t decl)
+{
+	struct ut_compiler c = { .s = s };
+	struct ut_op *op = ut_get_op(s, decl);
+	struct ut_function *fn, *tmp;
+	uint32_t *index, size, n;
+	uint16_t *params = NULL;
+	struct ut_op *arg;
+
+	if (!op)
+		return NULL;
+
+	/* functions of a shared program have been compiled in advance */
+	if (s->prog && decl <= s->prog->state->poolsize)
+		return ut_compile(s->prog->state, decl);
+
+	if (decl <= s->code.size && s->code.index[decl - 1])
+		return &s->code.funcs[s->code.index[decl - 1] - 1];
+
+	/* like symbols, inline caches of a context continue the program ones */
+	if (s->prog && s->code.ncaches < s->prog->state->code.ncaches)
+		s->code.ncaches = s->prog->state->code.ncaches;
+
+	if (decl > s->code.size) {
+		size = s->poolsize;
+		index = realloc(s->code.index, size * sizeof(*index));
+
+		if (!index)
+			return NULL;
+
+		memset(index + s->code.size, 0, (size - s->code.size) * sizeof(*index));
+
+		s->code.index = index;
+		s->code.size = size;
+	}
+
+	tmp = realloc(s->code.funcs, (s->code.nfuncs + 1) * sizeof(*tmp));
+
+	if (!tmp)
+		return NULL;
+
+	s->code.funcs = tmp;
+
+	for (n = 0, arg = ut_get_op(s, op->tree.operand[1]); arg; arg = ut_get_op(s, arg->tree.next))
+		n++;
+
+	if (n) {
+		params = calloc(n, sizeof(*params));
+
+		if (!params)
+			return NULL;
+	}
+
+	for (n = 0, arg = ut_get_op(s, op->tree.operand[1]); arg; arg = ut_get_op(s, arg->tree.next))
+		params[n++] = slot_add(&c, arg);
+
+	collect_slots(&c, op->tree.operand[2]);
+	compile_block(&c, op->tree.operand[2]);
+	emit(&c, I_END, 0, 0, decl);
+
+	if (c.oom) {
+		free(c.symbols);
+		free(c.insns);
+		free(params);
+
+		return NULL;
+	}
+
+	fn = &s->code.funcs[s->code.nfuncs++];
+	fn->decl = decl;
+	fn->ninsns = c.ninsns;
+	fn->maxstack = c.maxdepth;
+	fn->niters = c.maxiters;
+	fn->nslots = c.nslots;
+	fn->nparams = n;
+	fn->symbols = c.symbols;
+	fn->params = params;
+	fn->insns = c.insns;
+
+	s->code.index[decl - 1] = s->code.nfuncs;
+
+	return fn;
+}
+
+void
+ut_compiler_free(struct ut_state *s)
+{
+	uint32_t n;
+
+	for (n = 0; n < s->code.nfuncs; n++) {
+		free(s->code.funcs[n].symbols);
+		free(s->code.funcs[n].params);
+		free(s->code.funcs[n].insns);
+	}
+
+	free(s->code.funcs);
+	free(s->code.index);
+	json_object_put(s->code.symbols);
+
+	s->code.funcs = NULL;
+	s->code.index = NULL;
+	s->code.symbols = NULL;
+	s->code.nfuncs = 0;
+	s->code.size = 0;
+}
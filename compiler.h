@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __COMPILER_H_
+#define __COMPILER_H_
+
+#include "ast.h"
+
+/*
+ * Instruction set of the VM, listed as name and stack effect. The stack
+ * effect is the one of the fall-through path, conditional jumps which keep
+ * their operand on the taken path are balanced by the code they skip.
+ */
+#define UT_INSNS(X) \
+	X(NULL,          1)	/* push null */ \
+	X(CONST,         1)	/* push the value of op */ \
+	X(POP,          -1)	/* drop top of stack */ \
+	X(THIS,          1)	/* push the "this" context of the current function */ \
+	X(FUNC,          1)	/* push function value of op, declare it if named */ \
+	X(LOAD,          1)	/* push variable slot/symbol */ \
+	X(STORE,         0)	/* assign top of stack to variable slot/symbol */ \
+	X(DECLARE,       0)	/* assign top of stack to local variable slot */ \
+	X(GETPROP,       0)	/* replace object by its property named by op, using inline cache arg */ \
+	X(GETIDX,       -1)	/* replace key and object by the indexed value */ \
+	X(GETMETHOD,     1)	/* like GETPROP, keeping the object below as "this" context */ \
+	X(GETMETHOD_IDX, 0)	/* like GETIDX, keeping the object below as "this" context */ \
+	X(CHKREF,        0)	/* ensure top is an object or array, else raise and jump */ \
+	X(SETPROP,      -1)	/* object, value -> value */ \
+	X(SETIDX,       -2)	/* key, object, value -> value */ \
+	X(INCDEC,        1)	/* increment/decrement variable */ \
+	X(INCDEC_PROP,   0)	/* increment/decrement property of object */ \
+	X(INCDEC_IDX,   -1)	/* increment/decrement indexed value of object */ \
+	X(ADD,          -1) \
+	X(SUB,          -1) \
+	X(MUL,          -1) \
+	X(DIV,          -1) \
+	X(MOD,          -1) \
+	X(LSHIFT,       -1) \
+	X(RSHIFT,       -1) \
+	X(BAND,         -1) \
+	X(BXOR,         -1) \
+	X(BOR,          -1) \
+	X(LT,           -1) \
+	X(LE,           -1) \
+	X(GT,           -1) \
+	X(GE,           -1) \
+	X(EQ,           -1) \
+	X(NE,           -1) \
+	X(EQS,          -1) \
+	X(NES,          -1) \
+	X(IN,           -1) \
+	X(PLUS,          0) \
+	X(MINUS,         0) \
+	X(NOT,           0) \
+	X(COMPL,         0) \
+	X(ARRAY,         1)	/* push new array */ \
+	X(APPEND,       -1)	/* append top of stack to array below */ \
+	X(OBJECT,        1)	/* push new object */ \
+	X(SETKEY,       -1)	/* set key named by op in object below to top of stack */ \
+	X(CALL,         -1)	/* func, args -> result */ \
+	X(CALL_METHOD,  -2)	/* object, func, args -> result */ \
+	X(JMP,           0) \
+	X(JFALSE,       -1)	/* pop, jump if falsy */ \
+	X(JTRUE_KEEP,   -1)	/* jump keeping top if truish, else pop */ \
+	X(JFALSE_KEEP,  -1)	/* jump keeping top if falsy, else pop */ \
+	X(JEXC,          0)	/* jump keeping top if it is an exception */ \
+	X(TEXT,          0)	/* print template text of op */ \
+	X(PRINT,        -1)	/* pop and print expression block result */ \
+	X(STMT,         -1)	/* pop statement result, return it if exception */ \
+	X(CLEAR,         0)	/* reset statement result */ \
+	X(RAISE,         1)	/* push exception of kind n */ \
+	X(FORIN,        -1)	/* pop value into for-in iterator n */ \
+	X(FORIN_LOCAL,  -1)	/* pop value into for-in iterator n over local variable */ \
+	X(NEXT,          0)	/* advance iterator n or jump when exhausted */ \
+	X(FOREND,        0)	/* release iterator n */ \
+	X(RETURN,       -1)	/* pop and return */ \
+	X(END,           0)	/* return last statement result */
+
+#define UT_INSN_ENUM(name, effect) I_##name,
+
+enum ut_opcode {
+	UT_INSNS(UT_INSN_ENUM)
+	__I_MAX
+};
+
+enum ut_raise_kind {
+	UT_RAISE_OPCODE,
+	UT_RAISE_LHS,
+	UT_RAISE_LOOPCTL,
+	UT_RAISE_FORIN_INIT,
+	UT_RAISE_FORIN_LHS
+};
+
+#define UT_NOSLOT 0xffff
+
+/*
+ * Variable accesses carry the frame slot of the name within the current
+ * function, or UT_NOSLOT if the function never declares it, along with the
+ * program wide symbol id of the name used to resolve it in calling frames.
+ */
+struct ut_insn {
+	uint8_t code;
+	uint8_t n;
+	uint16_t slot;
+	uint32_t arg;
+	uint32_t off;
+};
+
+struct ut_function {
+	uint32_t decl;
+	uint32_t ninsns;
+	uint16_t maxstack;
+	uint16_t niters;
+	uint16_t nslots;
+	uint16_t nparams;
+	uint32_t *symbols;
+	uint16_t *params;
+	struct ut_insn *insns;
+};
+
+struct ut_function *ut_compile(struct ut_state *s, uint32_t decl);
+void ut_compiler_free(struct ut_state *s);
+
+#endif /* __COMPILER_H_ */
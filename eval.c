@@ -18,6 +18,11 @@
 #include "parser.h"
 #include "eval.h"
 #include "lib.h"
+#include "vm.h"
+#include "strbuf.h"
+#include "iter.h"
+#include "profile.h"
+#include "memo.h"
 
 #include <math.h>
 #include <ctype.h>
@@ -25,9 +30,6 @@
 #include <stdlib.h>
 #include <stdarg.h>
 
-char exception_tag_space[sizeof(struct ut_op) + sizeof(struct ut_op *)];
-static struct ut_op *exception_tag = (struct ut_op *)exception_tag_space;
-
 __attribute__((format(printf, 3, 0))) struct json_object *
 ut_exception(struct ut_state *state, uint32_t off, const char *fmt, ...)
 {
@@ -48,10 +50,10 @@ ut_exception(struct ut_state *state, uint32_t off, const char *fmt, ...)
 		free(s);
 	}
 
- 	exception_tag->type = T_EXCEPTION;
-	exception_tag->tree.operand[0] = off;
+	state->exception_tag.type = T_EXCEPTION;
+	state->exception_tag.tree.operand[0] = off;
 
-	json_object_set_userdata(msg, exception_tag, NULL);
+	json_object_set_userdata(msg, &state->exception_tag, NULL);
 
 	state->error.code = UT_ERROR_EXCEPTION;
 	state->error.info.exception = msg;
@@ -166,8 +168,8 @@ ut_cast_number(struct json_object *v, int64_t *n, double *d)
 	}
 }
 
-static struct json_object *
-ut_getscope(struct ut_state *state, uint8_t depth)
+struct json_object *
+ut_getscope(struct ut_state *state, uint32_t depth)
 {
 	if (depth >= state->stack.off)
 		return NULL;
@@ -179,21 +181,26 @@ static struct json_object *
 ut_addscope(struct ut_state *state, uint32_t decl)
 {
 	struct json_object *scope, **tmp;
+	uint32_t size;
 
-	if (state->stack.off >= 255)
+	if (state->stack.off >= ut_get_maxdepth(state) || ut_stack_exhausted(state, 0))
 		return ut_exception(state, decl, "Runtime error: Too much recursion");
 
 	if (state->stack.off >= state->stack.size) {
-		tmp = realloc(state->stack.scope, (state->stack.size + 1) * sizeof(*state->stack.scope));
+		size = state->stack.size ? state->stack.size * 2 : 8;
+		tmp = realloc(state->stack.scope, size * sizeof(*state->stack.scope));
 
 		if (!tmp)
 			return ut_exception(state, decl, UT_ERRMSG_OOM);
 
 		state->stack.scope = tmp;
-		state->stack.size++;
+		state->stack.size = size;
 	}
 
-	scope = ut_new_object(NULL);
+	if (state->stack.nspare > 0)
+		scope = state->stack.spare[--state->stack.nspare];
+	else
+		scope = ut_new_object(state, NULL);
 
 	if (!scope)
 		return ut_exception(state, decl, UT_ERRMSG_OOM);
@@ -203,6 +210,33 @@ ut_addscope(struct ut_state *state, uint32_t decl)
 	return scope;
 }
 
+/*
+ * Scopes nothing else refers to anymore are emptied and kept for reuse by
+ * subsequent calls, unless they grew beyond the initial table size.
+ */
+static void
+ut_dropscope(struct ut_state *state)
+{
+	struct json_object *scope = state->stack.scope[--state->stack.off];
+
+	state->stack.scope[state->stack.off] = NULL;
+
+	if (getrefcnt(scope) != 1 ||
+	    state->stack.nspare >= UT_SCOPE_POOLSIZE ||
+	    json_object_get_object(scope)->size > JSON_OBJECT_DEF_HASH_ENTRIES) {
+		json_object_put(scope);
+
+		return;
+	}
+
+	json_object_object_foreach(scope, key, val) {
+		(void)val;
+		json_object_object_del(scope, key);
+	}
+
+	state->stack.spare[state->stack.nspare++] = scope;
+}
+
 void
 ut_putval(struct json_object *val)
 {
@@ -217,7 +251,7 @@ ut_putval(struct json_object *val)
 static struct json_object *
 ut_execute_op(struct ut_state *state, uint32_t off);
 
-static char *
+char *
 ut_ref_to_str(struct ut_state *state, uint32_t off)
 {
 	struct ut_op *op = ut_get_op(state, off);
@@ -288,19 +322,63 @@ ut_ref_to_str(struct ut_state *state, uint32_t off)
 	}
 }
 
+/*
+ * Looks up the given key in an object, hashing it only if the hash is not
+ * known yet. Label ops carry the hash of their name, computed at parse time.
+ */
+static struct lh_entry *
+ut_lookup(struct json_object *obj, const char *key, unsigned long *hash)
+{
+	struct lh_table *t = json_object_get_object(obj);
+
+	if (!t)
+		return NULL;
+
+	if (!*hash)
+		*hash = lh_get_hash(t, key);
+
+	return lh_table_lookup_entry_w_hash(t, key, *hash);
+}
+
+struct json_object *
+ut_findscope(struct ut_state *state, const char *key, unsigned long hash)
+{
+	struct json_object *scope, *next;
+	uint32_t i = 0;
+
+	scope = ut_getscope(state, i);
+
+	while (true) {
+		if (ut_lookup(scope, key, &hash))
+			break;
+
+		next = ut_getscope(state, ++i);
+
+		if (!next)
+			break;
+
+		scope = next;
+	}
+
+	return scope;
+}
+
 static struct json_object *
-ut_getref(struct ut_state *state, uint32_t off, struct json_object **key)
+ut_getref(struct ut_state *state, uint32_t off, struct json_object **key, unsigned long *hash)
 {
 	struct ut_op *op = ut_get_op(state, off);
 	uint32_t off1 = op ? op->tree.operand[0] : 0;
 	uint32_t off2 = op ? op->tree.operand[1] : 0;
-	struct json_object *scope, *next;
-	uint8_t i;
+
+	*hash = 0;
 
 	if (op && op->type == T_DOT) {
 		if (key)
 			*key = off2 ? ut_get_op(state, off2)->val : NULL;
 
+		if (off2)
+			*hash = ut_get_op(state, off2)->hash;
+
 		return ut_execute_op(state, off1);
 	}
 	else if (op && op->type == T_LBRACK && op->is_postfix) {
@@ -310,25 +388,12 @@ ut_getref(struct ut_state *state, uint32_t off, struct json_object **key)
 		return ut_execute_op(state, off1);
 	}
 	else if (op && op->type == T_LABEL) {
-		i = 0;
-		scope = ut_getscope(state, i);
-
-		while (true) {
-			if (json_object_object_get_ex(scope, json_object_get_string(op->val), NULL))
-				break;
-
-			next = ut_getscope(state, ++i);
-
-			if (!next)
-				break;
-
-			scope = next;
-		}
-
 		if (key)
 			*key = op->val;
 
-		return json_object_get(scope);
+		*hash = op->hash;
+
+		return json_object_get(ut_findscope(state, json_object_get_string(op->val), op->hash));
 	}
 	else {
 		if (key)
@@ -338,41 +403,53 @@ ut_getref(struct ut_state *state, uint32_t off, struct json_object **key)
 	}
 }
 
-static struct json_object *
-ut_getref_required(struct ut_state *state, uint32_t off, struct json_object **key)
+struct json_object *
+ut_ref_exception(struct ut_state *state, uint32_t off)
 {
 	struct ut_op *op = ut_get_op(state, off);
 	uint32_t off1 = op ? op->tree.operand[0] : 0;
-	struct json_object *scope, *skey, *rv;
+	struct json_object *rv;
 	char *lhs;
 
-	scope = ut_getref(state, off, &skey);
+	lhs = off1 ? ut_ref_to_str(state, off1) : NULL;
 
-	if (!json_object_is_type(scope, json_type_array) &&
-		!json_object_is_type(scope, json_type_object)) {
-		lhs = off1 ? ut_ref_to_str(state, off1) : NULL;
+	if (lhs) {
+		rv = ut_exception(state, off1, "Type error: %s is null", lhs);
 
-		if (lhs) {
-			rv = ut_exception(state, off1, "Type error: %s is null", lhs);
+		free(lhs);
+	}
+	else {
+		rv = ut_exception(state, off,
+			"Syntax error: Invalid left-hand side operand %s", tokennames[op->type]);
+	}
 
-			free(lhs);
-		}
-		else {
-			rv = ut_exception(state, off,
-				"Syntax error: Invalid left-hand side operand %s", tokennames[op->type]);
-		}
+	return rv;
+}
+
+static struct json_object *
+ut_getref_required(struct ut_state *state, uint32_t off, struct json_object **key, unsigned long *hash)
+{
+	struct ut_op *op = ut_get_op(state, off);
+	struct json_object *scope, *skey;
+
+	scope = ut_getref(state, off, &skey, hash);
+
+	if (!json_object_is_type(scope, json_type_array) &&
+		!json_object_is_type(scope, json_type_object)) {
+		if (op && op->type == T_LBRACK && op->is_postfix)
+			json_object_put(skey);
 
 		json_object_put(scope);
 
 		*key = NULL;
-		return rv;
+		return ut_ref_exception(state, off);
 	}
 
 	*key = skey;
 	return scope;
 }
 
-static struct json_object *
+struct json_object *
 ut_getproto(struct json_object *obj)
 {
 	struct ut_op *op = json_object_get_userdata(obj);
@@ -383,10 +460,12 @@ ut_getproto(struct json_object *obj)
 	return op->tag.proto;
 }
 
-static struct json_object *
-ut_getval(struct json_object *scope, struct json_object *key)
+struct json_object *
+ut_getval(struct json_object *scope, struct json_object *key, unsigned long hash)
 {
-	struct json_object *o, *v;
+	struct lh_entry *e;
+	struct json_object *o;
+	const char *k;
 	int64_t idx;
 	double d;
 
@@ -414,20 +493,27 @@ ut_getval(struct json_object *scope, struct json_object *key)
 		return json_object_get(json_object_array_get_idx(scope, idx));
 	}
 
+	k = json_object_get_string(key);
+
 	for (o = scope; o; o = ut_getproto(o)) {
 		if (!json_object_is_type(o, json_type_object))
 			continue;
 
-		if (json_object_object_get_ex(o, key ? json_object_get_string(key) : "null", &v))
-			return json_object_get(v);
+		e = ut_lookup(o, k, &hash);
+
+		if (e)
+			return json_object_get(lh_entry_v(e));
 	}
 
 	return NULL;
 }
 
-static struct json_object *
-ut_setval(struct json_object *scope, struct json_object *key, struct json_object *val)
+struct json_object *
+ut_setval(struct json_object *scope, struct json_object *key, unsigned long hash, struct json_object *val)
 {
+	struct json_object *old;
+	struct lh_entry *e;
+	const char *k;
 	int64_t idx;
 
 	if (!key)
@@ -446,8 +532,18 @@ ut_setval(struct json_object *scope, struct json_object *key, struct json_object
 		return json_object_get(val);
 	}
 
-	if (json_object_object_add(scope, key ? json_object_get_string(key) : "null", val))
+	k = json_object_get_string(key);
+	e = json_object_is_type(scope, json_type_object) ? ut_lookup(scope, k, &hash) : NULL;
+
+	/* replace the value of existing keys in place, like json-c does */
+	if (e) {
+		old = lh_entry_v(e);
+		e->v = val;
+		json_object_put(old);
+	}
+	else if (json_object_object_add(scope, k, val)) {
 		return NULL;
+	}
 
 	return json_object_get(val);
 }
@@ -459,13 +555,14 @@ ut_execute_assign(struct ut_state *state, uint32_t off)
 	uint32_t label = op ? op->tree.operand[0] : 0;
 	uint32_t value = op ? op->tree.operand[1] : 0;
 	struct json_object *scope, *key, *val;
+	unsigned long hash;
 
-	scope = ut_getref_required(state, label, &key);
+	scope = ut_getref_required(state, label, &key, &hash);
 
 	if (!key)
 		return scope;
 
-	val = ut_setval(scope, key, ut_execute_op(state, value));
+	val = ut_setval(scope, key, hash, ut_execute_op(state, value));
 	ut_putval(scope);
 
 	return val;
@@ -483,7 +580,7 @@ ut_execute_local(struct ut_state *state, uint32_t off)
 
 		if (label)
 			rv = ut_setval(
-				ut_getscope(state, 0), label->val,
+				ut_getscope(state, 0), label->val, label->hash,
 				as->tree.operand[1] ? ut_execute_op(state, as->tree.operand[1]) : NULL);
 
 		as = ut_get_op(state, as->tree.next);
@@ -532,7 +629,9 @@ ut_execute_for(struct ut_state *state, uint32_t off)
 	struct ut_op *incr = ut_get_child(state, off, 2);
 	struct ut_op *body = ut_get_child(state, off, 3);
 	struct ut_op *ivar, *tag;
-	size_t arridx, arrlen;
+	unsigned long hash;
+	struct lh_entry *e;
+	struct ut_iter it;
 	bool local = false;
 
 	/* for (x in ...) loop variant */
@@ -553,59 +652,50 @@ ut_execute_for(struct ut_state *state, uint32_t off)
 			                    "Syntax error: invalid for-in left-hand side");
 
 		val = ut_execute_op(state, init->tree.operand[1]);
-		scope = local ? ut_getscope(state, 0) : ut_getref(state, ut_get_off(state, ivar), NULL);
+		scope = local ? json_object_get(ut_getscope(state, 0)) : ut_getref(state, ut_get_off(state, ivar), NULL, &hash);
 
-		if (json_object_is_type(val, json_type_array)) {
-			for (arridx = 0, arrlen = json_object_array_length(val);
-			     arridx < arrlen; arridx++) {
-				item = json_object_array_get_idx(val, arridx);
+		ut_iter_init(&it, val);
 
-				ut_setval(scope, ivar->val, item);
-				ut_putval(rv);
+		while (true) {
+			hash = ivar->hash;
+			e = ut_lookup(scope, json_object_get_string(ivar->val), &hash);
+			item = e ? lh_entry_v(e) : NULL;
 
-				rv = ut_execute_op_sequence(state, ut_get_off(state, body));
-				tag = json_object_get_userdata(rv);
+			if (!ut_iter_next(state, off, &it, item, &item))
+				break;
 
-				switch (tag ? tag->type : 0) {
-				case T_RETURN:
-				case T_EXCEPTION:
-					ut_putval(val);
+			if (ut_is_type(item, T_EXCEPTION)) {
+				ut_putval(rv);
+				rv = item;
+				goto out;
+			}
 
-					return rv;
+			ut_putval(ut_setval(scope, ivar->val, ivar->hash, item));
+			ut_putval(rv);
 
-				case T_BREAK:
-					ut_putval(val);
-					ut_putval(rv);
+			rv = ut_execute_op_sequence(state, ut_get_off(state, body));
+			tag = json_object_get_userdata(rv);
 
-					return NULL;
-				}
+			switch (tag ? tag->type : 0) {
+			case T_RETURN:
+			case T_EXCEPTION:
+			case T_BREAK:
+				goto out;
 			}
 		}
-		else if (json_object_is_type(val, json_type_object)) {
-			json_object_object_foreach(val, key, item) {
-				ut_setval(scope, ivar->val, json_object_new_string(key));
-				ut_putval(rv);
-
-				rv = ut_execute_op_sequence(state, ut_get_off(state, body));
-				tag = json_object_get_userdata(rv);
 
-				switch (tag ? tag->type : 0) {
-				case T_RETURN:
-				case T_EXCEPTION:
-					ut_putval(val);
-
-					return rv;
+out:
+		ut_iter_free(&it);
+		ut_putval(scope);
 
-				case T_BREAK:
-					ut_putval(val);
-					ut_putval(rv);
+		tag = json_object_get_userdata(rv);
 
-					return NULL;
-				}
-			}
+		switch (tag ? tag->type : 0) {
+		case T_RETURN:
+		case T_EXCEPTION:
+			return rv;
 		}
 
-		ut_putval(val);
 		ut_putval(rv);
 
 		return NULL;
@@ -760,17 +850,12 @@ ut_cmp(int how, struct json_object *v1, struct json_object *v2)
 	}
 }
 
-static struct json_object *
-ut_execute_rel(struct ut_state *state, uint32_t off)
+struct json_object *
+ut_rel(int type, struct json_object *v1, struct json_object *v2)
 {
-	struct ut_op *op = ut_get_op(state, off);
-	uint32_t off1 = op ? op->tree.operand[0] : 0;
-	uint32_t off2 = op ? op->tree.operand[1] : 0;
-	struct json_object *v1 = ut_execute_op(state, off1);
-	struct json_object *v2 = ut_execute_op(state, off2);
 	struct json_object *rv;
 
-	rv = json_object_new_boolean(ut_cmp(op->type, v1, v2));
+	rv = json_object_new_boolean(ut_cmp(type, v1, v2));
 
 	ut_putval(v1);
 	ut_putval(v2);
@@ -779,13 +864,20 @@ ut_execute_rel(struct ut_state *state, uint32_t off)
 }
 
 static struct json_object *
-ut_execute_equality(struct ut_state *state, uint32_t off)
+ut_execute_rel(struct ut_state *state, uint32_t off)
 {
 	struct ut_op *op = ut_get_op(state, off);
 	uint32_t off1 = op ? op->tree.operand[0] : 0;
 	uint32_t off2 = op ? op->tree.operand[1] : 0;
 	struct json_object *v1 = ut_execute_op(state, off1);
 	struct json_object *v2 = ut_execute_op(state, off2);
+
+	return ut_rel(op->type, v1, v2);
+}
+
+struct json_object *
+ut_equality(int type, struct json_object *v1, struct json_object *v2)
+{
 	struct ut_op *tag1 = json_object_get_userdata(v1);
 	struct ut_op *tag2 = json_object_get_userdata(v2);
 	enum json_type t1 = json_object_get_type(v1);
@@ -832,7 +924,7 @@ ut_execute_equality(struct ut_state *state, uint32_t off)
 		}
 	}
 
-	rv = json_object_new_boolean((op->type == T_EQS) ? equal : !equal);
+	rv = json_object_new_boolean((type == T_EQS) ? equal : !equal);
 
 	ut_putval(v1);
 	ut_putval(v2);
@@ -841,11 +933,20 @@ ut_execute_equality(struct ut_state *state, uint32_t off)
 }
 
 static struct json_object *
-ut_execute_in(struct ut_state *state, uint32_t off)
+ut_execute_equality(struct ut_state *state, uint32_t off)
 {
 	struct ut_op *op = ut_get_op(state, off);
-	struct json_object *op1 = ut_execute_op(state, op ? op->tree.operand[0] : 0);
-	struct json_object *op2 = ut_execute_op(state, op ? op->tree.operand[1] : 0);
+	uint32_t off1 = op ? op->tree.operand[0] : 0;
+	uint32_t off2 = op ? op->tree.operand[1] : 0;
+	struct json_object *v1 = ut_execute_op(state, off1);
+	struct json_object *v2 = ut_execute_op(state, off2);
+
+	return ut_equality(op->type, v1, v2);
+}
+
+struct json_object *
+ut_in(struct json_object *op1, struct json_object *op2)
+{
 	struct json_object *item;
 	size_t arrlen, arridx;
 	bool found = false;
@@ -874,29 +975,30 @@ ut_execute_in(struct ut_state *state, uint32_t off)
 }
 
 static struct json_object *
-ut_execute_inc_dec(struct ut_state *state, uint32_t off)
+ut_execute_in(struct ut_state *state, uint32_t off)
 {
 	struct ut_op *op = ut_get_op(state, off);
-	struct json_object *val, *nval, *scope, *key;
-	uint32_t label = op ? op->tree.operand[0] : 0;
-	int64_t n;
-	double d;
-
-	scope = ut_getref_required(state, label, &key);
+	struct json_object *op1 = ut_execute_op(state, op ? op->tree.operand[0] : 0);
+	struct json_object *op2 = ut_execute_op(state, op ? op->tree.operand[1] : 0);
 
-	if (!key)
-		return scope;
+	return ut_in(op1, op2);
+}
 
-	val = ut_getval(scope, key);
+struct json_object *
+ut_inc_dec(struct ut_op *op, struct json_object *scope, struct json_object *key, unsigned long hash)
+{
+	struct json_object *val, *nval;
+	int64_t n;
+	double d;
 
-	ut_putval(scope);
+	val = ut_getval(scope, key, hash);
 
 	if (ut_cast_number(val, &n, &d) == json_type_double)
 		nval = ut_new_double(d + (op->type == T_INC ? 1.0 : -1.0));
 	else
 		nval = json_object_new_int64(n + (op->type == T_INC ? 1 : -1));
 
-	ut_putval(ut_setval(scope, key, nval));
+	ut_putval(ut_setval(scope, key, hash, nval));
 
 	/* postfix inc/dec, return old val */
 	if (op->is_postfix)
@@ -907,6 +1009,26 @@ ut_execute_inc_dec(struct ut_state *state, uint32_t off)
 	return json_object_get(nval);
 }
 
+static struct json_object *
+ut_execute_inc_dec(struct ut_state *state, uint32_t off)
+{
+	struct ut_op *op = ut_get_op(state, off);
+	struct json_object *val, *scope, *key;
+	uint32_t label = op ? op->tree.operand[0] : 0;
+	unsigned long hash;
+
+	scope = ut_getref_required(state, label, &key, &hash);
+
+	if (!key)
+		return scope;
+
+	val = ut_inc_dec(op, scope, key, hash);
+
+	ut_putval(scope);
+
+	return val;
+}
+
 static struct json_object *
 ut_execute_list(struct ut_state *state, uint32_t off)
 {
@@ -927,7 +1049,7 @@ ut_execute_list(struct ut_state *state, uint32_t off)
 static struct json_object *
 ut_execute_object(struct ut_state *state, uint32_t off)
 {
-	struct json_object *obj = ut_new_object(NULL);
+	struct json_object *obj = ut_new_object(state, NULL);
 	struct ut_op *key, *val;
 
 	if (!obj)
@@ -943,13 +1065,13 @@ ut_execute_object(struct ut_state *state, uint32_t off)
 	return obj;
 }
 
-struct json_object *
-ut_invoke(struct ut_state *state, uint32_t off, struct json_object *scope,
-          struct json_object *func, struct json_object *argvals)
+static struct json_object *
+ut_invoke_func(struct ut_state *state, uint32_t off, struct json_object *scope,
+               struct json_object *func, struct json_object *argvals)
 {
 	struct ut_op *tag = json_object_get_userdata(func);
 	struct ut_op *arg, *decl;
-	struct json_object *s, *rv = NULL;
+	struct json_object *s, *val, *rv = NULL;
 	size_t arridx;
 	ut_c_fn *cfn;
 
@@ -963,7 +1085,11 @@ ut_invoke(struct ut_state *state, uint32_t off, struct json_object *scope,
 		return cfn ? cfn(state, off, argvals) : NULL;
 	}
 
-	decl = tag->tag.data;
+	decl = ut_get_op(state, tag->tag.decl);
+
+	if (!state->walk_ast)
+		return ut_vm_invoke(state, tag->tag.decl, argvals);
+
 	arg = ut_get_op(state, decl ? decl->tree.operand[1] : 0);
 
 	s = scope ? scope : ut_addscope(state, ut_get_off(state, decl));
@@ -972,7 +1098,7 @@ ut_invoke(struct ut_state *state, uint32_t off, struct json_object *scope,
 		return s;
 
 	for (arridx = 0; arg; arridx++, arg = ut_get_op(state, arg->tree.next))
-		ut_setval(s, arg->val, argvals ? json_object_array_get_idx(argvals, arridx) : NULL);
+		ut_setval(s, arg->val, arg->hash, argvals ? json_object_array_get_idx(argvals, arridx) : NULL);
 
 	/* store the function "this" context in the proto member of the scope tag structure */
 	tag = json_object_get_userdata(s);
@@ -991,14 +1117,9 @@ ut_invoke(struct ut_state *state, uint32_t off, struct json_object *scope,
 		break;
 
 	case T_RETURN:
-		/* handle magic null */
-		if (json_object_is_type(rv, json_type_boolean)) {
-			if (!strcmp(json_object_get_string(rv), "null")) {
-				ut_putval(rv);
-				rv = NULL;
-			}
-		}
-
+		val = json_object_get(json_object_array_get_idx(rv, 0));
+		ut_putval(rv);
+		rv = val;
 		break;
 	}
 
@@ -1007,24 +1128,113 @@ ut_invoke(struct ut_state *state, uint32_t off, struct json_object *scope,
 	json_object_put(tag->tag.proto);
 	tag->tag.proto = NULL;
 
-	if (!scope) {
-		state->stack.scope[--state->stack.off] = NULL;
-		json_object_put(s);
-	}
+	if (!scope)
+		ut_dropscope(state);
 
 	return rv;
 }
 
 static struct json_object *
-ut_execute_call(struct ut_state *state, uint32_t off)
+ut_invoke_profiled(struct ut_state *state, uint32_t off, struct json_object *scope,
+                   struct json_object *func, struct json_object *argvals)
+{
+	struct json_object *rv;
+
+	if (!state->profile || !ut_profile_enter(state, off, func))
+		return ut_invoke_func(state, off, scope, func, argvals);
+
+	rv = ut_invoke_func(state, off, scope, func, argvals);
+	ut_profile_leave(state);
+
+	return rv;
+}
+
+/*
+ * The output of memoized calls is collected separately while they run, so
+ * it can be remembered along with the value. Output of nested memoized
+ * calls thereby becomes part of the output of the outer one.
+ */
+static struct json_object *
+ut_invoke_memo(struct ut_state *state, uint32_t off, struct json_object *scope,
+               struct json_object *func, struct json_object *argvals, uint32_t decl)
+{
+	struct json_object *entry, *out, *rv;
+	struct ut_output output;
+	char *key, *buf;
+	size_t len;
+
+	key = ut_memo_key(argvals);
+
+	if (!key)
+		return ut_invoke_profiled(state, off, scope, func, argvals);
+
+	entry = ut_memo_lookup(state, decl, key);
+
+	if (entry) {
+		free(key);
+		out = json_object_array_get_idx(entry, 1);
+		ut_output_write(&state->output, json_object_get_string(out), json_object_get_string_len(out));
+
+		rv = ut_memo_result(state, entry);
+
+		if (!rv && json_object_array_get_idx(entry, 0))
+			return ut_exception(state, off, UT_ERRMSG_OOM);
+
+		return rv;
+	}
+
+	output = state->output;
+	memset(&state->output, 0, sizeof(state->output));
+	ut_output_memory(&state->output);
+
+	rv = ut_invoke_profiled(state, off, scope, func, argvals);
+
+	buf = state->output.error ? NULL : ut_output_steal(&state->output, &len);
+	ut_output_free(&state->output);
+	state->output = output;
+
+	if (!buf) {
+		free(key);
+		ut_putval(rv);
+
+		return ut_exception(state, off, UT_ERRMSG_OOM);
+	}
+
+	ut_output_write(&state->output, buf, len);
+
+	if (state->error.code == UT_ERROR_NO_ERROR)
+		ut_memo_store(state, decl, key, rv, buf, len);
+
+	free(key);
+	free(buf);
+
+	return rv;
+}
+
+struct json_object *
+ut_invoke(struct ut_state *state, uint32_t off, struct json_object *scope,
+          struct json_object *func, struct json_object *argvals)
+{
+	struct ut_op *tag = json_object_get_userdata(func);
+
+	if (tag && tag->type == T_FUNC && ut_memo_enabled(state, tag->tag.decl))
+		return ut_invoke_memo(state, off, scope, func, argvals, tag->tag.decl);
+
+	return ut_invoke_profiled(state, off, scope, func, argvals);
+}
+
+/*
+ * The "this" context is only borrowed for the duration of the call, whoever
+ * supplies it keeps it alive until the call returned.
+ */
+struct json_object *
+ut_call(struct ut_state *state, uint32_t off, struct json_object *ctx,
+        struct json_object *func, struct json_object *argvals)
 {
 	struct ut_op *op = ut_get_op(state, off);
 	uint32_t off1 = op ? op->tree.operand[0] : 0;
-	uint32_t off2 = op ? op->tree.operand[1] : 0;
-	struct json_object *func = ut_execute_op(state, off1);
 	struct ut_op *decl = func ? json_object_get_userdata(func) : NULL;
-	struct json_object *argvals = ut_execute_list(state, off2);
-	struct json_object *rv;
+	struct json_object *rv, *prev;
 	char *lhs;
 
 	if (!decl || (decl->type != T_FUNC && decl->type != T_CFUNC)) {
@@ -1036,7 +1246,10 @@ ut_execute_call(struct ut_state *state, uint32_t off)
 		free(lhs);
 	}
 	else {
+		prev = state->ctx;
+		state->ctx = ctx;
 		rv = ut_invoke(state, off, NULL, func, argvals);
+		state->ctx = prev;
 	}
 
 	ut_putval(argvals);
@@ -1045,8 +1258,61 @@ ut_execute_call(struct ut_state *state, uint32_t off)
 	return rv;
 }
 
+static struct json_object *
+ut_execute_call(struct ut_state *state, uint32_t off)
+{
+	struct ut_op *op = ut_get_op(state, off);
+	uint32_t off1 = op ? op->tree.operand[0] : 0;
+	uint32_t off2 = op ? op->tree.operand[1] : 0;
+	struct ut_op *callee = ut_get_op(state, off1);
+	struct json_object *ctx = NULL, *func, *key, *rv;
+	unsigned long hash;
+
+	/*
+	 * The object a member function was read from becomes its "this" context,
+	 * plain calls get the root scope, just like in the VM.
+	 */
+	switch (callee ? callee->type : 0) {
+	case T_LABEL:
+		ctx = json_object_get(state->stack.scope[0]);
+		func = ut_getval(ut_findscope(state, json_object_get_string(callee->val), callee->hash),
+		                 callee->val, callee->hash);
+		break;
+
+	case T_DOT:
+	case T_LBRACK:
+		if (callee->type == T_DOT || callee->is_postfix) {
+			ctx = ut_getref_required(state, off1, &key, &hash);
+
+			if (ut_is_type(ctx, T_EXCEPTION)) {
+				func = ctx;
+				ctx = NULL;
+				break;
+			}
+
+			func = ut_getval(ctx, key, hash);
+
+			if (callee->type == T_LBRACK)
+				ut_putval(key);
+
+			break;
+		}
+
+		/* fall through */
+
+	default:
+		func = ut_execute_op(state, off1);
+		break;
+	}
+
+	rv = ut_call(state, off, ctx, func, ut_execute_list(state, off2));
+	ut_putval(ctx);
+
+	return rv;
+}
+
 static void
-ut_write_str(struct json_object *v)
+ut_write_str(struct ut_state *state, struct json_object *v)
 {
 	const char *p;
 	size_t len;
@@ -1054,37 +1320,42 @@ ut_write_str(struct json_object *v)
 	p = v ? json_object_get_string(v) : "";
 	len = json_object_is_type(v, json_type_string) ? json_object_get_string_len(v) : strlen(p);
 
-	fwrite(p, 1, len, stdout);
+	ut_output_write(&state->output, p, len);
 }
 
-static struct json_object *
-ut_execute_exp(struct ut_state *state, uint32_t off)
+void
+ut_write_val(struct ut_state *state, struct json_object *val)
 {
-	struct ut_op *op = ut_get_op(state, off);
-	struct json_object *val = ut_execute_op_sequence(state, op ? op->tree.operand[0] : 0);
 	struct ut_op *tag = val ? json_object_get_userdata(val) : NULL;
 
 	switch (tag ? tag->type : 0) {
 	case T_EXCEPTION:
-		printf("<exception: %s>", json_object_get_string(val));
+		ut_output_write(&state->output, "<exception: ", 12);
+		ut_write_str(state, val);
+		ut_output_write(&state->output, ">", 1);
 		break;
 
 	default:
-		ut_write_str(val);
+		ut_write_str(state, val);
 		break;
 	}
 
 	ut_putval(val);
-
-	return NULL;
 }
 
 static struct json_object *
-ut_execute_unary_plus_minus(struct ut_state *state, uint32_t off)
+ut_execute_exp(struct ut_state *state, uint32_t off)
 {
 	struct ut_op *op = ut_get_op(state, off);
-	struct ut_op *op1 = ut_get_child(state, off, 0);
-	struct json_object *val = ut_execute_op(state, op ? op->tree.operand[0] : 0);
+
+	ut_write_val(state, ut_execute_op_sequence(state, op ? op->tree.operand[0] : 0));
+
+	return NULL;
+}
+
+struct json_object *
+ut_unary_arith(int type, bool overflow, struct json_object *val)
+{
 	enum json_type t;
 	int64_t n;
 	double d;
@@ -1095,57 +1366,48 @@ ut_execute_unary_plus_minus(struct ut_state *state, uint32_t off)
 
 	switch (t) {
 	case json_type_int:
-		if (op1->is_overflow)
-			return json_object_new_int64(((n >= 0) == (op->type == T_SUB)) ? INT64_MIN : INT64_MAX);
+		if (overflow)
+			return json_object_new_int64(((n >= 0) == (type == T_SUB)) ? INT64_MIN : INT64_MAX);
 
-		return json_object_new_int64((op->type == T_SUB) ? -n : n);
+		return json_object_new_int64((type == T_SUB) ? -n : n);
 
 	default:
-		return ut_new_double((op->type == T_SUB) ? -d : d);
+		return ut_new_double((type == T_SUB) ? -d : d);
 	}
 }
 
 static struct json_object *
-ut_execute_arith(struct ut_state *state, uint32_t off)
+ut_execute_unary_plus_minus(struct ut_state *state, uint32_t off)
 {
 	struct ut_op *op = ut_get_op(state, off);
-	struct json_object *v1, *v2, *rv;
+	struct ut_op *op1 = ut_get_child(state, off, 0);
+	struct json_object *val = ut_execute_op(state, op ? op->tree.operand[0] : 0);
+
+	return ut_unary_arith(op->type, op1->is_overflow, val);
+}
+
+struct json_object *
+ut_arith(int type, struct json_object *v1, struct json_object *v2)
+{
+	struct ut_strbuf *sb = NULL;
+	struct json_object *rv;
 	enum json_type t1, t2;
-	const char *s1, *s2;
-	size_t len1, len2;
 	int64_t n1, n2;
 	double d1, d2;
-	char *s;
-
-	if (!op->tree.operand[1])
-		return ut_execute_unary_plus_minus(state, off);
-
-	v1 = ut_execute_op(state, op ? op->tree.operand[0] : 0);
-	v2 = ut_execute_op(state, op ? op->tree.operand[1] : 0);
 
-	if (op->type == T_ADD &&
+	if (type == T_ADD &&
 	    (json_object_is_type(v1, json_type_string) ||
 	     json_object_is_type(v2, json_type_string))) {
-		s1 = v1 ? json_object_get_string(v1) : "null";
-		s2 = v2 ? json_object_get_string(v2) : "null";
-		len1 = strlen(s1);
-		len2 = strlen(s2);
-		s = calloc(1, len1 + len2 + 1);
-
-		if (!s) {
-			ut_putval(v1);
-			ut_putval(v2);
-
-			return NULL;
+		if (ut_strbuf_append_val(&sb, v1) && ut_strbuf_append_val(&sb, v2)) {
+			rv = ut_strbuf_finish(sb);
+		}
+		else {
+			ut_strbuf_put(sb);
+			rv = NULL;
 		}
-
-		snprintf(s, len1 + len2 + 1, "%s%s", s1, s2);
-
-		rv = json_object_new_string(s);
 
 		ut_putval(v1);
 		ut_putval(v2);
-		free(s);
 
 		return rv;
 	}
@@ -1160,7 +1422,7 @@ ut_execute_arith(struct ut_state *state, uint32_t off)
 		d1 = (t1 == json_type_double) ? d1 : (double)n1;
 		d2 = (t2 == json_type_double) ? d2 : (double)n2;
 
-		switch (op->type) {
+		switch (type) {
 		case T_ADD:
 			return ut_new_double(d1 + d2);
 
@@ -1185,7 +1447,7 @@ ut_execute_arith(struct ut_state *state, uint32_t off)
 		}
 	}
 
-	switch (op->type) {
+	switch (type) {
 	case T_ADD:
 		return json_object_new_int64(n1 + n2);
 
@@ -1209,18 +1471,26 @@ ut_execute_arith(struct ut_state *state, uint32_t off)
 }
 
 static struct json_object *
-ut_execute_bitop(struct ut_state *state, uint32_t off)
+ut_execute_arith(struct ut_state *state, uint32_t off)
 {
 	struct ut_op *op = ut_get_op(state, off);
-	uint32_t off1 = op ? op->tree.operand[0] : 0;
-	uint32_t off2 = op ? op->tree.operand[1] : 0;
 	struct json_object *v1, *v2;
+
+	if (!op->tree.operand[1])
+		return ut_execute_unary_plus_minus(state, off);
+
+	v1 = ut_execute_op(state, op ? op->tree.operand[0] : 0);
+	v2 = ut_execute_op(state, op ? op->tree.operand[1] : 0);
+
+	return ut_arith(op->type, v1, v2);
+}
+
+struct json_object *
+ut_bitop(int type, struct json_object *v1, struct json_object *v2)
+{
 	int64_t n1, n2;
 	double d;
 
-	v1 = off1 ? ut_execute_op(state, off1) : NULL;
-	v2 = off2 ? ut_execute_op(state, off2) : NULL;
-
 	if (ut_cast_number(v1, &n1, &d) == json_type_double)
 		n1 = isnan(d) ? 0 : (int64_t)d;
 
@@ -1230,7 +1500,7 @@ ut_execute_bitop(struct ut_state *state, uint32_t off)
 	ut_putval(v1);
 	ut_putval(v2);
 
-	switch (op->type) {
+	switch (type) {
 	case T_LSHIFT:
 		return json_object_new_int64(n1 << n2);
 
@@ -1252,19 +1522,30 @@ ut_execute_bitop(struct ut_state *state, uint32_t off)
 }
 
 static struct json_object *
-ut_execute_not(struct ut_state *state, uint32_t off)
+ut_execute_bitop(struct ut_state *state, uint32_t off)
 {
 	struct ut_op *op = ut_get_op(state, off);
+	uint32_t off1 = op ? op->tree.operand[0] : 0;
+	uint32_t off2 = op ? op->tree.operand[1] : 0;
+	struct json_object *v1, *v2;
 
-	return json_object_new_boolean(!ut_test_condition(state, op ? op->tree.operand[0] : 0));
+	v1 = off1 ? ut_execute_op(state, off1) : NULL;
+	v2 = off2 ? ut_execute_op(state, off2) : NULL;
+
+	return ut_bitop(op->type, v1, v2);
 }
 
 static struct json_object *
-ut_execute_compl(struct ut_state *state, uint32_t off)
+ut_execute_not(struct ut_state *state, uint32_t off)
 {
 	struct ut_op *op = ut_get_op(state, off);
-	uint32_t off1 = op ? op->tree.operand[0] : 0;
-	struct json_object *val = off1 ? ut_execute_op(state, off1) : NULL;
+
+	return json_object_new_boolean(!ut_test_condition(state, op ? op->tree.operand[0] : 0));
+}
+
+struct json_object *
+ut_compl(struct json_object *val)
+{
 	int64_t n;
 	double d;
 
@@ -1276,19 +1557,39 @@ ut_execute_compl(struct ut_state *state, uint32_t off)
 	return json_object_new_int64(~n);
 }
 
+static struct json_object *
+ut_execute_compl(struct ut_state *state, uint32_t off)
+{
+	struct ut_op *op = ut_get_op(state, off);
+	uint32_t off1 = op ? op->tree.operand[0] : 0;
+
+	return ut_compl(off1 ? ut_execute_op(state, off1) : NULL);
+}
+
 static struct json_object *
 ut_execute_return(struct ut_state *state, uint32_t off)
 {
 	struct ut_op *op = ut_get_op(state, off);
 	uint32_t off1 = op ? op->tree.operand[0] : 0;
 	struct json_object *val = off1 ? ut_execute_op(state, off1) : NULL;
+	struct json_object *rv;
 
-	if (!val)
-		val = ut_new_null();
+	if (ut_is_type(val, T_EXCEPTION))
+		return val;
 
-	json_object_set_userdata(val, op, NULL);
+	/* the value is passed up wrapped, tagging it would outlive the call */
+	rv = json_object_new_array();
 
-	return val;
+	if (!rv) {
+		ut_putval(val);
+
+		return ut_exception(state, off, UT_ERRMSG_OOM);
+	}
+
+	json_object_array_add(rv, val);
+	json_object_set_userdata(rv, op, NULL);
+
+	return rv;
 }
 
 static struct json_object *
@@ -1305,8 +1606,7 @@ ut_execute_break_cont(struct ut_state *state, uint32_t off)
 static struct json_object *
 ut_execute_function(struct ut_state *state, uint32_t off)
 {
-	struct ut_op *op = ut_get_op(state, off);
-	struct json_object *obj = ut_new_func(op);
+	struct json_object *obj = ut_new_func(state, off);
 
 	if (!obj)
 		return ut_exception(state, off, UT_ERRMSG_OOM);
@@ -1317,7 +1617,7 @@ ut_execute_function(struct ut_state *state, uint32_t off)
 static struct json_object *
 ut_execute_this(struct ut_state *state, uint32_t off)
 {
-	return ut_getproto(ut_getscope(state, 0));
+	return json_object_get(ut_getproto(ut_getscope(state, 0)));
 }
 
 static struct json_object *
@@ -1326,6 +1626,10 @@ ut_execute_op(struct ut_state *state, uint32_t off)
 	struct ut_op *op = ut_get_op(state, off);
 	struct ut_op *op1 = ut_get_child(state, off, 0);
 	struct json_object *scope, *key, *val;
+	unsigned long hash;
+
+	if (ut_profile_pending)
+		ut_profile_tick(state, off);
 
 	switch (op->type) {
 	case T_NUMBER:
@@ -1342,12 +1646,13 @@ ut_execute_op(struct ut_state *state, uint32_t off)
 		val = ut_execute_function(state, off);
 
 		if (op1)
-			ut_setval(ut_getscope(state, 0), op1->val, val);
+			ut_setval(ut_getscope(state, 0), op1->val, op1->hash, val);
 
 		return val;
 
 	case T_TEXT:
-		printf("%s", json_object_get_string(op->val));
+		ut_output_write(&state->output, json_object_get_string(op->val),
+		                json_object_get_string_len(op->val));
 
 		return NULL;
 
@@ -1358,26 +1663,17 @@ ut_execute_op(struct ut_state *state, uint32_t off)
 		return ut_execute_local(state, off);
 
 	case T_LABEL:
-		scope = ut_getref(state, off, &key);
-
-		ut_putval(state->ctx);
-		state->ctx = json_object_get(scope);
-
-		val = ut_getval(scope, key);
-		ut_putval(scope);
-
-		return val;
+		/* scopes are held by the stack, reading from them borrows them */
+		return ut_getval(ut_findscope(state, json_object_get_string(op->val), op->hash),
+		                 op->val, op->hash);
 
 	case T_DOT:
-		scope = ut_getref_required(state, off, &key);
-
-		ut_putval(state->ctx);
-		state->ctx = json_object_get(scope);
+		scope = ut_getref_required(state, off, &key, &hash);
 
-		if (!key)
+		if (ut_is_type(scope, T_EXCEPTION))
 			return scope;
 
-		val = ut_getval(scope, key);
+		val = ut_getval(scope, key, hash);
 		ut_putval(scope);
 
 		return val;
@@ -1385,16 +1681,14 @@ ut_execute_op(struct ut_state *state, uint32_t off)
 	case T_LBRACK:
 		/* postfix access */
 		if (op->is_postfix) {
-			scope = ut_getref_required(state, off, &key);
+			scope = ut_getref_required(state, off, &key, &hash);
 
-			ut_putval(state->ctx);
-			state->ctx = json_object_get(scope);
-
-			if (!key)
+			if (ut_is_type(scope, T_EXCEPTION))
 				return scope;
 
-			val = ut_getval(scope, key);
-			json_object_put(scope);
+			val = ut_getval(scope, key, hash);
+			ut_putval(scope);
+			ut_putval(key);
 
 			return val;
 		}
@@ -1526,12 +1820,45 @@ ut_globals_init(struct ut_state *state, struct json_object *scope)
 	json_object_object_add(scope, "REQUIRE_SEARCH_PATH", arr);
 }
 
+/* find the end of the stack of the thread running the state */
+static void
+ut_stack_init(struct ut_state *state)
+{
+	pthread_t self = pthread_self();
+	pthread_attr_t attr;
+	size_t size;
+	void *addr;
+
+	if (state->stack.limit && pthread_equal(state->stack.thread, self))
+		return;
+
+	state->stack.limit = 0;
+	state->stack.thread = self;
+
+	if (pthread_getattr_np(self, &attr))
+		return;
+
+	if (!pthread_attr_getstack(&attr, &addr, &size) && size > UT_STACK_RESERVE)
+		state->stack.limit = (uintptr_t)addr + UT_STACK_RESERVE;
+
+	pthread_attr_destroy(&attr);
+}
+
 enum ut_error_type
-ut_run(struct ut_state *state)
+ut_run(struct ut_state *state, struct json_object *env)
 {
 	struct ut_op *op = ut_get_op(state, state->main);
 	struct json_object *entry, *scope, *args, *rv;
 
+	/* forget the outcome of a previous run of the same program */
+	if (state->error.code == UT_ERROR_EXCEPTION)
+		json_object_put(state->error.info.exception);
+
+	memset(&state->error, 0, sizeof(state->error));
+
+	ut_memo_reset(state);
+	ut_stack_init(state);
+
 	if (!op || op->type != T_FUNC) {
 		ut_exception(state, state->main, "Runtime error: Invalid root operation in AST");
 
@@ -1553,6 +1880,11 @@ ut_run(struct ut_state *state)
 	ut_globals_init(state, scope);
 	ut_lib_init(state, scope);
 
+	if (json_object_is_type(env, json_type_object)) {
+		json_object_object_foreach(env, key, val)
+			json_object_object_add(scope, key, json_object_get(val));
+	}
+
 	args = json_object_new_array();
 	rv = ut_invoke(state, state->main, NULL, entry, args);
 
@@ -1560,5 +1892,37 @@ ut_run(struct ut_state *state)
 	json_object_put(args);
 	json_object_put(rv);
 
+	state->stack.scope[--state->stack.off] = NULL;
+	json_object_put(scope);
+
+	state->ctx = NULL;
+
+	ut_output_flush(&state->output);
+
 	return state->error.code;
 }
+
+enum ut_error_type
+ut_render(struct ut_state *state, struct json_object *env, char **res, size_t *reslen)
+{
+	struct ut_output output;
+	enum ut_error_type err;
+
+	ut_output_flush(&state->output);
+
+	output = state->output;
+	memset(&state->output, 0, sizeof(state->output));
+	ut_output_memory(&state->output);
+
+	err = ut_run(state, env);
+
+	*res = ut_output_steal(&state->output, reslen);
+
+	if (!*res && !err)
+		err = UT_ERROR_OUT_OF_MEMORY;
+
+	ut_output_free(&state->output);
+	state->output = output;
+
+	return err;
+}
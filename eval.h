@@ -39,10 +39,71 @@ ut_val_is_truish(struct json_object *val);
 enum json_type
 ut_cast_number(struct json_object *v, int64_t *n, double *d);
 
+struct json_object *
+ut_getscope(struct ut_state *state, uint32_t depth);
+
+struct json_object *
+ut_findscope(struct ut_state *state, const char *key, unsigned long hash);
+
+struct json_object *
+ut_getproto(struct json_object *obj);
+
+struct json_object *
+ut_getval(struct json_object *scope, struct json_object *key, unsigned long hash);
+
+struct json_object *
+ut_setval(struct json_object *scope, struct json_object *key, unsigned long hash, struct json_object *val);
+
+char *
+ut_ref_to_str(struct ut_state *state, uint32_t off);
+
+struct json_object *
+ut_ref_exception(struct ut_state *state, uint32_t off);
+
+/* value operations shared by the AST walker and the VM, operands are consumed */
+struct json_object *
+ut_arith(int type, struct json_object *v1, struct json_object *v2);
+
+struct json_object *
+ut_unary_arith(int type, bool overflow, struct json_object *val);
+
+struct json_object *
+ut_bitop(int type, struct json_object *v1, struct json_object *v2);
+
+struct json_object *
+ut_compl(struct json_object *val);
+
+struct json_object *
+ut_rel(int type, struct json_object *v1, struct json_object *v2);
+
+struct json_object *
+ut_equality(int type, struct json_object *v1, struct json_object *v2);
+
+struct json_object *
+ut_in(struct json_object *op1, struct json_object *op2);
+
+struct json_object *
+ut_inc_dec(struct ut_op *op, struct json_object *scope, struct json_object *key, unsigned long hash);
+
+struct json_object *
+ut_call(struct ut_state *state, uint32_t off, struct json_object *ctx,
+        struct json_object *func, struct json_object *argvals);
+
+void
+ut_write_val(struct ut_state *state, struct json_object *val);
+
 struct json_object *
 ut_invoke(struct ut_state *, uint32_t, struct json_object *, struct json_object *, struct json_object *);
 
 enum ut_error_type
-ut_run(struct ut_state *state);
+ut_run(struct ut_state *state, struct json_object *env);
+
+/*
+ * Runs the already parsed program of the given state and returns its output
+ * in a newly allocated, zero terminated buffer. The members of env, if given,
+ * are made available as global variables. The state can be rendered again.
+ */
+enum ut_error_type
+ut_render(struct ut_state *state, struct json_object *env, char **res, size_t *reslen);
 
 #endif
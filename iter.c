@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "iter.h"
+#include "eval.h"
+#include "lexer.h"
+#include "parser.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct json_object *
+ut_range_new(struct ut_state *s, int64_t start, int64_t end, int64_t step)
+{
+	struct json_object *v = json_object_new_object();
+	struct ut_range *r = calloc(1, sizeof(*r));
+
+	if (!v || !r || !ut_set_extended_type(s, v, "range", r)) {
+		json_object_put(v);
+		free(r);
+
+		return NULL;
+	}
+
+	r->start = start;
+	r->end = end;
+	r->step = step;
+
+	return v;
+}
+
+static bool
+ut_iter_init_ressource(struct ut_iter *it, struct json_object *val)
+{
+	struct ut_range **r = (struct ut_range **)ut_get_extended_type(val, "range");
+	struct json_object *o, *fn;
+
+	if (r && *r) {
+		it->type = UT_ITER_RANGE;
+		it->pos = (*r)->start;
+		it->end = (*r)->end;
+		it->step = (*r)->step;
+
+		return true;
+	}
+
+	for (o = val; o; o = ut_getproto(o)) {
+		if (!json_object_object_get_ex(o, "next", &fn))
+			continue;
+
+		if (!ut_is_type(fn, T_FUNC) && !ut_is_type(fn, T_CFUNC))
+			return false;
+
+		it->args = json_object_new_array();
+
+		if (!it->args)
+			return false;
+
+		it->type = UT_ITER_CALL;
+		it->fn = json_object_get(fn);
+
+		return true;
+	}
+
+	return false;
+}
+
+/* takes over the reference of the given value */
+void
+ut_iter_init(struct ut_iter *it, struct json_object *val)
+{
+	memset(it, 0, sizeof(*it));
+
+	it->val = val;
+
+	if (json_object_is_type(val, json_type_array)) {
+		it->type = UT_ITER_ARRAY;
+		it->len = json_object_array_length(val);
+	}
+	else if (json_object_is_type(val, json_type_object)) {
+		if (ut_is_type(val, T_RESSOURCE) && ut_iter_init_ressource(it, val))
+			return;
+
+		it->type = UT_ITER_OBJECT;
+		it->next = json_object_get_object(val)->head;
+	}
+}
+
+bool
+ut_iter_next_int(struct ut_iter *it, int64_t *n)
+{
+	if (it->type != UT_ITER_RANGE)
+		return false;
+
+	if (it->step > 0 ? it->pos >= it->end : it->pos <= it->end)
+		return false;
+
+	*n = it->pos;
+
+	if (__builtin_add_overflow(it->pos, it->step, &it->pos))
+		it->type = UT_ITER_NONE;
+
+	return true;
+}
+
+/*
+ * The value produced by the previous step may be overwritten in place if the
+ * loop variable holds the only reference to it, sparing one allocation per
+ * iteration for object keys and ranges.
+ */
+static bool
+ut_iter_reusable(struct json_object *prev, enum json_type type)
+{
+	return (json_object_is_type(prev, type) &&
+	        !json_object_get_userdata(prev) &&
+	        getrefcnt(prev) == 1);
+}
+
+/*
+ * Stores a new reference to the next value in item, the previous value
+ * of the loop variable is passed in prev. Exceptions raised by next()
+ * methods are passed on as item.
+ */
+bool
+ut_iter_next(struct ut_state *s, uint32_t off, struct ut_iter *it,
+             struct json_object *prev, struct json_object **item)
+{
+	struct json_object *ctx;
+	const char *k;
+	int64_t n;
+
+	switch (it->type) {
+	case UT_ITER_ARRAY:
+		if (it->idx >= it->len)
+			return false;
+
+		*item = json_object_get(json_object_array_get_idx(it->val, it->idx++));
+
+		return true;
+
+	case UT_ITER_OBJECT:
+		if (!it->next)
+			return false;
+
+		k = lh_entry_k(it->next);
+		it->next = it->next->next;
+
+		if (ut_iter_reusable(prev, json_type_string) &&
+		    json_object_set_string_len(prev, k, strlen(k)))
+			*item = json_object_get(prev);
+		else
+			*item = json_object_new_string(k);
+
+		return true;
+
+	case UT_ITER_RANGE:
+		if (!ut_iter_next_int(it, &n))
+			return false;
+
+		if (ut_iter_reusable(prev, json_type_int) &&
+		    json_object_set_int64(prev, n))
+			*item = json_object_get(prev);
+		else
+			*item = json_object_new_int64(n);
+
+		return true;
+
+	case UT_ITER_CALL:
+		ctx = s->ctx;
+		s->ctx = it->val;
+
+		*item = ut_invoke(s, off, NULL, it->fn, it->args);
+
+		s->ctx = ctx;
+
+		/* iterator objects signal exhaustion by returning null */
+		if (!*item)
+			it->type = UT_ITER_NONE;
+
+		return (*item != NULL);
+
+	default:
+		return false;
+	}
+}
+
+void
+ut_iter_free(struct ut_iter *it)
+{
+	ut_putval(it->val);
+	json_object_put(it->fn);
+	json_object_put(it->args);
+
+	memset(it, 0, sizeof(*it));
+}
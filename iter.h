@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __ITER_H_
+#define __ITER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ast.h"
+
+enum ut_iter_type {
+	UT_ITER_NONE,
+	UT_ITER_ARRAY,
+	UT_ITER_OBJECT,
+	UT_ITER_RANGE,
+	UT_ITER_CALL,
+};
+
+struct ut_range {
+	int64_t start;
+	int64_t end;
+	int64_t step;
+};
+
+/*
+ * Iteration state of a for-in loop. Arrays yield their items and objects
+ * their keys; range() values and ressources providing a next() method yield
+ * their values one by one without the sequence being materialized.
+ */
+struct ut_iter {
+	enum ut_iter_type type;
+	struct json_object *val;
+	struct json_object *fn;
+	struct json_object *args;
+	struct lh_entry *next;
+	size_t idx;
+	size_t len;
+	int64_t pos;
+	int64_t end;
+	int64_t step;
+};
+
+struct json_object *ut_range_new(struct ut_state *s, int64_t start, int64_t end, int64_t step);
+
+void ut_iter_init(struct ut_iter *it, struct json_object *val);
+bool ut_iter_next_int(struct ut_iter *it, int64_t *n);
+bool ut_iter_next(struct ut_state *s, uint32_t off, struct ut_iter *it,
+                  struct json_object *prev, struct json_object **item);
+void ut_iter_free(struct ut_iter *it);
+
+#endif /* __ITER_H_ */
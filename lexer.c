@@ -595,7 +595,7 @@ parse_label(const char *buf, struct ut_op *op, struct ut_state *s)
 	for (i = 0, word = &reserved_words[0];
 	     i < sizeof(reserved_words) / sizeof(reserved_words[0]);
 	     i++, word = &reserved_words[i]) {
-		if (!strcmp(str, word->pat)) {
+		if (word->plen == (in - buf) && !strcmp(str, word->pat)) {
 			op->type = word->type;
 
 			if (word->parse)
@@ -691,17 +691,45 @@ parse_bool(const char *buf, struct ut_op *op, struct ut_state *s)
 }
 
 
+/*
+ * Candidate tokens[] entries for each possible first character, stored as
+ * one-based indexes in table order and terminated by zero. No character
+ * starts more than six tokens.
+ */
+static uint8_t token_dispatch[256][8];
+
+/* built at load time so that lexers on different threads never race */
+__attribute__((constructor)) static void
+init_token_dispatch(void)
+{
+	const struct token *tok;
+	int i, c, n;
+
+	for (i = 0; i < sizeof(tokens) / sizeof(tokens[0]); i++) {
+		tok = &tokens[i];
+
+		for (c = (unsigned char)tok->pat[0];
+		     c <= (unsigned char)(tok->plen ? tok->pat[0] : tok->pat[1]);
+		     c++) {
+			for (n = 0; token_dispatch[c][n]; n++)
+				;
+
+			token_dispatch[c][n] = i + 1;
+		}
+	}
+}
+
 static int
 match_token(const char *ptr, struct ut_op *op, struct ut_state *s)
 {
-	int i;
 	const struct token *tok;
+	const uint8_t *idx;
 
-	for (i = 0, tok = &tokens[0];
-	     i < sizeof(tokens) / sizeof(tokens[0]);
-		 i++, tok = &tokens[i]) {
-		if ((tok->plen > 0 && !strncmp(ptr, tok->pat, tok->plen)) ||
-		    (tok->plen == 0 && *ptr >= tok->pat[0] && *ptr <= tok->pat[1])) {
+	for (idx = token_dispatch[(unsigned char)*ptr]; *idx; idx++) {
+		tok = &tokens[*idx - 1];
+
+		/* the first character is known to match already */
+		if (tok->plen <= 1 || !strncmp(ptr + 1, tok->pat + 1, tok->plen - 1)) {
 			op->type = tok->type;
 
 			if (tok->parse)
@@ -723,6 +751,12 @@ ut_get_token(struct ut_state *s, const char *input, int *mlen)
 
 	for (o = p = input; *p; p++) {
 		if (s->blocktype == UT_BLOCK_NONE) {
+			/* skip ahead to the next possible block start */
+			p = strchrnul(p, '{');
+
+			if (!*p)
+				break;
+
 			if (!strncmp(p, "{#", 2))
 				s->blocktype = UT_BLOCK_COMMENT;
 			else if (!strncmp(p, "{{", 2))
@@ -754,6 +788,15 @@ ut_get_token(struct ut_state *s, const char *input, int *mlen)
 			}
 		}
 		else if (s->blocktype == UT_BLOCK_COMMENT) {
+			/* skip ahead to the next possible block end */
+			p = strchrnul(p, '#');
+
+			if (!*p)
+				break;
+
+			if (p > input && p[-1] == '-' && p[1] == '}')
+				p--;
+
 			if (!strncmp(p, "#}", 2) || !strncmp(p, "-#}", 3)) {
 				*mlen = (p - input) + 2;
 
@@ -20,6 +20,10 @@
 #include "eval.h"
 #include "lib.h"
 #include "module.h"
+#include "cache.h"
+#include "strbuf.h"
+#include "iter.h"
+#include "memo.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,6 +34,7 @@
 #include <math.h>
 #include <time.h>
 #include <dlfcn.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -326,7 +331,7 @@ ut_print(struct ut_state *s, uint32_t off, struct json_object *args)
 			len = strlen(p);
 		}
 
-		reslen += fwrite(p, 1, len, stdout);
+		reslen += ut_output_write(&s->output, p, len);
 	}
 
 	return json_object_new_int64(reslen);
@@ -419,7 +424,7 @@ ut_push(struct ut_state *s, uint32_t off, struct json_object *args)
 		json_object_array_add(arr, json_object_get(item));
 	}
 
-	return item;
+	return json_object_get(item);
 }
 
 static struct json_object *
@@ -492,13 +497,14 @@ ut_unshift(struct ut_state *s, uint32_t off, struct json_object *args)
 		json_object_array_put_idx(arr, arridx, json_object_get(item));
 	}
 
-	return item;
+	return json_object_get(item);
 }
 
 static struct json_object *
 ut_chr(struct ut_state *s, uint32_t off, struct json_object *args)
 {
 	size_t len = json_object_array_length(args);
+	struct json_object *rv;
 	size_t idx;
 	int64_t n;
 	char *str;
@@ -522,7 +528,10 @@ ut_chr(struct ut_state *s, uint32_t off, struct json_object *args)
 		str[idx] = (char)n;
 	}
 
-	return json_object_new_string_len(str, len);
+	rv = json_object_new_string_len(str, len);
+	free(str);
+
+	return rv;
 }
 
 static struct json_object *
@@ -657,60 +666,34 @@ ut_int(struct ut_state *s, uint32_t off, struct json_object *args)
 static struct json_object *
 ut_join(struct ut_state *s, uint32_t off, struct json_object *args)
 {
-	const char *sep = json_object_get_string(json_object_array_get_idx(args, 0));
+	struct json_object *sep = json_object_array_get_idx(args, 0);
 	struct json_object *arr = json_object_array_get_idx(args, 1);
-	struct json_object *rv = NULL;
-	size_t arrlen, arridx, len = 1;
-	const char *item;
-	char *res, *p;
-	int ret;
+	struct json_object *item;
+	struct ut_strbuf *sb = NULL;
+	size_t arrlen, arridx;
 
 	if (!json_object_is_type(arr, json_type_array))
 		return NULL;
 
-	for (arrlen = json_object_array_length(arr), arridx = 0; arridx < arrlen; arridx++) {
-		if (arridx > 0)
-			len += strlen(sep);
-
-		item = json_object_get_string(json_object_array_get_idx(arr, arridx));
-		len += item ? strlen(item) : 0;
-	}
-
-	p = res = calloc(1, len);
-
-	if (!res)
+	if (!ut_strbuf_append(&sb, "", 0))
 		return ut_exception(s, off, UT_ERRMSG_OOM);
 
 	for (arrlen = json_object_array_length(arr), arridx = 0; arridx < arrlen; arridx++) {
-		if (arridx > 0) {
-			ret = snprintf(p, len, "%s", sep);
-
-			if (ret < 0 || ret >= len)
-				goto out;
-
-			len -= ret;
-			p += ret;
-		}
-
-		item = json_object_get_string(json_object_array_get_idx(arr, arridx));
-
-		if (item) {
-			ret = snprintf(p, len, "%s", item);
+		if (arridx > 0 && sep && !ut_strbuf_append_val(&sb, sep))
+			goto err;
 
-			if (ret < 0 || ret >= len)
-				goto out;
+		item = json_object_array_get_idx(arr, arridx);
 
-			len -= ret;
-			p += ret;
-		}
+		if (item && !ut_strbuf_append_val(&sb, item))
+			goto err;
 	}
 
-	rv = json_object_new_string(res);
+	return ut_strbuf_finish(sb);
 
-out:
-	free(res);
+err:
+	ut_strbuf_put(sb);
 
-	return rv;
+	return ut_exception(s, off, UT_ERRMSG_OOM);
 }
 
 static struct json_object *
@@ -889,34 +872,152 @@ ut_reverse(struct ut_state *s, uint32_t off, struct json_object *args)
 	return rv;
 }
 
+enum sort_mode {
+	SORT_GENERIC,
+	SORT_INT,
+	SORT_DOUBLE,
+	SORT_STRING,
+};
+
+struct sort_item {
+	struct json_object *val;
+	struct json_object *key;
+	union { int64_t n; double d; const char *s; } k;
+};
 
-static struct {
+struct sort_ctx {
 	struct ut_state *s;
 	uint32_t off;
 	struct json_object *fn;
 	struct json_object *args;
-} sort_ctx;
+	struct json_object *ex;
+	enum sort_mode mode;
+};
 
-static int
-sort_fn(const void *k1, const void *k2)
+static bool
+sort_lt(struct sort_ctx *ctx, struct sort_item *a, struct sort_item *b)
 {
-	struct json_object * const *v1 = k1;
-	struct json_object * const *v2 = k2;
 	struct json_object *rv;
-	int ret;
+	bool lt;
 
-	if (!sort_ctx.fn)
-		return !ut_cmp(T_LT, *v1, *v2);
+	switch (ctx->mode) {
+	case SORT_INT:
+		return (a->k.n < b->k.n);
 
-	json_object_array_put_idx(sort_ctx.args, 0, *v1);
-	json_object_array_put_idx(sort_ctx.args, 1, *v2);
+	case SORT_DOUBLE:
+		return (a->k.d < b->k.d);
 
-	rv = ut_invoke(sort_ctx.s, sort_ctx.off, NULL, sort_ctx.fn, sort_ctx.args);
-	ret = !ut_val_is_truish(rv);
+	case SORT_STRING:
+		return (strcmp(a->k.s, b->k.s) < 0);
+
+	default:
+		break;
+	}
 
+	if (!ctx->fn)
+		return ut_cmp(T_LT, a->key, b->key);
+
+	/* stop calling the comparator once it raised an exception */
+	if (ctx->ex)
+		return false;
+
+	json_object_array_put_idx(ctx->args, 0, json_object_get(a->key));
+	json_object_array_put_idx(ctx->args, 1, json_object_get(b->key));
+
+	rv = ut_invoke(ctx->s, ctx->off, NULL, ctx->fn, ctx->args);
+
+	if (ut_is_type(rv, T_EXCEPTION)) {
+		ctx->ex = rv;
+
+		return false;
+	}
+
+	lt = ut_val_is_truish(rv);
 	ut_putval(rv);
 
-	return ret;
+	return lt;
+}
+
+/*
+ * Stable merge sort, short runs are sorted by insertion first. The comparison
+ * is a "less than" predicate so equal items keep their order.
+ */
+static void
+sort_merge(struct sort_ctx *ctx, struct sort_item *items, struct sort_item *tmp, size_t len)
+{
+	struct sort_item *src = items, *dst = tmp, *swap, item;
+	size_t width, lo, mid, hi, i, j, k;
+
+	for (lo = 0; lo < len; lo += 8) {
+		hi = (lo + 8 < len) ? lo + 8 : len;
+
+		for (i = lo + 1; i < hi; i++) {
+			item = items[i];
+
+			for (j = i; j > lo && sort_lt(ctx, &item, &items[j - 1]); j--)
+				items[j] = items[j - 1];
+
+			items[j] = item;
+		}
+	}
+
+	for (width = 8; width < len; width *= 2) {
+		for (lo = 0; lo < len; lo += 2 * width) {
+			mid = (lo + width < len) ? lo + width : len;
+			hi = (mid + width < len) ? mid + width : len;
+
+			for (i = lo, j = mid, k = lo; k < hi; k++) {
+				if (i < mid && (j >= hi || !sort_lt(ctx, &src[j], &src[i])))
+					dst[k] = src[i++];
+				else
+					dst[k] = src[j++];
+			}
+		}
+
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+
+	if (src != items)
+		memcpy(items, src, len * sizeof(*items));
+}
+
+/* compare plain numbers or strings natively, without casting every time */
+static enum sort_mode
+sort_detect(struct sort_item *items, size_t len)
+{
+	enum json_type t, type = json_type_null;
+	bool dbl = false;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		t = json_object_get_type(items[i].key);
+
+		if (t == json_type_double) {
+			dbl = true;
+			t = json_type_int;
+		}
+
+		if ((t != json_type_int && t != json_type_string) || (i > 0 && t != type))
+			return SORT_GENERIC;
+
+		type = t;
+	}
+
+	for (i = 0; i < len; i++) {
+		if (type == json_type_string)
+			items[i].k.s = json_object_get_string(items[i].key);
+		else if (dbl)
+			items[i].k.d = json_object_get_double(items[i].key);
+		else
+			items[i].k.n = json_object_get_int64(items[i].key);
+	}
+
+	if (type == json_type_string)
+		return SORT_STRING;
+
+	return dbl ? SORT_DOUBLE : SORT_INT;
 }
 
 static struct json_object *
@@ -924,24 +1025,79 @@ ut_sort(struct ut_state *s, uint32_t off, struct json_object *args)
 {
 	struct json_object *arr = json_object_array_get_idx(args, 0);
 	struct json_object *fn = json_object_array_get_idx(args, 1);
+	struct json_object *keyfn = json_object_array_get_idx(args, 2);
+	struct sort_ctx ctx = { .s = s, .off = off, .fn = fn };
+	struct json_object *keyargs = NULL, *rv = NULL;
+	struct sort_item *items;
+	size_t len, i;
 
 	if (!json_object_is_type(arr, json_type_array))
 		return NULL;
 
-	if (fn) {
-		sort_ctx.s = s;
-		sort_ctx.off = off;
-		sort_ctx.fn = fn;
-		sort_ctx.args = json_object_new_array();
+	len = json_object_array_length(arr);
+	items = calloc(len ? len * 2 : 1, sizeof(*items));
 
-		if (!sort_ctx.args)
-			return ut_exception(s, off, UT_ERRMSG_OOM);
+	if (!items)
+		return ut_exception(s, off, UT_ERRMSG_OOM);
+
+	if (fn)
+		ctx.args = json_object_new_array();
+
+	if (keyfn)
+		keyargs = json_object_new_array();
+
+	if ((fn && !ctx.args) || (keyfn && !keyargs)) {
+		rv = ut_exception(s, off, UT_ERRMSG_OOM);
+		goto out;
 	}
 
-	json_object_array_sort(arr, sort_fn);
-	ut_putval(sort_ctx.args);
+	/* hold references on the items, the callbacks might modify the array */
+	for (i = 0; i < len; i++) {
+		items[i].val = json_object_get(json_object_array_get_idx(arr, i));
 
-	return json_object_get(arr);
+		if (!keyfn) {
+			items[i].key = json_object_get(items[i].val);
+			continue;
+		}
+
+		/* evaluate the key function only once per item */
+		json_object_array_put_idx(keyargs, 0, json_object_get(items[i].val));
+		items[i].key = ut_invoke(s, off, NULL, keyfn, keyargs);
+
+		if (ut_is_type(items[i].key, T_EXCEPTION)) {
+			rv = items[i].key;
+			items[i].key = NULL;
+			goto out;
+		}
+	}
+
+	ctx.mode = fn ? SORT_GENERIC : sort_detect(items, len);
+
+	sort_merge(&ctx, items, items + len, len);
+
+	if (ctx.ex) {
+		rv = ctx.ex;
+		goto out;
+	}
+
+	for (i = 0; i < len; i++) {
+		json_object_array_put_idx(arr, i, items[i].val);
+		items[i].val = NULL;
+	}
+
+	rv = json_object_get(arr);
+
+out:
+	for (i = 0; i < len; i++) {
+		ut_putval(items[i].val);
+		ut_putval(items[i].key);
+	}
+
+	ut_putval(keyargs);
+	ut_putval(ctx.args);
+	free(items);
+
+	return rv;
 }
 
 static struct json_object *
@@ -1217,6 +1373,48 @@ ut_values(struct ut_state *s, uint32_t off, struct json_object *args)
 	return arr;
 }
 
+static bool
+ut_range_arg(struct json_object *v, int64_t *n)
+{
+	double d;
+
+	if (ut_cast_number(v, n, &d) != json_type_double)
+		return true;
+
+	if (isnan(d) || (double)(int64_t)d != d)
+		return false;
+
+	*n = (int64_t)d;
+
+	return true;
+}
+
+static struct json_object *
+ut_range(struct ut_state *s, uint32_t off, struct json_object *args)
+{
+	struct json_object *v1 = json_object_array_get_idx(args, 0);
+	struct json_object *v2 = json_object_array_get_idx(args, 1);
+	struct json_object *v3 = json_object_array_get_idx(args, 2);
+	int64_t start = 0, end, step = 1;
+	struct json_object *rv;
+
+	if (json_object_array_length(args) < 2) {
+		if (!ut_range_arg(v1, &end))
+			return NULL;
+	}
+	else if (!ut_range_arg(v1, &start) || !ut_range_arg(v2, &end) ||
+	         (v3 && !ut_range_arg(v3, &step))) {
+		return NULL;
+	}
+
+	if (step == 0)
+		return NULL;
+
+	rv = ut_range_new(s, start, end, step);
+
+	return rv ? rv : ut_exception(s, off, UT_ERRMSG_OOM);
+}
+
 static struct json_object *
 ut_trim_common(struct ut_state *s, uint32_t off, struct json_object *args, bool start, bool end)
 {
@@ -1275,233 +1473,428 @@ ut_rtrim(struct ut_state *s, uint32_t off, struct json_object *args)
 	return ut_trim_common(s, off, args, false, true);
 }
 
-static size_t
-ut_printf_common(struct ut_state *s, uint32_t off, struct json_object *args, char **res)
+enum ut_format_conv {
+	UT_FORMAT_NONE,
+	UT_FORMAT_INT,
+	UT_FORMAT_CHAR,
+	UT_FORMAT_DOUBLE,
+	UT_FORMAT_STRING,
+	UT_FORMAT_PERCENT,
+};
+
+/*
+ * Every '%' of a format string yields a directive: the literal text since the
+ * previous directive followed by a conversion, which consumes an argument.
+ * Malformed conversions are not emitted and stay part of the literal text.
+ */
+struct ut_format_dir {
+	uint32_t litoff;
+	uint32_t litlen;
+	uint8_t conv;
+	bool emit;
+	char spec[sizeof("%0- 123456789.123456789%")];
+};
+
+struct ut_format {
+	size_t len;
+	const char *fmt;
+	uint32_t ndirs;
+	struct ut_format_dir dirs[];
+};
+
+static bool
+ut_format_spec(struct ut_format_dir *d, const char **pp)
 {
-	struct json_object *fmt = json_object_array_get_idx(args, 0);
-	char *fp, sfmt[sizeof("%0- 123456789.123456789%")];
-	union { const char *s; int64_t n; double d; } arg;
-	size_t len = 0, arglen, argidx;
-	const char *fstr, *last, *p;
-	enum json_type t;
-	bool ok;
+	char *fp = d->spec, *end = d->spec + sizeof(d->spec);
+	const char *p = *pp;
 
-	*res = NULL;
+	*fp++ = *p++;
 
-	if (json_object_is_type(fmt, json_type_string))
-		fstr = json_object_get_string(fmt);
-	else
-		fstr = "";
+	while (*p && strchr("0- ", *p)) {
+		if (fp + 1 >= end)
+			return false;
 
-	arglen = json_object_array_length(args);
-	argidx = 1;
+		*fp++ = *p++;
+	}
 
-	for (last = p = fstr; *p; p++) {
-		if (*p == '%') {
-			if (!snprintf_append(res, &len, "%s", p - last, last))
-				goto err;
+	if (*p >= '1' && *p <= '9') {
+		if (fp + 1 >= end)
+			return false;
 
-			last = p++;
+		*fp++ = *p++;
 
-			fp = sfmt;
-			*fp++ = '%';
+		while (isdigit(*p)) {
+			if (fp + 1 >= end)
+				return false;
 
-			memset(&arg, 0, sizeof(arg));
+			*fp++ = *p++;
+		}
+	}
 
-			while (strchr("0- ", *p)) {
-				if (fp + 1 >= sfmt + sizeof(sfmt))
-					goto next;
+	if (*p == '.') {
+		if (fp + 1 >= end)
+			return false;
 
-				*fp++ = *p++;
-			}
+		*fp++ = *p++;
 
-			if (*p >= '1' && *p <= '9') {
-				if (fp + 1 >= sfmt + sizeof(sfmt))
-					goto next;
+		if (*p == '-') {
+			if (fp + 1 >= end)
+				return false;
 
-				*fp++ = *p++;
+			*fp++ = *p++;
+		}
 
-				while (isdigit(*p)) {
-					if (fp + 1 >= sfmt + sizeof(sfmt))
-						goto next;
+		while (isdigit(*p)) {
+			if (fp + 1 >= end)
+				return false;
 
-					*fp++ = *p++;
-				}
-			}
+			*fp++ = *p++;
+		}
+	}
 
-			if (*p == '.') {
-				if (fp + 1 >= sfmt + sizeof(sfmt))
-					goto next;
+	if (!strncmp(p, "hh", 2) || !strncmp(p, "ll", 2)) {
+		if (fp + 2 >= end)
+			return false;
 
-				*fp++ = *p++;
+		*fp++ = *p++;
+		*fp++ = *p++;
+	}
+	else if (*p == 'h' || *p == 'l') {
+		if (fp + 1 >= end)
+			return false;
 
-				if (*p == '-') {
-					if (fp + 1 >= sfmt + sizeof(sfmt))
-						goto next;
+		*fp++ = *p++;
+	}
 
-					*fp++ = *p++;
-				}
+	*pp = p;
 
-				while (isdigit(*p)) {
-					if (fp + 1 >= sfmt + sizeof(sfmt))
-						goto next;
+	switch (*p) {
+	case 'd':
+	case 'i':
+	case 'o':
+	case 'u':
+	case 'x':
+	case 'X':
+		d->conv = UT_FORMAT_INT;
+		break;
 
-					*fp++ = *p++;
-				}
-			}
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'F':
+	case 'g':
+	case 'G':
+		d->conv = UT_FORMAT_DOUBLE;
+		break;
 
-			if (!strncmp(p, "hh", 2) || !strncmp(p, "ll", 2)) {
-				if (fp + 2 >= sfmt + sizeof(sfmt))
-					goto next;
+	case 'c':
+		d->conv = UT_FORMAT_CHAR;
+		break;
 
-				*fp++ = *p++;
-				*fp++ = *p++;
-			}
-			else if (*p == 'h' || *p == 'l') {
-				if (fp + 1 >= sfmt + sizeof(sfmt))
-					goto next;
+	case 's':
+		d->conv = UT_FORMAT_STRING;
+		break;
 
-				*fp++ = *p++;
-			}
+	case '%':
+		d->conv = UT_FORMAT_PERCENT;
+		break;
 
-			switch (*p) {
-			case 'd':
-			case 'i':
-			case 'o':
-			case 'u':
-			case 'x':
-			case 'X':
-				t = json_type_int;
-
-				if (argidx < arglen)
-					arg.n = ut_cast_int64(json_object_array_get_idx(args, argidx++));
-				else
-					arg.n = 0;
+	default:
+		return false;
+	}
 
-				break;
+	/* the argument is consumed even if the spec turns out to be too long */
+	if (fp + 2 >= end)
+		return false;
 
-			case 'e':
-			case 'E':
-			case 'f':
-			case 'F':
-			case 'g':
-			case 'G':
-				t = json_type_double;
+	*fp++ = *p;
+	*fp = 0;
 
-				if (argidx < arglen)
-					arg.d = ut_cast_double(json_object_array_get_idx(args, argidx++));
-				else
-					arg.d = 0;
+	return true;
+}
 
-				break;
+static struct ut_format *
+ut_format_compile(const char *fstr, size_t len)
+{
+	struct ut_format_dir *d;
+	struct ut_format *f;
+	const char *last, *p;
+	char *copy;
+	size_t n;
 
-			case 'c':
-				t = json_type_int;
+	for (p = fstr, n = 1; p < fstr + len; p++)
+		n += (*p == '%');
 
-				if (argidx < arglen)
-					arg.n = ut_cast_int64(json_object_array_get_idx(args, argidx++)) & 0xff;
-				else
-					arg.n = 0;
+	f = malloc(sizeof(*f) + n * sizeof(*d) + len + 1);
 
-				break;
+	if (!f)
+		return NULL;
 
-			case 's':
-				t = json_type_string;
+	copy = (char *)&f->dirs[n];
+	memcpy(copy, fstr, len);
+	copy[len] = 0;
 
-				if (argidx < arglen)
-					arg.s = json_object_get_string(json_object_array_get_idx(args, argidx++));
-				else
-					arg.s = NULL;
+	f->fmt = copy;
+	f->len = len;
+	f->ndirs = 0;
 
-				arg.s = arg.s ? arg.s : "(null)";
+	/* like the format itself, the directives end at the first zero byte */
+	for (last = p = copy; *p; p++) {
+		if (*p != '%')
+			continue;
 
-				break;
+		d = &f->dirs[f->ndirs++];
+		d->litoff = last - copy;
+		d->litlen = p - last;
+		d->conv = UT_FORMAT_NONE;
+		d->emit = ut_format_spec(d, &p);
 
-			case '%':
-				t = json_type_null;
+		last = d->emit ? p + 1 : copy + d->litoff + d->litlen;
 
-				break;
+		if (!*p)
+			break;
+	}
 
-			default:
-				goto next;
-			}
+	d = &f->dirs[f->ndirs++];
+	d->litoff = last - copy;
+	d->litlen = strlen(last);
+	d->conv = UT_FORMAT_NONE;
+	d->emit = false;
 
-			if (fp + 2 >= sfmt + sizeof(sfmt))
-				goto next;
+	return f;
+}
 
-			*fp++ = *p;
-			*fp = 0;
+/* compiled formats are kept per call site as long as the format is unchanged */
+static struct ut_format *
+ut_format_get(struct ut_state *s, uint32_t off, struct json_object *fmt, bool *owned)
+{
+	const char *fstr = json_object_is_type(fmt, json_type_string) ? json_object_get_string(fmt) : "";
+	size_t len = json_object_is_type(fmt, json_type_string) ? json_object_get_string_len(fmt) : 0;
+	struct ut_format **tmp, *f;
+	uint32_t size;
 
-			switch (t) {
-			case json_type_int:    ok = sprintf_append(res, &len, sfmt, arg.n); break;
-			case json_type_double: ok = sprintf_append(res, &len, sfmt, arg.d); break;
-			case json_type_string: ok = sprintf_append(res, &len, sfmt, arg.s); break;
-			default:               ok = sprintf_append(res, &len, sfmt);        break;
-			}
+	*owned = true;
+
+	if (off > s->formats.size) {
+		size = (s->poolsize > off) ? s->poolsize : off;
+		tmp = realloc(s->formats.cache, size * sizeof(*tmp));
+
+		if (tmp) {
+			memset(tmp + s->formats.size, 0, (size - s->formats.size) * sizeof(*tmp));
+			s->formats.cache = tmp;
+			s->formats.size = size;
+		}
+	}
+
+	if (!off || off > s->formats.size)
+		return ut_format_compile(fstr, len);
+
+	f = s->formats.cache[off - 1];
+
+	if (!f || f->len != len || memcmp(f->fmt, fstr, len)) {
+		f = ut_format_compile(fstr, len);
+
+		if (!f)
+			return NULL;
+
+		free(s->formats.cache[off - 1]);
+		s->formats.cache[off - 1] = f;
+	}
+
+	*owned = false;
+
+	return f;
+}
+
+/*
+ * Formats into the scratch buffer of the state, which is reused by the next
+ * call, so that the output does not need to be allocated each time.
+ */
+static struct ut_strbuf *
+ut_printf_common(struct ut_state *s, uint32_t off, struct json_object *args)
+{
+	struct json_object *arg;
+	struct ut_format_dir *d;
+	struct ut_strbuf *sb;
+	struct ut_format *f;
+	size_t arglen, argidx;
+	bool owned, ok = true;
+
+	f = ut_format_get(s, off, json_object_array_get_idx(args, 0), &owned);
 
-			if (!ok)
-				goto err;
+	if (!f)
+		return NULL;
 
-			last = p + 1;
+	sb = s->formats.buf;
 
-next:
+	/* don't hold on to the buffer of an exceptionally large result */
+	if (sb && sb->size > UT_OUTPUT_BUFSIZE) {
+		ut_strbuf_put(sb);
+		sb = NULL;
+	}
+
+	if (sb)
+		sb->len = 0;
+	else if (!ut_strbuf_append(&sb, "", 0))
+		goto out;
+
+	arglen = json_object_array_length(args);
+	argidx = 1;
+
+	for (d = f->dirs; ok && d < f->dirs + f->ndirs; d++) {
+		ok = ut_strbuf_append(&sb, f->fmt + d->litoff, d->litlen);
+
+		if (!ok || d->conv == UT_FORMAT_NONE)
+			continue;
+
+		if (d->conv == UT_FORMAT_PERCENT) {
+			ok = ut_strbuf_printf(&sb, d->spec);
 			continue;
 		}
-	}
 
-	if (!snprintf_append(res, &len, "%s", p - last, last))
-		goto err;
+		arg = (argidx < arglen) ? json_object_array_get_idx(args, argidx++) : NULL;
 
-	return len;
+		if (!d->emit)
+			continue;
 
-err:
-	free(*res);
-	*res = NULL;
+		switch (d->conv) {
+		case UT_FORMAT_INT:
+			ok = ut_strbuf_printf(&sb, d->spec, arg ? ut_cast_int64(arg) : 0);
+			break;
+
+		case UT_FORMAT_CHAR:
+			ok = ut_strbuf_printf(&sb, d->spec, arg ? ut_cast_int64(arg) & 0xff : 0);
+			break;
+
+		case UT_FORMAT_DOUBLE:
+			ok = ut_strbuf_printf(&sb, d->spec, arg ? ut_cast_double(arg) : 0.0);
+			break;
+
+		default:
+			/* plain %s conversions of strings copy the known length */
+			if (!strcmp(d->spec, "%s") && json_object_is_type(arg, json_type_string))
+				ok = ut_strbuf_append(&sb, json_object_get_string(arg),
+				                      json_object_get_string_len(arg));
+			else
+				ok = ut_strbuf_printf(&sb, d->spec,
+				                      arg ? json_object_get_string(arg) : "(null)");
+			break;
+		}
+	}
 
-	return 0;
+out:
+	if (owned)
+		free(f);
+
+	s->formats.buf = sb;
+
+	return ok ? sb : NULL;
 }
 
 static struct json_object *
 ut_sprintf(struct ut_state *s, uint32_t off, struct json_object *args)
 {
-	char *str = NULL;
-	size_t len;
+	struct ut_strbuf *sb = ut_printf_common(s, off, args);
 
-	len = ut_printf_common(s, off, args, &str);
-
-	if (!str)
+	if (!sb)
 		return ut_exception(s, off, UT_ERRMSG_OOM);
 
-	return json_object_new_string_len(str, len);
+	return json_object_new_string_len(sb->data, sb->len);
 }
 
 static struct json_object *
 ut_printf(struct ut_state *s, uint32_t off, struct json_object *args)
 {
-	char *str = NULL;
+	struct ut_strbuf *sb = ut_printf_common(s, off, args);
 	size_t len;
 
-	len = ut_printf_common(s, off, args, &str);
-
-	if (!str)
+	if (!sb)
 		return ut_exception(s, off, UT_ERRMSG_OOM);
 
-	len = fwrite(str, 1, len, stdout);
+	len = ut_output_write(&s->output, sb->data, sb->len);
 
 	return json_object_new_int64(len);
 }
 
+/*
+ * Read the remainder of the given stream into a zero terminated buffer.
+ * Regular files are read with a single call sized by fstat(), everything
+ * else, including procfs files reporting a zero size, with a buffer
+ * growing geometrically.
+ */
+char *
+ut_read_file(FILE *fp, size_t *len)
+{
+	size_t size = 4096, rlen = 0, n;
+	char *buf = NULL, *tmp;
+	struct stat st;
+	off_t pos;
+	int c;
+
+	if (!fstat(fileno(fp), &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+		pos = ftello(fp);
+
+		if (pos >= 0 && pos < st.st_size)
+			size = st.st_size - pos + 1;
+	}
+
+	while (true) {
+		tmp = realloc(buf, size);
+
+		if (!tmp) {
+			free(buf);
+
+			return NULL;
+		}
+
+		buf = tmp;
+		n = fread(buf + rlen, 1, size - rlen - 1, fp);
+		rlen += n;
+
+		/* don't grow a buffer the file exactly filled, as sized by fstat() */
+		c = (rlen < size - 1) ? EOF : fgetc(fp);
+
+		if (c == EOF) {
+			if (ferror(fp)) {
+				free(buf);
+
+				return NULL;
+			}
+
+			break;
+		}
+
+		ungetc(c, fp);
+
+		if (size > SIZE_MAX / 2) {
+			free(buf);
+			errno = ENOMEM;
+
+			return NULL;
+		}
+
+		size *= 2;
+	}
+
+	buf[rlen] = 0;
+
+	if (len)
+		*len = rlen;
+
+	return buf;
+}
+
+/* modules keep the ops table in a process-wide variable set by their first
+ * initialization, so states on different threads initialize them in turn */
+static pthread_mutex_t module_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static struct json_object *
 ut_require_so(struct ut_state *s, uint32_t off, const char *path)
 {
 	void (*init)(const struct ut_ops *, struct ut_state *, struct json_object *);
 	struct json_object *scope;
-	struct stat st;
 	void *dlh;
 
-	if (stat(path, &st))
-		return NULL;
-
 	dlerror();
 	dlh = dlopen(path, RTLD_LAZY|RTLD_LOCAL);
 
@@ -1518,39 +1911,39 @@ ut_require_so(struct ut_state *s, uint32_t off, const char *path)
 	if (!scope)
 		return ut_exception(s, off, UT_ERRMSG_OOM);
 
+	pthread_mutex_lock(&module_lock);
 	init(&ut, s, scope);
+	pthread_mutex_unlock(&module_lock);
 
 	return scope;
 }
 
 static struct json_object *
-ut_require_utpl(struct ut_state *s, uint32_t off, const char *path)
+ut_require_utpl(struct ut_state *s, uint32_t off, const char *path, const struct stat *st)
 {
-	struct json_object *ex, *scope;
+	struct json_object *ex, *entry, *rv;
+	uint32_t base, main = s->main;
 	char *source, *msg;
-	struct stat st;
 	FILE *sfile;
 
-	if (stat(path, &st))
-		return NULL;
+	if (ut_cache_load(s, path, st))
+		goto invoke;
 
 	sfile = fopen(path, "rb");
 
 	if (!sfile)
 		return ut_exception(s, off, "Unable to open file %s: %s", path, strerror(errno));
 
-	source = calloc(1, st.st_size + 1);
-
-	if (!source) {
-		fclose(sfile);
+	source = ut_read_file(sfile, NULL);
+	fclose(sfile);
 
-		return ut_exception(s, off, UT_ERRMSG_OOM);
-	}
+	if (!source)
+		return ut_exception(s, off, "Unable to read file %s: %s", path, strerror(errno));
 
-	fread(source, 1, st.st_size, sfile);
-	fclose(sfile);
+	base = s->poolsize;
 
 	if (ut_parse(s, source)) {
+		s->main = main;
 		msg = ut_format_error(s, source);
 		ex = ut_exception(s, off, "Module loading failed: %s", msg);
 
@@ -1560,14 +1953,22 @@ ut_require_utpl(struct ut_state *s, uint32_t off, const char *path)
 		return ex;
 	}
 
+	ut_cache_store(s, path, st, base);
 	free(source);
 
-	scope = json_object_new_object();
+invoke:
+	/* the main program has to stay the entry point of the state */
+	entry = ut_new_func(s, s->main);
+	s->main = main;
 
-	if (!scope)
+	if (!entry)
 		return ut_exception(s, off, UT_ERRMSG_OOM);
 
-	return ut_invoke(s, off, scope, ut_get_op(s, s->main)->val, NULL);
+	rv = ut_invoke(s, off, NULL, entry, NULL);
+
+	json_object_put(entry);
+
+	return rv;
 }
 
 static struct json_object *
@@ -1577,6 +1978,7 @@ ut_require_path(struct ut_state *s, uint32_t off, const char *path_template, con
 	const char *p, *q, *last;
 	char *path = NULL;
 	size_t plen = 0;
+	struct stat st;
 
 	p = strchr(path_template, '*');
 
@@ -1600,10 +2002,36 @@ ut_require_path(struct ut_state *s, uint32_t off, const char *path_template, con
 		}
 	}
 
+	if (strcmp(p, ".so") && strcmp(p, ".utpl"))
+		goto invalid;
+
+	/* modules are loaded once per state, known misses are remembered as null */
+	if (json_object_object_get_ex(s->modules, path, &rv)) {
+		rv = json_object_get(rv);
+		goto invalid;
+	}
+
+	if (!s->modules) {
+		s->modules = json_object_new_object();
+
+		if (!s->modules) {
+			rv = ut_exception(s, off, UT_ERRMSG_OOM);
+			goto invalid;
+		}
+	}
+
+	if (stat(path, &st)) {
+		json_object_object_add(s->modules, path, NULL);
+		goto invalid;
+	}
+
 	if (!strcmp(p, ".so"))
 		rv = ut_require_so(s, off, path);
-	else if (!strcmp(p, ".utpl"))
-		rv = ut_require_utpl(s, off, path);
+	else
+		rv = ut_require_utpl(s, off, path, &st);
+
+	if (rv && !ut_is_type(rv, T_EXCEPTION))
+		json_object_object_add(s->modules, path, json_object_get(rv));
 
 invalid:
 	free(path);
@@ -1750,6 +2178,345 @@ ut_arrtoip(struct ut_state *s, uint32_t off, struct json_object *args)
 	}
 }
 
+/*
+ * JSON input is consumed through a fixed size buffer, either pointing into a
+ * string or refilled from an fs file or process handle. Selected values are
+ * parsed by feeding the buffered data to a json-c tokener until it completes
+ * a value, everything else in between is skipped without being allocated.
+ */
+struct json_reader {
+	struct json_tokener *tok;
+	FILE *fp;
+	const char *buf;
+	size_t len, pos;
+	const char *error;
+	char chunk[4096];
+};
+
+static int
+json_peek(struct json_reader *r)
+{
+	size_t n;
+
+	if (r->pos == r->len) {
+		if (!r->fp)
+			return EOF;
+
+		n = fread(r->chunk, 1, sizeof(r->chunk), r->fp);
+
+		if (n == 0) {
+			if (ferror(r->fp))
+				r->error = strerror(errno);
+
+			return EOF;
+		}
+
+		r->buf = r->chunk;
+		r->len = n;
+		r->pos = 0;
+	}
+
+	return (unsigned char)r->buf[r->pos];
+}
+
+static int
+json_skip_ws(struct json_reader *r)
+{
+	int c;
+
+	while ((c = json_peek(r)) == ' ' || c == '\t' || c == '\r' || c == '\n')
+		r->pos++;
+
+	return c;
+}
+
+static bool
+json_fail(struct json_reader *r, enum json_tokener_error err)
+{
+	if (!r->error)
+		r->error = json_tokener_error_desc(err);
+
+	return false;
+}
+
+/* a successfully parsed value may be null */
+static bool
+json_parse_value(struct json_reader *r, struct json_object **val)
+{
+	enum json_tokener_error err;
+
+	json_tokener_reset(r->tok);
+
+	do {
+		/* the terminating zero completes numbers at the end of the input */
+		if (json_peek(r) == EOF) {
+			if (r->error)
+				return false;
+
+			*val = json_tokener_parse_ex(r->tok, "", 1);
+			err = json_tokener_get_error(r->tok);
+
+			if (err == json_tokener_continue)
+				err = json_tokener_error_parse_eof;
+
+			break;
+		}
+
+		*val = json_tokener_parse_ex(r->tok, r->buf + r->pos, r->len - r->pos);
+		r->pos += json_tokener_get_parse_end(r->tok);
+		err = json_tokener_get_error(r->tok);
+	} while (err == json_tokener_continue);
+
+	if (err != json_tokener_success)
+		return json_fail(r, err);
+
+	return true;
+}
+
+/* pass over a value not selected by the path, only minding the nesting */
+static bool
+json_skip_value(struct json_reader *r)
+{
+	uint64_t objects = 0;
+	uint32_t depth = 0;
+	int c, quote;
+
+	do {
+		c = json_skip_ws(r);
+
+		switch (c) {
+		case EOF:
+			return json_fail(r, json_tokener_error_parse_eof);
+
+		/* would never be consumed by the scalar case below */
+		case '\0':
+			return json_fail(r, json_tokener_error_parse_unexpected);
+
+		case '"':
+		case '\'':
+			for (quote = c, r->pos++; (c = json_peek(r)) != quote; r->pos++) {
+				if (c == EOF)
+					return json_fail(r, json_tokener_error_parse_string);
+
+				if (c == '\\') {
+					r->pos++;
+
+					if (json_peek(r) == EOF)
+						return json_fail(r, json_tokener_error_parse_string);
+				}
+			}
+
+			r->pos++;
+			break;
+
+		case '{':
+		case '[':
+			if (depth == 64)
+				return json_fail(r, json_tokener_error_depth);
+
+			objects = (objects << 1) | (c == '{');
+			depth++;
+			r->pos++;
+			break;
+
+		case '}':
+		case ']':
+			if (!depth || (objects & 1) != (c == '}'))
+				return json_fail(r, json_tokener_error_parse_unexpected);
+
+			objects >>= 1;
+			depth--;
+			r->pos++;
+			break;
+
+		case ',':
+		case ':':
+			if (!depth)
+				return json_fail(r, json_tokener_error_parse_unexpected);
+
+			r->pos++;
+			break;
+
+		default:
+			while ((c = json_peek(r)) != EOF && !strchr(" \t\r\n,:[]{}\"'", c))
+				r->pos++;
+
+			break;
+		}
+	} while (depth);
+
+	return true;
+}
+
+/* strings select object members, integers array elements and null either */
+static bool
+json_path_match(struct json_object *elem, struct json_object *key, size_t idx)
+{
+	if (!elem)
+		return true;
+
+	if (key)
+		return json_object_is_type(elem, json_type_string) &&
+		       !strcmp(json_object_get_string(elem), json_object_get_string(key));
+
+	return json_object_is_type(elem, json_type_int) &&
+	       json_object_get_int64(elem) == (int64_t)idx;
+}
+
+static bool
+json_select(struct json_reader *r, struct json_object *path, size_t depth, struct json_object *res)
+{
+	struct json_object *elem, *key, *val;
+	bool object, match;
+	size_t idx;
+	int c;
+
+	if (depth == json_object_array_length(path)) {
+		if (!json_parse_value(r, &val))
+			return false;
+
+		json_object_array_add(res, val);
+
+		return true;
+	}
+
+	c = json_skip_ws(r);
+
+	if (c != '{' && c != '[')
+		return json_skip_value(r);
+
+	object = (c == '{');
+	elem = json_object_array_get_idx(path, depth);
+	r->pos++;
+
+	for (idx = 0; ; idx++) {
+		c = json_skip_ws(r);
+
+		if (c == EOF)
+			return json_fail(r, json_tokener_error_parse_eof);
+
+		if (idx == 0 && c == (object ? '}' : ']'))
+			break;
+
+		key = NULL;
+
+		if (object) {
+			if (c != '"' && c != '\'')
+				return json_fail(r, json_tokener_error_parse_object_key_name);
+
+			if (!json_parse_value(r, &key))
+				return false;
+
+			if (json_skip_ws(r) != ':') {
+				json_object_put(key);
+
+				return json_fail(r, json_tokener_error_parse_object_key_sep);
+			}
+
+			r->pos++;
+		}
+
+		match = json_path_match(elem, key, idx);
+		json_object_put(key);
+
+		if (!(match ? json_select(r, path, depth + 1, res) : json_skip_value(r)))
+			return false;
+
+		c = json_skip_ws(r);
+
+		if (c == (object ? '}' : ']'))
+			break;
+
+		if (c == EOF)
+			return json_fail(r, json_tokener_error_parse_eof);
+
+		if (c != ',')
+			return json_fail(r, object ? json_tokener_error_parse_object_value_sep
+			                           : json_tokener_error_parse_array);
+
+		r->pos++;
+	}
+
+	r->pos++;
+
+	return true;
+}
+
+static struct json_object *
+ut_json(struct ut_state *s, uint32_t off, struct json_object *args)
+{
+	struct json_object *src = json_object_array_get_idx(args, 0);
+	struct json_object *path = json_object_array_get_idx(args, 1);
+	struct json_object *rv = NULL;
+	struct json_reader r = { 0 };
+	FILE **fp;
+	bool ok;
+
+	/* handles are the ones of the fs module, if it was loaded at all */
+	if (json_object_is_type(src, json_type_string)) {
+		r.buf = json_object_get_string(src);
+		r.len = json_object_get_string_len(src);
+	}
+	else if ((fp = (FILE **)ut_get_extended_type(src, "fs.file")) != NULL ||
+	         (fp = (FILE **)ut_get_extended_type(src, "fs.proc")) != NULL) {
+		if (!*fp)
+			return NULL;
+
+		r.fp = *fp;
+	}
+	else {
+		return NULL;
+	}
+
+	if (path && !json_object_is_type(path, json_type_array))
+		return NULL;
+
+	r.tok = json_tokener_new();
+
+	if (!r.tok)
+		return ut_exception(s, off, UT_ERRMSG_OOM);
+
+	if (path) {
+		rv = json_object_new_array();
+		ok = rv ? json_select(&r, path, 0, rv) : json_fail(&r, json_tokener_error_memory);
+	}
+	else {
+		ok = json_parse_value(&r, &rv);
+	}
+
+	if (ok && (json_skip_ws(&r) != EOF || r.error)) {
+		if (!r.error)
+			r.error = "trailing garbage after value";
+
+		ok = false;
+	}
+
+	json_tokener_free(r.tok);
+
+	if (!ok) {
+		json_object_put(rv);
+
+		return ut_exception(s, off, "Unable to parse JSON: %s", r.error);
+	}
+
+	return rv;
+}
+
+static struct json_object *
+ut_memo(struct ut_state *s, uint32_t off, struct json_object *args)
+{
+	struct json_object *func = json_object_array_get_idx(args, 0);
+	struct ut_op *tag = json_object_get_userdata(func);
+
+	if (!tag || tag->type != T_FUNC)
+		return NULL;
+
+	if (!ut_memo_enable(s, tag->tag.decl))
+		return ut_exception(s, off, UT_ERRMSG_OOM);
+
+	return json_object_get(func);
+}
+
 const struct ut_ops ut = {
 	.register_function = ut_register_function,
 	.register_type = ut_register_extended_type,
@@ -1759,6 +2526,7 @@ const struct ut_ops ut = {
 	.new_double = ut_new_double,
 	.invoke = ut_invoke,
 	.cast_number = ut_cast_number,
+	.read_file = ut_read_file,
 };
 
 static const struct { const char *name; ut_c_fn *func; } functions[] = {
@@ -1782,6 +2550,7 @@ static const struct { const char *name; ut_c_fn *func; } functions[] = {
 	{ "pop",		ut_pop },
 	{ "print",		ut_print },
 	{ "push",		ut_push },
+	{ "range",		ut_range },
 	{ "reverse",	ut_reverse },
 	{ "rindex",		ut_rindex },
 	{ "rtrim",		ut_rtrim },
@@ -1802,6 +2571,8 @@ static const struct { const char *name; ut_c_fn *func; } functions[] = {
 	{ "require",	ut_require },
 	{ "iptoarr",	ut_iptoarr },
 	{ "arrtoip",	ut_arrtoip },
+	{ "json",		ut_json },
+	{ "memo",		ut_memo },
 };
 
 void
@@ -1811,4 +2582,6 @@ ut_lib_init(struct ut_state *state, struct json_object *scope)
 
 	for (i = 0; i < sizeof(functions) / sizeof(functions[0]); i++)
 		ut_register_function(scope, functions[i].name, functions[i].func);
+
+	ut_register_extended_type(state, "range", NULL, free);
 }
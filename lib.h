@@ -20,6 +20,8 @@
 #include "ast.h"
 #include "lexer.h"
 
+#include <stdio.h>
+
 #ifndef ARRAY_SIZE
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
 #endif
@@ -30,4 +32,6 @@ void ut_lib_init(struct ut_state *state, struct json_object *scope);
 
 char *ut_format_error(struct ut_state *state, const char *expr);
 
+char *ut_read_file(FILE *fp, size_t *len);
+
 #endif /* __LIB_H_ */
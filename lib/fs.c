@@ -17,6 +17,7 @@
 #include "../module.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <dirent.h>
@@ -29,11 +30,13 @@
 
 static const struct ut_ops *ops;
 
-static struct json_object *proc_proto;
-static struct json_object *file_proto;
-static struct json_object *dir_proto;
+struct fs_lines {
+	FILE *fp;
+	char *buf;
+	size_t size;
+};
 
-static int last_error = 0;
+static __thread int last_error = 0;
 
 static struct json_object *
 ut_fs_error(struct ut_state *s, uint32_t off, struct json_object *args)
@@ -54,10 +57,11 @@ ut_fs_read_common(struct ut_state *s, uint32_t off, struct json_object *args, co
 {
 	struct json_object *limit = json_object_array_get_idx(args, 0);
 	struct json_object *rv = NULL;
-	char buf[128], *p = NULL, *tmp;
-	size_t rlen, len = 0;
+	size_t size = 0, len = 0;
 	const char *lstr;
+	char *p = NULL;
 	int64_t lsize;
+	ssize_t n;
 
 	FILE **fp = (FILE **)ops->get_type(s->ctx, type);
 
@@ -68,46 +72,20 @@ ut_fs_read_common(struct ut_state *s, uint32_t off, struct json_object *args, co
 		lstr = json_object_get_string(limit);
 
 		if (!strcmp(lstr, "line")) {
-			while (true) {
-				if (!fgets(buf, sizeof(buf), *fp))
-					break;
-
-				rlen = strlen(buf);
-				tmp = realloc(p, len + rlen + 1);
-
-				if (!tmp) {
-					free(p);
-					err_return(ENOMEM);
-				}
-
-				snprintf(tmp + len, rlen + 1, "%s", buf);
-
-				p = tmp;
-				len += rlen;
+			n = getline(&p, &size, *fp);
 
-				if (rlen > 0 && buf[rlen - 1] == '\n')
-					break;
+			if (n < 0 && ferror(*fp)) {
+				free(p);
+				err_return(errno);
 			}
+
+			len = (n > 0) ? n : 0;
 		}
 		else if (!strcmp(lstr, "all")) {
-			while (true) {
-				rlen = fread(buf, 1, sizeof(buf), *fp);
-
-				tmp = realloc(p, len + rlen);
-
-				if (!tmp) {
-					free(p);
-					err_return(ENOMEM);
-				}
-
-				memcpy(tmp + len, buf, rlen);
-
-				p = tmp;
-				len += rlen;
+			p = ops->read_file(*fp, &len);
 
-				if (rlen == 0)
-					break;
-			}
+			if (!p)
+				err_return(errno ? errno : ENOMEM);
 		}
 		else {
 			return NULL;
@@ -221,7 +199,7 @@ ut_fs_popen(struct ut_state *s, uint32_t off, struct json_object *args)
 		err_return(ENOMEM);
 	}
 
-	return ops->set_type(fo, proc_proto, "fs.proc", fp);
+	return ops->set_type(s, fo, "fs.proc", fp);
 }
 
 
@@ -328,7 +306,106 @@ ut_fs_open(struct ut_state *s, uint32_t off, struct json_object *args)
 		err_return(ENOMEM);
 	}
 
-	return ops->set_type(fo, file_proto, "fs.file", fp);
+	return ops->set_type(s, fo, "fs.file", fp);
+}
+
+static struct json_object *
+ut_fs_readfile(struct ut_state *s, uint32_t off, struct json_object *args)
+{
+	struct json_object *path = json_object_array_get_idx(args, 0);
+	struct json_object *rv;
+	size_t len;
+	FILE *fp;
+	char *p;
+
+	if (!json_object_is_type(path, json_type_string))
+		err_return(EINVAL);
+
+	fp = fopen(json_object_get_string(path), "r");
+
+	if (!fp)
+		err_return(errno);
+
+	p = ops->read_file(fp, &len);
+	fclose(fp);
+
+	if (!p)
+		err_return(errno ? errno : ENOMEM);
+
+	rv = json_object_new_string_len(p, len);
+	free(p);
+
+	return rv;
+}
+
+
+static struct json_object *
+ut_fs_lines_next(struct ut_state *s, uint32_t off, struct json_object *args)
+{
+	struct fs_lines **lp = (struct fs_lines **)ops->get_type(s->ctx, "fs.lines");
+	ssize_t n;
+
+	if (!lp || !*lp || !(*lp)->fp)
+		err_return(EBADF);
+
+	/* the line buffer is kept across calls */
+	n = getline(&(*lp)->buf, &(*lp)->size, (*lp)->fp);
+
+	if (n < 0) {
+		if (ferror((*lp)->fp))
+			err_return(errno);
+
+		return NULL;
+	}
+
+	return json_object_new_string_len((*lp)->buf, n);
+}
+
+static struct json_object *
+ut_fs_lines_close(struct ut_state *s, uint32_t off, struct json_object *args)
+{
+	struct fs_lines **lp = (struct fs_lines **)ops->get_type(s->ctx, "fs.lines");
+
+	if (!lp || !*lp || !(*lp)->fp)
+		err_return(EBADF);
+
+	fclose((*lp)->fp);
+	(*lp)->fp = NULL;
+
+	return json_object_new_boolean(true);
+}
+
+static struct json_object *
+ut_fs_lines(struct ut_state *s, uint32_t off, struct json_object *args)
+{
+	struct json_object *path = json_object_array_get_idx(args, 0);
+	struct json_object *lo;
+	struct fs_lines *l;
+
+	if (!json_object_is_type(path, json_type_string))
+		err_return(EINVAL);
+
+	l = calloc(1, sizeof(*l));
+
+	if (!l)
+		err_return(ENOMEM);
+
+	l->fp = fopen(json_object_get_string(path), "r");
+
+	if (!l->fp) {
+		free(l);
+		err_return(errno);
+	}
+
+	lo = json_object_new_object();
+
+	if (!lo) {
+		fclose(l->fp);
+		free(l);
+		err_return(ENOMEM);
+	}
+
+	return ops->set_type(s, lo, "fs.lines", l);
 }
 
 
@@ -423,7 +500,7 @@ ut_fs_opendir(struct ut_state *s, uint32_t off, struct json_object *args)
 		err_return(ENOMEM);
 	}
 
-	return ops->set_type(diro, dir_proto, "fs.dir", dp);
+	return ops->set_type(s, diro, "fs.dir", dp);
 }
 
 static struct json_object *
@@ -685,6 +762,11 @@ static const struct { const char *name; ut_c_fn *func; } file_fns[] = {
 	{ "close",		ut_fs_close },
 };
 
+static const struct { const char *name; ut_c_fn *func; } lines_fns[] = {
+	{ "next",		ut_fs_lines_next },
+	{ "close",		ut_fs_lines_close },
+};
+
 static const struct { const char *name; ut_c_fn *func; } dir_fns[] = {
 	{ "read",		ut_fs_readdir },
 	{ "seek",		ut_fs_seekdir },
@@ -695,6 +777,8 @@ static const struct { const char *name; ut_c_fn *func; } dir_fns[] = {
 static const struct { const char *name; ut_c_fn *func; } global_fns[] = {
 	{ "error",		ut_fs_error },
 	{ "open",		ut_fs_open },
+	{ "readfile",	ut_fs_readfile },
+	{ "lines",		ut_fs_lines },
 	{ "opendir",	ut_fs_opendir },
 	{ "popen",		ut_fs_popen },
 	{ "readlink",	ut_fs_readlink },
@@ -721,19 +805,36 @@ static void close_dir(void *ud) {
 	closedir((DIR *)ud);
 }
 
+static void close_lines(void *ud) {
+	struct fs_lines *l = ud;
+
+	if (l->fp)
+		fclose(l->fp);
+
+	free(l->buf);
+	free(l);
+}
+
 void ut_module_init(const struct ut_ops *ut, struct ut_state *s, struct json_object *scope)
 {
-	ops = ut;
-	ops->register_type("fs.proc", close_proc);
-	ops->register_type("fs.file", close_file);
-	ops->register_type("fs.dir", close_dir);
+	struct json_object *proc_proto, *file_proto, *dir_proto, *lines_proto;
 
-	proc_proto = ops->new_object(NULL);
-	file_proto = ops->new_object(NULL);
-	dir_proto = ops->new_object(NULL);
+	if (!ops)
+		ops = ut;
+
+	proc_proto = ops->new_object(s, NULL);
+	file_proto = ops->new_object(s, NULL);
+	dir_proto = ops->new_object(s, NULL);
+	lines_proto = ops->new_object(s, NULL);
 
 	register_functions(ops, global_fns, scope);
 	register_functions(ops, proc_fns, proc_proto);
 	register_functions(ops, file_fns, file_proto);
 	register_functions(ops, dir_fns, dir_proto);
+	register_functions(ops, lines_fns, lines_proto);
+
+	ops->register_type(s, "fs.proc", proc_proto, close_proc);
+	ops->register_type(s, "fs.file", file_proto, close_file);
+	ops->register_type(s, "fs.dir", dir_proto, close_dir);
+	ops->register_type(s, "fs.lines", lines_proto, close_lines);
 }
@@ -179,7 +179,8 @@ static const struct { const char *name; ut_c_fn *func; } global_fns[] = {
 
 void ut_module_init(const struct ut_ops *ut, struct ut_state *s, struct json_object *scope)
 {
-	ops = ut;
+	if (!ops)
+		ops = ut;
 
 	register_functions(ops, global_fns, scope);
 }
@@ -25,14 +25,15 @@
 
 static const struct ut_ops *ops;
 
-static struct json_object *conn_proto;
-
-static enum ubus_msg_status last_error = 0;
+static __thread enum ubus_msg_status last_error = 0;
 
 struct ubus_connection {
 	int timeout;
 	struct blob_buf buf;
 	struct ubus_context *ctx;
+	struct json_object *ids;
+	struct ubus_event_handler remove_ev;
+	bool remove_ev_registered;
 };
 
 static struct json_object *
@@ -171,7 +172,7 @@ ut_ubus_connect(struct ut_state *s, uint32_t off, struct json_object *args)
 
 	ubus_add_uloop(c->ctx);
 
-	return ops->set_type(co, conn_proto, "ubus.connection", c);
+	return ops->set_type(s, co, "ubus.connection", c);
 }
 
 static void
@@ -236,9 +237,137 @@ ut_ubus_call_cb(struct ubus_request *req, int type, struct blob_attr *msg)
 {
 	struct json_object **res = (struct json_object **)req->priv;
 
+	json_object_put(*res);
 	*res = msg ? ut_blob_array_to_json(blob_data(msg), blob_len(msg), true) : NULL;
 }
 
+static void
+ut_ubus_forget(struct ubus_connection *c, const char *path)
+{
+	if (c->ids)
+		json_object_object_del(c->ids, path);
+}
+
+static void
+ut_ubus_remove_cb(struct ubus_context *ctx, struct ubus_event_handler *ev,
+                  const char *type, struct blob_attr *msg)
+{
+	struct ubus_connection *c = container_of(ev, struct ubus_connection, remove_ev);
+	static const struct blobmsg_policy policy = { "path", BLOBMSG_TYPE_STRING };
+	struct blob_attr *path;
+
+	blobmsg_parse(&policy, 1, &path, blob_data(msg), blob_len(msg));
+
+	if (path)
+		ut_ubus_forget(c, blobmsg_get_string(path));
+}
+
+/*
+ * Resolve an object path to its id, successful lookups are remembered until
+ * the object is removed. Removal events are only seen while the uloop runs
+ * so callers retry with a fresh lookup if a cached id turns out to be gone.
+ */
+static enum ubus_msg_status
+ut_ubus_lookup(struct ubus_connection *c, const char *path, uint32_t *id, bool *cached)
+{
+	enum ubus_msg_status rv;
+	struct json_object *v;
+
+	if (c->ids && json_object_object_get_ex(c->ids, path, &v)) {
+		*id = (uint32_t)json_object_get_int64(v);
+		*cached = true;
+
+		return UBUS_STATUS_OK;
+	}
+
+	*cached = false;
+	rv = ubus_lookup_id(c->ctx, path, id);
+
+	if (rv != UBUS_STATUS_OK)
+		return rv;
+
+	if (!c->remove_ev_registered) {
+		c->remove_ev.cb = ut_ubus_remove_cb;
+
+		if (ubus_register_event_handler(c->ctx, &c->remove_ev, "ubus.object.remove"))
+			return UBUS_STATUS_OK;
+
+		c->remove_ev_registered = true;
+	}
+
+	if (!c->ids)
+		c->ids = json_object_new_object();
+
+	if (c->ids)
+		json_object_object_add(c->ids, path, json_object_new_int64(*id));
+
+	return UBUS_STATUS_OK;
+}
+
+static bool
+ut_ubus_check_call(struct json_object *objname, struct json_object *funname,
+                   struct json_object *funargs)
+{
+	return (json_object_is_type(objname, json_type_string) &&
+	        json_object_is_type(funname, json_type_string) &&
+	        (!funargs || json_object_is_type(funargs, json_type_object)));
+}
+
+/* send a request without waiting for the reply */
+static enum ubus_msg_status
+ut_ubus_start(struct ubus_connection *c, struct json_object *objname,
+              struct json_object *funname, struct json_object *funargs,
+              struct ubus_request *req, struct json_object **res, bool *cached)
+{
+	enum ubus_msg_status rv;
+	uint32_t id;
+
+	blob_buf_init(&c->buf, 0);
+
+	if (funargs && !blobmsg_add_object(&c->buf, funargs))
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	rv = ut_ubus_lookup(c, json_object_get_string(objname), &id, cached);
+
+	if (rv != UBUS_STATUS_OK)
+		return rv;
+
+	rv = ubus_invoke_async(c->ctx, id, json_object_get_string(funname), c->buf.head, req);
+
+	if (rv != UBUS_STATUS_OK)
+		return rv;
+
+	req->data_cb = ut_ubus_call_cb;
+	req->priv = res;
+
+	return UBUS_STATUS_OK;
+}
+
+static enum ubus_msg_status
+ut_ubus_invoke(struct ubus_connection *c, struct json_object *objname,
+               struct json_object *funname, struct json_object *funargs,
+               struct json_object **res)
+{
+	struct ubus_request req;
+	enum ubus_msg_status rv;
+	bool cached;
+
+	*res = NULL;
+	rv = ut_ubus_start(c, objname, funname, funargs, &req, res, &cached);
+
+	if (rv == UBUS_STATUS_OK)
+		rv = ubus_complete_request(c->ctx, &req, c->timeout * 1000);
+
+	/* the object went away or got replaced since it was looked up */
+	if (rv == UBUS_STATUS_NOT_FOUND && cached) {
+		ut_ubus_forget(c, json_object_get_string(objname));
+
+		return ut_ubus_invoke(c, objname, funname, funargs, res);
+	}
+
+	return rv;
+}
+
 static struct json_object *
 ut_ubus_call(struct ut_state *s, uint32_t off, struct json_object *args)
 {
@@ -248,33 +377,114 @@ ut_ubus_call(struct ut_state *s, uint32_t off, struct json_object *args)
 	struct json_object *funargs = json_object_array_get_idx(args, 2);
 	struct json_object *res;
 	enum ubus_msg_status rv;
-	uint32_t id;
 
 	if (!c || !*c || !(*c)->ctx)
 		err_return(UBUS_STATUS_CONNECTION_FAILED);
 
-	if (!json_object_is_type(objname, json_type_string) ||
-	    !json_object_is_type(funname, json_type_string) ||
-	    (funargs && !json_object_is_type(funargs, json_type_object)))
+	if (!ut_ubus_check_call(objname, funname, funargs))
 		err_return(UBUS_STATUS_INVALID_ARGUMENT);
 
-	blob_buf_init(&(*c)->buf, 0);
+	rv = ut_ubus_invoke(*c, objname, funname, funargs, &res);
 
-	if (funargs && !blobmsg_add_object(&(*c)->buf, funargs))
-		err_return(UBUS_STATUS_UNKNOWN_ERROR);
+	if (rv != UBUS_STATUS_OK) {
+		json_object_put(res);
+		err_return(rv);
+	}
 
-	rv = ubus_lookup_id((*c)->ctx, json_object_get_string(objname), &id);
+	return res;
+}
 
-	if (rv != UBUS_STATUS_OK)
-		err_return(rv);
+/*
+ * Issue all given [ object, method, args ] calls before waiting for any
+ * reply, so that the requests are processed concurrently. Returns an array
+ * of the results in call order, failed calls yield null and set the error.
+ */
+static struct json_object *
+ut_ubus_call_many(struct ut_state *s, uint32_t off, struct json_object *args)
+{
+	struct ubus_connection **c = (struct ubus_connection **)ops->get_type(s->ctx, "ubus.connection");
+	struct json_object *calls = json_object_array_get_idx(args, 0);
+	struct json_object *call, *objname, *funname, *funargs, **res;
+	enum ubus_msg_status *status, rv;
+	struct ubus_request *reqs;
+	struct json_object *rva;
+	size_t i, len;
+	bool *cached;
 
-	rv = ubus_invoke((*c)->ctx, id, json_object_get_string(funname), (*c)->buf.head,
-	                 ut_ubus_call_cb, &res, (*c)->timeout * 1000);
+	if (!c || !*c || !(*c)->ctx)
+		err_return(UBUS_STATUS_CONNECTION_FAILED);
+
+	if (!json_object_is_type(calls, json_type_array))
+		err_return(UBUS_STATUS_INVALID_ARGUMENT);
+
+	len = json_object_array_length(calls);
+	rva = json_object_new_array();
+	reqs = calloc(len ? len : 1, sizeof(*reqs));
+	res = calloc(len ? len : 1, sizeof(*res));
+	status = calloc(len ? len : 1, sizeof(*status));
+	cached = calloc(len ? len : 1, sizeof(*cached));
+
+	if (!rva || !reqs || !res || !status || !cached) {
+		json_object_put(rva);
+		rva = NULL;
+		rv = UBUS_STATUS_UNKNOWN_ERROR;
+		goto out;
+	}
+
+	for (i = 0; i < len; i++) {
+		call = json_object_array_get_idx(calls, i);
+		objname = json_object_array_get_idx(call, 0);
+		funname = json_object_array_get_idx(call, 1);
+		funargs = json_object_array_get_idx(call, 2);
+
+		if (!json_object_is_type(call, json_type_array) ||
+		    !ut_ubus_check_call(objname, funname, funargs))
+			status[i] = UBUS_STATUS_INVALID_ARGUMENT;
+		else
+			status[i] = ut_ubus_start(*c, objname, funname, funargs,
+			                          &reqs[i], &res[i], &cached[i]);
+	}
+
+	/* replies to other requests are dispatched while waiting for one */
+	for (i = 0; i < len; i++)
+		if (status[i] == UBUS_STATUS_OK)
+			status[i] = ubus_complete_request((*c)->ctx, &reqs[i], (*c)->timeout * 1000);
+
+	rv = UBUS_STATUS_OK;
+
+	for (i = 0; i < len; i++) {
+		if (status[i] == UBUS_STATUS_NOT_FOUND && cached[i]) {
+			call = json_object_array_get_idx(calls, i);
+			objname = json_object_array_get_idx(call, 0);
+
+			ut_ubus_forget(*c, json_object_get_string(objname));
+			json_object_put(res[i]);
+
+			status[i] = ut_ubus_invoke(*c, objname,
+			                           json_object_array_get_idx(call, 1),
+			                           json_object_array_get_idx(call, 2),
+			                           &res[i]);
+		}
+
+		if (status[i] != UBUS_STATUS_OK) {
+			json_object_put(res[i]);
+			res[i] = NULL;
+			rv = status[i];
+		}
+
+		json_object_array_add(rva, res[i]);
+	}
+
+out:
+	free(reqs);
+	free(res);
+	free(status);
+	free(cached);
 
 	if (rv != UBUS_STATUS_OK)
-		err_return(rv);
+		last_error = rv;
 
-	return res;
+	return rva;
 }
 
 static struct json_object *
@@ -287,6 +497,10 @@ ut_ubus_disconnect(struct ut_state *s, uint32_t off, struct json_object *args)
 
 	ubus_free((*c)->ctx);
 	(*c)->ctx = NULL;
+	(*c)->remove_ev_registered = false;
+
+	json_object_put((*c)->ids);
+	(*c)->ids = NULL;
 
 	return json_object_new_boolean(true);
 }
@@ -300,6 +514,7 @@ static const struct { const char *name; ut_c_fn *func; } global_fns[] = {
 static const struct { const char *name; ut_c_fn *func; } conn_fns[] = {
 	{ "list",		ut_ubus_list },
 	{ "call",		ut_ubus_call },
+	{ "call_many",	ut_ubus_call_many },
 	{ "disconnect",	ut_ubus_disconnect },
 };
 
@@ -312,16 +527,21 @@ static void close_connection(void *ud) {
 	if (conn->ctx)
 		ubus_free(conn->ctx);
 
+	json_object_put(conn->ids);
 	free(conn);
 }
 
 void ut_module_init(const struct ut_ops *ut, struct ut_state *s, struct json_object *scope)
 {
-	ops = ut;
-	ops->register_type("ubus.connection", close_connection);
+	struct json_object *conn_proto;
+
+	if (!ops)
+		ops = ut;
 
-	conn_proto = ops->new_object(NULL);
+	conn_proto = ops->new_object(s, NULL);
 
 	register_functions(ops, global_fns, scope);
 	register_functions(ops, conn_fns, conn_proto);
+
+	ops->register_type(s, "ubus.connection", conn_proto, close_connection);
 }
@@ -23,9 +23,7 @@
 
 static const struct ut_ops *ops;
 
-static struct json_object *uci_proto;
-
-static int last_error = 0;
+static __thread int last_error = 0;
 
 enum pkg_cmd {
 	CMD_SAVE,
@@ -33,6 +31,24 @@ enum pkg_cmd {
 	CMD_REVERT
 };
 
+/*
+ * JSON representation of a loaded package, built on first use and dropped
+ * whenever the package is changed through the cursor. The sections are
+ * indexed by name, by type and in order of appearance.
+ */
+struct uci_snapshot {
+	struct uci_snapshot *next;
+	struct uci_package *package;
+	struct json_object *sections;
+	struct json_object *types;
+	struct json_object *all;
+};
+
+struct uci_cursor {
+	struct uci_context *ctx;
+	struct uci_snapshot *snapshots;
+};
+
 static struct json_object *
 ut_uci_error(struct ut_state *s, uint32_t off, struct json_object *args)
 {
@@ -72,6 +88,7 @@ ut_uci_cursor(struct ut_state *s, uint32_t off, struct json_object *args)
 	struct json_object *cdir = json_object_array_get_idx(args, 0);
 	struct json_object *sdir = json_object_array_get_idx(args, 1);
 	struct json_object *co;
+	struct uci_cursor *cur;
 	struct uci_context *c;
 	int rv;
 
@@ -98,21 +115,47 @@ ut_uci_cursor(struct ut_state *s, uint32_t off, struct json_object *args)
 			err_return(rv);
 	}
 
+	cur = calloc(1, sizeof(*cur));
 	co = json_object_new_object();
 
-	if (!co) {
+	if (!cur || !co) {
 		uci_free_context(c);
+		json_object_put(co);
+		free(cur);
 		err_return(UCI_ERR_MEM);
 	}
 
-	return ops->set_type(co, uci_proto, "uci.cursor", c);
+	cur->ctx = c;
+
+	return ops->set_type(s, co, "uci.cursor", cur);
+}
+
+static void
+snapshot_drop(struct uci_cursor *c, struct uci_package *p)
+{
+	struct uci_snapshot **sp, *snap;
+
+	for (sp = &c->snapshots; *sp; sp = &(*sp)->next) {
+		if ((*sp)->package != p)
+			continue;
+
+		snap = *sp;
+		*sp = snap->next;
+
+		json_object_put(snap->sections);
+		json_object_put(snap->types);
+		json_object_put(snap->all);
+		free(snap);
+
+		break;
+	}
 }
 
 
 static struct json_object *
 ut_uci_load(struct ut_state *s, uint32_t off, struct json_object *args)
 {
-	struct uci_context **c = (struct uci_context **)ops->get_type(s->ctx, "uci.cursor");
+	struct uci_cursor **c = (struct uci_cursor **)ops->get_type(s->ctx, "uci.cursor");
 	struct json_object *conf = json_object_array_get_idx(args, 0);
 	struct uci_element *e;
 
@@ -122,15 +165,16 @@ ut_uci_load(struct ut_state *s, uint32_t off, struct json_object *args)
 	if (!json_object_is_type(conf, json_type_string))
 		err_return(UCI_ERR_INVAL);
 
-	uci_foreach_element(&(*c)->root, e) {
+	uci_foreach_element(&(*c)->ctx->root, e) {
 		if (!strcmp(e->name, json_object_get_string(conf))) {
-			uci_unload(*c, uci_to_package(e));
+			snapshot_drop(*c, uci_to_package(e));
+			uci_unload((*c)->ctx, uci_to_package(e));
 			break;
 		}
 	}
 
-	if (uci_load(*c, json_object_get_string(conf), NULL))
-		err_return((*c)->err);
+	if (uci_load((*c)->ctx, json_object_get_string(conf), NULL))
+		err_return((*c)->ctx->err);
 
 	return json_object_new_boolean(true);
 }
@@ -138,7 +182,7 @@ ut_uci_load(struct ut_state *s, uint32_t off, struct json_object *args)
 static struct json_object *
 ut_uci_unload(struct ut_state *s, uint32_t off, struct json_object *args)
 {
-	struct uci_context **c = (struct uci_context **)ops->get_type(s->ctx, "uci.cursor");
+	struct uci_cursor **c = (struct uci_cursor **)ops->get_type(s->ctx, "uci.cursor");
 	struct json_object *conf = json_object_array_get_idx(args, 0);
 	struct uci_element *e;
 
@@ -148,9 +192,10 @@ ut_uci_unload(struct ut_state *s, uint32_t off, struct json_object *args)
 	if (!json_object_is_type(conf, json_type_string))
 		err_return(UCI_ERR_INVAL);
 
-	uci_foreach_element(&(*c)->root, e) {
+	uci_foreach_element(&(*c)->ctx->root, e) {
 		if (!strcmp(e->name, json_object_get_string(conf))) {
-			uci_unload(*c, uci_to_package(e));
+			snapshot_drop(*c, uci_to_package(e));
+			uci_unload((*c)->ctx, uci_to_package(e));
 
 			return json_object_new_boolean(true);
 		}
@@ -237,32 +282,144 @@ section_to_json(struct uci_section *s, int index)
 	return so;
 }
 
-static struct json_object *
-package_to_json(struct uci_package *p)
+static struct uci_snapshot *
+snapshot_get(struct uci_cursor *c, struct uci_package *p)
 {
-	struct json_object *po = json_object_new_object();
-	struct json_object *so;
+	struct json_object *so, *list;
+	struct uci_snapshot *snap;
+	struct uci_section *sc;
 	struct uci_element *e;
 	int i = 0;
 
-	if (!po)
+	for (snap = c->snapshots; snap; snap = snap->next)
+		if (snap->package == p)
+			return snap;
+
+	snap = calloc(1, sizeof(*snap));
+
+	if (!snap)
 		return NULL;
 
+	snap->package = p;
+	snap->sections = json_object_new_object();
+	snap->types = json_object_new_object();
+	snap->all = json_object_new_array();
+
+	if (!snap->sections || !snap->types || !snap->all)
+		goto fail;
+
 	uci_foreach_element(&p->sections, e) {
-		so = section_to_json(uci_to_section(e), i++);
-		json_object_object_add(po, e->name, so);
+		sc = uci_to_section(e);
+		so = section_to_json(sc, i++);
+
+		if (!so)
+			goto fail;
+
+		if (!json_object_object_get_ex(snap->types, sc->type, &list)) {
+			list = json_object_new_array();
+
+			if (!list) {
+				json_object_put(so);
+				goto fail;
+			}
+
+			json_object_object_add(snap->types, sc->type, list);
+		}
+
+		json_object_array_add(list, json_object_get(so));
+		json_object_array_add(snap->all, json_object_get(so));
+		json_object_object_add(snap->sections, e->name, so);
 	}
 
+	snap->next = c->snapshots;
+	c->snapshots = snap;
+
+	return snap;
+
+fail:
+	json_object_put(snap->sections);
+	json_object_put(snap->types);
+	json_object_put(snap->all);
+	free(snap);
+
+	return NULL;
+}
+
+/*
+ * Values handed out to scripts must not alias the snapshot. String values
+ * are immutable and can be shared, only the containers need to be copied.
+ */
+static struct json_object *
+value_copy(struct json_object *v)
+{
+	struct json_object *arr;
+	size_t i;
+
+	if (!json_object_is_type(v, json_type_array))
+		return json_object_get(v);
+
+	arr = json_object_new_array();
+
+	if (arr)
+		for (i = 0; i < json_object_array_length(v); i++)
+			json_object_array_add(arr, json_object_get(json_object_array_get_idx(v, i)));
+
+	return arr;
+}
+
+static struct json_object *
+section_copy(struct json_object *so, bool index)
+{
+	struct json_object *co = json_object_new_object();
+
+	if (!co)
+		return NULL;
+
+	json_object_object_foreach(so, k, v) {
+		if (!index && !strcmp(k, ".index"))
+			continue;
+
+		json_object_object_add(co, k, value_copy(v));
+	}
+
+	return co;
+}
+
+static struct json_object *
+package_copy(struct uci_snapshot *snap)
+{
+	struct json_object *po = json_object_new_object();
+
+	if (!po)
+		return NULL;
+
+	json_object_object_foreach(snap->sections, k, v)
+		json_object_object_add(po, k, section_copy(v, true));
+
 	return po;
 }
 
+static struct uci_package *
+find_package(struct uci_context *ctx, const char *name)
+{
+	struct uci_element *e;
+
+	uci_foreach_element(&ctx->root, e)
+		if (!strcmp(e->name, name))
+			return uci_to_package(e);
+
+	return NULL;
+}
+
 static struct json_object *
 ut_uci_get_any(struct ut_state *s, uint32_t off, struct json_object *args, bool all)
 {
-	struct uci_context **c = (struct uci_context **)ops->get_type(s->ctx, "uci.cursor");
+	struct uci_cursor **c = (struct uci_cursor **)ops->get_type(s->ctx, "uci.cursor");
 	struct json_object *conf = json_object_array_get_idx(args, 0);
 	struct json_object *sect = json_object_array_get_idx(args, 1);
 	struct json_object *opt = json_object_array_get_idx(args, 2);
+	struct json_object *so;
+	struct uci_snapshot *snap;
 	struct uci_ptr ptr = {};
 	int rv;
 
@@ -281,7 +438,7 @@ ut_uci_get_any(struct ut_state *s, uint32_t off, struct json_object *args, bool
 	ptr.section = sect ? json_object_get_string(sect) : NULL;
 	ptr.option = opt ? json_object_get_string(opt) : NULL;
 
-	rv = lookup_ptr(*c, &ptr, true);
+	rv = lookup_ptr((*c)->ctx, &ptr, true);
 
 	if (rv != UCI_OK)
 		err_return(rv);
@@ -290,17 +447,24 @@ ut_uci_get_any(struct ut_state *s, uint32_t off, struct json_object *args, bool
 		err_return(UCI_ERR_NOTFOUND);
 
 	if (all) {
-		if (ptr.section) {
-			if (!ptr.s)
-				err_return(UCI_ERR_NOTFOUND);
-
-			return section_to_json(ptr.s, -1);
-		}
+		if (ptr.section && !ptr.s)
+			err_return(UCI_ERR_NOTFOUND);
 
 		if (!ptr.p)
 			err_return(UCI_ERR_NOTFOUND);
 
-		return package_to_json(ptr.p);
+		snap = snapshot_get(*c, ptr.p);
+
+		if (!snap)
+			err_return(UCI_ERR_MEM);
+
+		if (!ptr.section)
+			return package_copy(snap);
+
+		if (!json_object_object_get_ex(snap->sections, ptr.s->e.name, &so))
+			err_return(UCI_ERR_NOTFOUND);
+
+		return section_copy(so, false);
 	}
 
 	if (ptr.option) {
@@ -331,68 +495,52 @@ ut_uci_get_all(struct ut_state *s, uint32_t off, struct json_object *args)
 static struct json_object *
 ut_uci_get_first(struct ut_state *s, uint32_t off, struct json_object *args)
 {
-	struct uci_context **c = (struct uci_context **)ops->get_type(s->ctx, "uci.cursor");
+	struct uci_cursor **c = (struct uci_cursor **)ops->get_type(s->ctx, "uci.cursor");
 	struct json_object *conf = json_object_array_get_idx(args, 0);
 	struct json_object *type = json_object_array_get_idx(args, 1);
 	struct json_object *opt = json_object_array_get_idx(args, 2);
-	struct uci_package *p = NULL;
-	struct uci_section *sc;
-	struct uci_element *e;
-	struct uci_ptr ptr = {};
-	int rv;
+	struct json_object *list, *so, *val;
+	struct uci_snapshot *snap;
+	struct uci_package *p;
+	const char *name;
 
 	if (!json_object_is_type(conf, json_type_string) ||
 	    !json_object_is_type(type, json_type_string) ||
 	    (opt && !json_object_is_type(opt, json_type_string)))
 		err_return(UCI_ERR_INVAL);
 
-	uci_foreach_element(&(*c)->root, e) {
-		if (strcmp(e->name, json_object_get_string(conf)))
-			continue;
-
-		p = uci_to_package(e);
-		break;
-	}
+	p = find_package((*c)->ctx, json_object_get_string(conf));
 
 	if (!p)
 		err_return(UCI_ERR_NOTFOUND);
 
-	uci_foreach_element(&p->sections, e) {
-		sc = uci_to_section(e);
-
-		if (strcmp(sc->type, json_object_get_string(type)))
-			continue;
-
-		if (!opt)
-			return json_object_new_string(sc->e.name);
+	snap = snapshot_get(*c, p);
 
-		ptr.package = json_object_get_string(conf);
-		ptr.section = sc->e.name;
-		ptr.option = json_object_get_string(opt);
-		ptr.p = p;
-		ptr.s = sc;
+	if (!snap)
+		err_return(UCI_ERR_MEM);
 
-		rv = lookup_ptr(*c, &ptr, false);
+	if (!json_object_object_get_ex(snap->types, json_object_get_string(type), &list))
+		err_return(UCI_ERR_NOTFOUND);
 
-		if (rv != UCI_OK)
-			err_return(rv);
+	so = json_object_array_get_idx(list, 0);
+	name = opt ? json_object_get_string(opt) : ".name";
 
-		if (!(ptr.flags & UCI_LOOKUP_COMPLETE))
-			err_return(UCI_ERR_NOTFOUND);
+	/* option names never start with a dot, don't expose meta data */
+	if (opt && *name == '.')
+		err_return(UCI_ERR_NOTFOUND);
 
-		return option_to_json(ptr.o);
-	}
+	if (!json_object_object_get_ex(so, name, &val))
+		err_return(UCI_ERR_NOTFOUND);
 
-	err_return(UCI_ERR_NOTFOUND);
+	return value_copy(val);
 }
 
 static struct json_object *
 ut_uci_add(struct ut_state *s, uint32_t off, struct json_object *args)
 {
-	struct uci_context **c = (struct uci_context **)ops->get_type(s->ctx, "uci.cursor");
+	struct uci_cursor **c = (struct uci_cursor **)ops->get_type(s->ctx, "uci.cursor");
 	struct json_object *conf = json_object_array_get_idx(args, 0);
 	struct json_object *type = json_object_array_get_idx(args, 1);
-	struct uci_element *e = NULL;
 	struct uci_package *p = NULL;
 	struct uci_section *sc = NULL;
 	int rv;
@@ -401,17 +549,14 @@ ut_uci_add(struct ut_state *s, uint32_t off, struct json_object *args)
 	    !json_object_is_type(type, json_type_string))
 	    err_return(UCI_ERR_INVAL);
 
-	uci_foreach_element(&(*c)->root, e) {
-		if (!strcmp(e->name, json_object_get_string(conf))) {
-			p = uci_to_package(e);
-			break;
-		}
-	}
+	p = find_package((*c)->ctx, json_object_get_string(conf));
 
 	if (!p)
 		err_return(UCI_ERR_NOTFOUND);
 
-	rv = uci_add_section(*c, p, json_object_get_string(type), &sc);
+	snapshot_drop(*c, p);
+
+	rv = uci_add_section((*c)->ctx, p, json_object_get_string(type), &sc);
 
 	if (rv != UCI_OK)
 		err_return(rv);
@@ -468,7 +613,7 @@ json_to_value(struct json_object *val, const char **p, bool *is_list)
 static struct json_object *
 ut_uci_set(struct ut_state *s, uint32_t off, struct json_object *args)
 {
-	struct uci_context **c = (struct uci_context **)ops->get_type(s->ctx, "uci.cursor");
+	struct uci_cursor **c = (struct uci_cursor **)ops->get_type(s->ctx, "uci.cursor");
 	struct json_object *conf = json_object_array_get_idx(args, 0);
 	struct json_object *sect = json_object_array_get_idx(args, 1);
 	struct json_object *opt = NULL, *val = NULL;
@@ -508,11 +653,13 @@ ut_uci_set(struct ut_state *s, uint32_t off, struct json_object *args)
 	ptr.section = json_object_get_string(sect);
 	ptr.option = opt ? json_object_get_string(opt) : NULL;
 
-	rv = lookup_ptr(*c, &ptr, true);
+	rv = lookup_ptr((*c)->ctx, &ptr, true);
 
 	if (rv != UCI_OK)
 		err_return(rv);
 
+	snapshot_drop(*c, ptr.p);
+
 	if (!ptr.s && ptr.option)
 		err_return(UCI_ERR_NOTFOUND);
 
@@ -528,7 +675,7 @@ ut_uci_set(struct ut_state *s, uint32_t off, struct json_object *args)
 			if (ptr.o) {
 				ptr.value = NULL;
 
-				rv = uci_delete(*c, &ptr);
+				rv = uci_delete((*c)->ctx, &ptr);
 
 				if (rv != UCI_OK)
 					err_return(rv);
@@ -539,7 +686,7 @@ ut_uci_set(struct ut_state *s, uint32_t off, struct json_object *args)
 		else {
 			i = 1;
 
-			rv = uci_set(*c, &ptr);
+			rv = uci_set((*c)->ctx, &ptr);
 
 			if (rv != UCI_OK)
 				err_return(rv);
@@ -549,14 +696,14 @@ ut_uci_set(struct ut_state *s, uint32_t off, struct json_object *args)
 			if (!json_to_value(json_object_array_get_idx(val, i), &ptr.value, NULL))
 				continue;
 
-			rv = uci_add_list(*c, &ptr);
+			rv = uci_add_list((*c)->ctx, &ptr);
 
 			if (rv != UCI_OK)
 				err_return(rv);
 		}
 	}
 	else {
-		rv = uci_set(*c, &ptr);
+		rv = uci_set((*c)->ctx, &ptr);
 
 		if (rv != UCI_OK)
 			err_return(rv);
@@ -568,7 +715,7 @@ ut_uci_set(struct ut_state *s, uint32_t off, struct json_object *args)
 static struct json_object *
 ut_uci_delete(struct ut_state *s, uint32_t off, struct json_object *args)
 {
-	struct uci_context **c = (struct uci_context **)ops->get_type(s->ctx, "uci.cursor");
+	struct uci_cursor **c = (struct uci_cursor **)ops->get_type(s->ctx, "uci.cursor");
 	struct json_object *conf = json_object_array_get_idx(args, 0);
 	struct json_object *sect = json_object_array_get_idx(args, 1);
 	struct json_object *opt = json_object_array_get_idx(args, 2);
@@ -584,15 +731,17 @@ ut_uci_delete(struct ut_state *s, uint32_t off, struct json_object *args)
 	ptr.section = json_object_get_string(sect);
 	ptr.option = opt ? json_object_get_string(opt) : NULL;
 
-	rv = lookup_ptr(*c, &ptr, true);
+	rv = lookup_ptr((*c)->ctx, &ptr, true);
 
 	if (rv != UCI_OK)
 		err_return(rv);
 
+	snapshot_drop(*c, ptr.p);
+
 	if (opt ? !ptr.o : !ptr.s)
 		err_return(UCI_ERR_NOTFOUND);
 
-	rv = uci_delete(*c, &ptr);
+	rv = uci_delete((*c)->ctx, &ptr);
 
 	if (rv != UCI_OK)
 		err_return(rv);
@@ -603,7 +752,7 @@ ut_uci_delete(struct ut_state *s, uint32_t off, struct json_object *args)
 static struct json_object *
 ut_uci_rename(struct ut_state *s, uint32_t off, struct json_object *args)
 {
-	struct uci_context **c = (struct uci_context **)ops->get_type(s->ctx, "uci.cursor");
+	struct uci_cursor **c = (struct uci_cursor **)ops->get_type(s->ctx, "uci.cursor");
 	struct json_object *conf = json_object_array_get_idx(args, 0);
 	struct json_object *sect = json_object_array_get_idx(args, 1);
 	struct json_object *opt = NULL, *val = NULL;
@@ -644,15 +793,17 @@ ut_uci_rename(struct ut_state *s, uint32_t off, struct json_object *args)
 	ptr.option = opt ? json_object_get_string(opt) : NULL;
 	ptr.value = json_object_get_string(val);
 
-	rv = lookup_ptr(*c, &ptr, true);
+	rv = lookup_ptr((*c)->ctx, &ptr, true);
 
 	if (rv != UCI_OK)
 		err_return(rv);
 
+	snapshot_drop(*c, ptr.p);
+
 	if (!ptr.s && ptr.option)
 		err_return(UCI_ERR_NOTFOUND);
 
-	rv = uci_rename(*c, &ptr);
+	rv = uci_rename((*c)->ctx, &ptr);
 
 	if (rv != UCI_OK)
 		err_return(rv);
@@ -663,7 +814,7 @@ ut_uci_rename(struct ut_state *s, uint32_t off, struct json_object *args)
 static struct json_object *
 ut_uci_reorder(struct ut_state *s, uint32_t off, struct json_object *args)
 {
-	struct uci_context **c = (struct uci_context **)ops->get_type(s->ctx, "uci.cursor");
+	struct uci_cursor **c = (struct uci_cursor **)ops->get_type(s->ctx, "uci.cursor");
 	struct json_object *conf = json_object_array_get_idx(args, 0);
 	struct json_object *sect = json_object_array_get_idx(args, 1);
 	struct json_object *val = json_object_array_get_idx(args, 2);
@@ -684,15 +835,17 @@ ut_uci_reorder(struct ut_state *s, uint32_t off, struct json_object *args)
 	ptr.package = json_object_get_string(conf);
 	ptr.section = json_object_get_string(sect);
 
-	rv = lookup_ptr(*c, &ptr, true);
+	rv = lookup_ptr((*c)->ctx, &ptr, true);
 
 	if (rv != UCI_OK)
 		err_return(rv);
 
+	snapshot_drop(*c, ptr.p);
+
 	if (!ptr.s)
 		err_return(UCI_ERR_NOTFOUND);
 
-	rv = uci_reorder_section(*c, ptr.s, n);
+	rv = uci_reorder_section((*c)->ctx, ptr.s, n);
 
 	if (rv != UCI_OK)
 		err_return(rv);
@@ -703,7 +856,7 @@ ut_uci_reorder(struct ut_state *s, uint32_t off, struct json_object *args)
 static struct json_object *
 ut_uci_pkg_command(struct ut_state *s, uint32_t off, struct json_object *args, enum pkg_cmd cmd)
 {
-	struct uci_context **c = (struct uci_context **)ops->get_type(s->ctx, "uci.cursor");
+	struct uci_cursor **c = (struct uci_cursor **)ops->get_type(s->ctx, "uci.cursor");
 	struct json_object *conf = json_object_array_get_idx(args, 0);
 	struct uci_element *e, *tmp;
 	struct uci_package *p;
@@ -716,24 +869,27 @@ ut_uci_pkg_command(struct ut_state *s, uint32_t off, struct json_object *args, e
 	if (conf && !json_object_is_type(conf, json_type_string))
 		err_return(UCI_ERR_INVAL);
 
-	uci_foreach_element_safe(&(*c)->root, tmp, e) {
+	uci_foreach_element_safe(&(*c)->ctx->root, tmp, e) {
 		p = uci_to_package(e);
 
 		if (conf && strcmp(e->name, json_object_get_string(conf)))
 			continue;
 
+		if (cmd != CMD_SAVE)
+			snapshot_drop(*c, p);
+
 		switch (cmd) {
 		case CMD_COMMIT:
-			rv = uci_commit(*c, &p, false);
+			rv = uci_commit((*c)->ctx, &p, false);
 			break;
 
 		case CMD_SAVE:
-			rv = uci_save(*c, p);
+			rv = uci_save((*c)->ctx, p);
 			break;
 
 		case CMD_REVERT:
 			ptr.p = p;
-			rv = uci_revert(*c, &ptr);
+			rv = uci_revert((*c)->ctx, &ptr);
 			break;
 		}
 
@@ -857,7 +1013,7 @@ changes_to_json(struct uci_context *ctx, const char *package)
 static struct json_object *
 ut_uci_changes(struct ut_state *s, uint32_t off, struct json_object *args)
 {
-	struct uci_context **c = (struct uci_context **)ops->get_type(s->ctx, "uci.cursor");
+	struct uci_cursor **c = (struct uci_cursor **)ops->get_type(s->ctx, "uci.cursor");
 	struct json_object *conf = json_object_array_get_idx(args, 0);
 	struct json_object *res, *chg;
 	char **configs;
@@ -866,7 +1022,7 @@ ut_uci_changes(struct ut_state *s, uint32_t off, struct json_object *args)
 	if (conf && !json_object_is_type(conf, json_type_string))
 		err_return(UCI_ERR_INVAL);
 
-	rv = uci_list_configs(*c, &configs);
+	rv = uci_list_configs((*c)->ctx, &configs);
 
 	if (rv != UCI_OK)
 		err_return(rv);
@@ -882,7 +1038,7 @@ ut_uci_changes(struct ut_state *s, uint32_t off, struct json_object *args)
 		if (conf && strcmp(configs[i], json_object_get_string(conf)))
 			continue;
 
-		chg = changes_to_json(*c, configs[i]);
+		chg = changes_to_json((*c)->ctx, configs[i]);
 
 		if (chg)
 			json_object_object_add(res, configs[i], chg);
@@ -896,74 +1052,76 @@ ut_uci_changes(struct ut_state *s, uint32_t off, struct json_object *args)
 static struct json_object *
 ut_uci_foreach(struct ut_state *s, uint32_t off, struct json_object *args)
 {
-	struct uci_context **c = (struct uci_context **)ops->get_type(s->ctx, "uci.cursor");
+	struct uci_cursor **c = (struct uci_cursor **)ops->get_type(s->ctx, "uci.cursor");
 	struct json_object *conf = json_object_array_get_idx(args, 0);
 	struct json_object *type = json_object_array_get_idx(args, 1);
 	struct json_object *func = json_object_array_get_idx(args, 2);
-	struct json_object *fnargs, *rv = NULL;
-	struct uci_package *p = NULL;
-	struct uci_element *e, *tmp;
-	struct uci_section *sc;
+	struct json_object *fnargs, *list, *rv = NULL;
+	struct uci_snapshot *snap;
+	struct uci_package *p;
 	bool stop = false;
 	bool ret = false;
-	int i = 0;
+	size_t i;
 
 	if (!json_object_is_type(conf, json_type_string) ||
 	    (type && !json_object_is_type(type, json_type_string)))
 	    err_return(UCI_ERR_INVAL);
 
-	uci_foreach_element(&(*c)->root, e) {
-		if (strcmp(e->name, json_object_get_string(conf)))
-			continue;
-
-		p = uci_to_package(e);
-		break;
-	}
+	p = find_package((*c)->ctx, json_object_get_string(conf));
 
 	if (!p)
 		err_return(UCI_ERR_NOTFOUND);
 
+	snap = snapshot_get(*c, p);
+
+	if (!snap)
+		err_return(UCI_ERR_MEM);
+
+	if (!type)
+		list = snap->all;
+	else if (!json_object_object_get_ex(snap->types, json_object_get_string(type), &list))
+		return json_object_new_boolean(false);
+
 	fnargs = json_object_new_array();
 
 	if (!fnargs)
 		err_return(UCI_ERR_MEM);
 
-	uci_foreach_element_safe(&p->sections, tmp, e) {
-		sc = uci_to_section(e);
-		i++;
-
-		if (type && strcmp(sc->type, json_object_get_string(type)))
-			continue;
+	/* the callback might change the package and drop the snapshot */
+	list = json_object_get(list);
 
-		json_object_array_put_idx(fnargs, 0, section_to_json(sc, i - 1));
+	for (i = 0; !stop && i < json_object_array_length(list); i++) {
+		json_object_array_put_idx(fnargs, 0,
+			section_copy(json_object_array_get_idx(list, i), true));
 
 		rv = ops->invoke(s, off, NULL, func, fnargs);
 
 		/* forward exceptions from callback function */
 		if (ut_is_type(rv, T_EXCEPTION))
-			return rv;
+			break;
 
 		ret = true;
 		stop = (json_object_is_type(rv, json_type_boolean) && !json_object_get_boolean(rv));
 
 		json_object_put(rv);
-
-		if (stop)
-			break;
+		rv = NULL;
 	}
 
-	return json_object_new_boolean(ret);
+	json_object_put(fnargs);
+	json_object_put(list);
+
+	return rv ? rv : json_object_new_boolean(ret);
 }
 
 static struct json_object *
 ut_uci_configs(struct ut_state *s, uint32_t off, struct json_object *args)
 {
-	struct uci_context **c = (struct uci_context **)ops->get_type(s->ctx, "uci.cursor");
+	struct uci_cursor **c = (struct uci_cursor **)ops->get_type(s->ctx, "uci.cursor");
 	struct json_object *a;
 	char **configs;
 	int i, rv;
 
-	rv = uci_list_configs(*c, &configs);
+	rv = uci_list_configs((*c)->ctx, &configs);
 
 	if (rv != UCI_OK)
 		err_return(rv);
@@ -1010,16 +1168,26 @@ static const struct { const char *name; ut_c_fn *func; } global_fns[] = {
 
 
 static void close_uci(void *ud) {
-	uci_free_context((struct uci_context *)ud);
+	struct uci_cursor *c = ud;
+
+	while (c->snapshots)
+		snapshot_drop(c, c->snapshots->package);
+
+	uci_free_context(c->ctx);
+	free(c);
 }
 
 void ut_module_init(const struct ut_ops *ut, struct ut_state *s, struct json_object *scope)
 {
-	ops = ut;
-	ops->register_type("uci.cursor", close_uci);
+	struct json_object *uci_proto;
 
-	uci_proto = ops->new_object(NULL);
+	if (!ops)
+		ops = ut;
+
+	uci_proto = ops->new_object(s, NULL);
 
 	register_functions(ops, global_fns, scope);
 	register_functions(ops, cursor_fns, uci_proto);
+
+	ops->register_type(s, "uci.cursor", uci_proto, close_uci);
 }
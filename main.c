@@ -19,7 +19,9 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
+#include <getopt.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 
 #ifdef JSONC
 	#include <json.h>
@@ -31,6 +33,11 @@
 #include "parser.h"
 #include "eval.h"
 #include "lib.h"
+#include "cache.h"
+#include "profile.h"
+#include "server.h"
+#include "batch.h"
+#include "region.h"
 
 
 static void
@@ -38,14 +45,29 @@ print_usage(char *app)
 {
 	printf(
 	"== Usage ==\n\n"
-	"  # %s [-d] [-l] [-r] {-i <file> | -s \"utpl script...\"}\n"
+	"  # %s [-d] [-l] [-r] [-w] [-m] [-p <file>] [-c <dir>] [-R <depth>] {-i <file> | -s \"utpl script...\" | -S <socket> [-M] | -b <manifest> [-j <threads>]}\n"
 	"  -h, --help	Print this help\n"
 	"  -i file	Specify an utpl script to parse\n"
 	"  -s \"utpl script...\"	Specify an utpl code fragment to parse\n"
 	"  -d Instead of executing the script, dump the resulting AST as dot\n"
 	"  -l Do not strip leading block whitespace\n"
-	"  -r Do not trim trailing block newlines\n",
-		app);
+	"  -r Do not trim trailing block newlines\n"
+	"  -w Evaluate the AST directly instead of compiling it to bytecode\n"
+	"  -m, --stats	Print the op pool high-water mark, the value tag allocations\n"
+	"		and the peak memory usage to stderr when done\n"
+	"  -p file	Print a profile of function calls and source lines to stderr and\n"
+	"		write the sampled call stacks in folded format to the given file\n"
+	"  -c dir	Cache parsed scripts and required modules in the given directory\n"
+	"  -R depth	Limit the nesting of function calls to the given depth (default %d),\n"
+	"		calls failing earlier when running out of stack\n"
+	"  -S socket	Listen on the given unix socket and render the templates\n"
+	"		requested as {\"template\": path, \"context\": {...}} lines,\n"
+	"		replying with the output, a zero byte and a JSON status line\n"
+	"  -M Keep the results of memo() functions across the requests of -S\n"
+	"  -b manifest	Render the jobs of the given JSON manifest, an array of\n"
+	"		{\"template\": path, \"context\": {...}, \"output\": path} objects\n"
+	"  -j threads	Number of worker threads for -b (default one per CPU)\n",
+		app, UT_DEFAULT_MAXDEPTH);
 }
 
 #ifndef NDEBUG
@@ -137,13 +159,61 @@ static void dump(struct ut_state *s, uint32_t off, int level) {
 }
 #endif /* NDEBUG */
 
+static void
+print_stats(struct ut_state *s)
+{
+	struct ut_region *tags = s->tags;
+	struct rusage ru;
+
+	fprintf(stderr, "Op pool: %"PRIu32" of %"PRIu32" ops used, %zu of %zu bytes\n",
+	        s->poolsize, s->poolcap,
+	        s->poolsize * sizeof(*s->pool), s->poolcap * sizeof(*s->pool));
+
+	if (tags)
+		fprintf(stderr, "Value tags: %zu allocated from %zu slabs, %zu in use, peak %zu bytes\n",
+		        tags->stats.allocs, tags->stats.slabs, tags->stats.live, tags->stats.peak);
+
+	if (!getrusage(RUSAGE_SELF, &ru))
+		fprintf(stderr, "Peak memory: %ld kB\n", ru.ru_maxrss);
+}
+
+/*
+ * A one-shot run leaves releasing its values to the exit, unless ressources
+ * are left which still have to close files or reap processes. Debug and
+ * sanitizer builds always tear down, so leak checkers keep working.
+ */
+static bool
+can_skip_teardown(struct ut_state *s)
+{
+#if defined(DEBUG) || defined(__SANITIZE_ADDRESS__)
+	return false;
+#else
+	struct ut_extended_type *et;
+
+	for (et = s->types; et; et = et->next)
+		if (et->live)
+			return false;
+
+	return true;
+#endif
+}
+
 static enum ut_error_type
-parse(struct ut_state *state, const char *source, bool dumponly)
+parse(struct ut_state *state, const char *source, const char *path,
+      const struct stat *st, bool dumponly, bool memstats, const char *profile)
 {
-	enum ut_error_type err;
+	enum ut_error_type err = 0;
+	uint32_t base;
+	FILE *fp;
 	char *msg;
 
-	err = ut_parse(state, source);
+	if (!path || !ut_cache_load(state, path, st)) {
+		base = state->poolsize;
+		err = ut_parse(state, source);
+
+		if (!err && path)
+			ut_cache_store(state, path, st, base);
+	}
 
 	if (!err) {
 		if (dumponly) {
@@ -154,8 +224,32 @@ parse(struct ut_state *state, const char *source, bool dumponly)
 			dump(state, state->main, 0);
 #endif /* NDEBUG */
 		}
+		else if (profile) {
+			if (!ut_profile_new(state, source)) {
+				fprintf(stderr, "Unable to start profiling: %s\n", strerror(errno));
+				err = UT_ERROR_EXCEPTION;
+			}
+			else {
+				err = ut_run(state, NULL);
+
+				ut_profile_report(state, stderr);
+
+				fp = fopen(profile, "w");
+
+				if (fp) {
+					ut_profile_folded(state, fp);
+					fclose(fp);
+				}
+				else {
+					fprintf(stderr, "Failed to open %s: %s\n", profile, strerror(errno));
+				}
+
+				ut_profile_free(state->profile);
+				state->profile = NULL;
+			}
+		}
 		else {
-			err = ut_run(state);
+			err = ut_run(state, NULL);
 		}
 	}
 
@@ -166,20 +260,34 @@ parse(struct ut_state *state, const char *source, bool dumponly)
 		free(msg);
 	}
 
-	ut_free(state);
+	if (memstats)
+		print_stats(state);
+
+	if (can_skip_teardown(state))
+		ut_output_flush(&state->output);
+	else
+		ut_free(state);
 
 	return err;
 }
 
+static const struct option long_options[] = {
+	{ "help",  no_argument, NULL, 'h' },
+	{ "stats", no_argument, NULL, 'm' },
+	{ }
+};
+
 int
 main(int argc, char **argv)
 {
 	struct ut_state *state;
 	bool dumponly = false;
-	size_t rlen, tlen = 0;
-	char buf[1024], *tmp;
-	char *source = NULL;
+	bool memstats = false;
+	char *source = NULL, *path = NULL, *buf = NULL, *tmp;
+	const char *profile = NULL, *sockpath = NULL, *manifest = NULL;
+	unsigned int nthreads = 0;
 	FILE *input = NULL;
+	struct stat st;
 	int opt, rv = 0;
 
 	if (argc == 1)
@@ -198,7 +306,10 @@ main(int argc, char **argv)
 	state->lstrip_blocks = 1;
 	state->trim_blocks = 1;
 
-	while ((opt = getopt(argc, argv, "dhlri:s:")) != -1)
+	if (isatty(STDOUT_FILENO))
+		state->output.flush = UT_OUTPUT_FLUSH_LINE;
+
+	while ((opt = getopt_long(argc, argv, "dhlrwmMb:c:i:j:p:s:R:S:", long_options, NULL)) != -1)
 	{
 		switch (opt) {
 		case 'h':
@@ -214,6 +325,11 @@ main(int argc, char **argv)
 				goto out;
 			}
 
+			path = (input != stdin) ? optarg : NULL;
+			break;
+
+		case 'c':
+			state->cache_dir = optarg;
 			break;
 
 		case 'd':
@@ -228,43 +344,87 @@ main(int argc, char **argv)
 			state->trim_blocks = 0;
 			break;
 
+		case 'w':
+			state->walk_ast = 1;
+			break;
+
+		case 'm':
+			memstats = true;
+			break;
+
+		case 'M':
+			state->memo_persist = 1;
+			break;
+
+		case 'p':
+			profile = optarg;
+			break;
+
 		case 's':
 			source = optarg;
 			break;
+
+		case 'R':
+			state->maxdepth = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'S':
+			sockpath = optarg;
+			break;
+
+		case 'b':
+			manifest = optarg;
+			break;
+
+		case 'j':
+			nthreads = strtoul(optarg, NULL, 10);
+			break;
 		}
 	}
 
-	if (!source) {
-		while (1) {
-			rlen = fread(buf, 1, sizeof(buf), input);
+	if (manifest) {
+		rv = ut_batch_run(state, manifest, nthreads);
+		ut_free(state);
+		goto out;
+	}
 
-			if (rlen == 0)
-				break;
+	if (sockpath) {
+		rv = ut_server_run(state, sockpath);
+		ut_free(state);
+		goto out;
+	}
 
-			tmp = realloc(source, tlen + rlen + 1);
+	if (!source) {
+		if (path && fstat(fileno(input), &st))
+			path = NULL;
 
-			if (!tmp) {
-				tmp = ut_format_error(NULL, "");
+		source = buf = ut_read_file(input, NULL);
 
-				fprintf(stderr, "%s\n", tmp);
-				free(tmp);
+		if (!source) {
+			tmp = ut_format_error(NULL, "");
 
-				rv = UT_ERROR_OUT_OF_MEMORY;
-				goto out;
-			}
+			fprintf(stderr, "%s\n", tmp);
+			free(tmp);
 
-			source = tmp;
-			memcpy(source + tlen, buf, rlen);
-			source[tlen + rlen] = 0;
-			tlen += rlen;
+			rv = UT_ERROR_OUT_OF_MEMORY;
+			goto out;
 		}
+
+		/* keep ignoring empty input */
+		if (!*source)
+			source = NULL;
+	}
+	else {
+		path = NULL;
 	}
 
-	rv = source ? parse(state, source, dumponly) : 0;
+	rv = source ? parse(state, source, path, &st, dumponly, memstats, profile) : 0;
 
 out:
 	if (input && input != stdin)
 		fclose(input);
 
+	free(buf);
+
 	return rv;
 }
@@ -0,0 +1,325 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "memo.h"
+#include "lexer.h"
+#include "parser.h"
+#include "strbuf.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+
+bool
+ut_memo_enable(struct ut_state *s, uint32_t decl)
+{
+	struct json_object **tmp;
+	uint32_t size;
+
+	if (decl >= s->memo.size) {
+		size = (s->poolsize > decl) ? s->poolsize + 1 : decl + 1;
+		tmp = realloc(s->memo.tables, size * sizeof(*tmp));
+
+		if (!tmp)
+			return false;
+
+		memset(tmp + s->memo.size, 0, (size - s->memo.size) * sizeof(*tmp));
+		s->memo.tables = tmp;
+		s->memo.size = size;
+	}
+
+	if (!s->memo.tables[decl])
+		s->memo.tables[decl] = json_object_new_object();
+
+	return (s->memo.tables[decl] != NULL);
+}
+
+/* only values serializing to what they are qualify */
+static bool
+memo_plain(struct json_object *v, uint32_t depth)
+{
+	struct ut_op *tag = json_object_get_userdata(v);
+	struct lh_entry *e;
+	size_t i, len;
+
+	if (depth > 32)
+		return false;
+
+	switch (tag ? tag->type : 0) {
+	case T_FUNC:
+	case T_CFUNC:
+	case T_RESSOURCE:
+	case T_EXCEPTION:
+		return false;
+	}
+
+	switch (json_object_get_type(v)) {
+	case json_type_array:
+		for (i = 0, len = json_object_array_length(v); i < len; i++)
+			if (!memo_plain(json_object_array_get_idx(v, i), depth + 1))
+				return false;
+
+		break;
+
+	case json_type_object:
+		for (e = json_object_get_object(v)->head; e; e = e->next)
+			if (!memo_plain(lh_entry_v(e), depth + 1))
+				return false;
+
+		break;
+
+	default:
+		break;
+	}
+
+	return true;
+}
+
+/*
+ * Keys tag each value with its type and spell out strings with their length
+ * and doubles with all significant digits, so distinct arguments never share
+ * a key the way they might share their JSON serialization.
+ */
+static bool
+memo_encode(struct ut_strbuf **sb, struct json_object *v, uint32_t depth)
+{
+	struct ut_op *tag = json_object_get_userdata(v);
+	struct lh_entry *e;
+	const char *s;
+	size_t i, len;
+	double d;
+
+	if (depth > 32)
+		return false;
+
+	switch (tag ? tag->type : 0) {
+	case T_FUNC:
+	case T_CFUNC:
+	case T_RESSOURCE:
+	case T_EXCEPTION:
+		return false;
+	}
+
+	switch (json_object_get_type(v)) {
+	case json_type_null:
+		return ut_strbuf_append(sb, "n", 1);
+
+	case json_type_boolean:
+		return ut_strbuf_append(sb, json_object_get_boolean(v) ? "t" : "f", 1);
+
+	case json_type_int:
+		return ut_strbuf_printf(sb, "i%" PRId64 ";", json_object_get_int64(v));
+
+	case json_type_double:
+		d = json_object_get_double(v);
+
+		if (isnan(d))
+			return ut_strbuf_append(sb, "N", 1);
+
+		if (isinf(d))
+			return ut_strbuf_append(sb, (d > 0) ? "I+" : "I-", 2);
+
+		return ut_strbuf_printf(sb, "d%.17g;", d);
+
+	case json_type_string:
+		s = json_object_get_string(v);
+		len = json_object_get_string_len(v);
+
+		/* keys are zero terminated */
+		if (memchr(s, 0, len))
+			return false;
+
+		return ut_strbuf_printf(sb, "s%zu:", len) && ut_strbuf_append(sb, s, len);
+
+	case json_type_array:
+		len = json_object_array_length(v);
+
+		if (!ut_strbuf_printf(sb, "a%zu[", len))
+			return false;
+
+		for (i = 0; i < len; i++)
+			if (!memo_encode(sb, json_object_array_get_idx(v, i), depth + 1))
+				return false;
+
+		return ut_strbuf_append(sb, "]", 1);
+
+	case json_type_object:
+		if (!ut_strbuf_printf(sb, "o%d{", json_object_object_length(v)))
+			return false;
+
+		for (e = json_object_get_object(v)->head; e; e = e->next) {
+			s = (const char *)lh_entry_k(e);
+
+			if (!ut_strbuf_printf(sb, "%zu:%s", strlen(s), s) ||
+			    !memo_encode(sb, lh_entry_v(e), depth + 1))
+				return false;
+		}
+
+		return ut_strbuf_append(sb, "}", 1);
+	}
+
+	return false;
+}
+
+char *
+ut_memo_key(struct json_object *args)
+{
+	struct ut_strbuf *sb = ut_strbuf_new(NULL, 0, 64);
+	char *key = NULL;
+
+	if (sb && memo_encode(&sb, args, 0))
+		key = strndup(sb->data, sb->len);
+
+	ut_strbuf_put(sb);
+
+	return key;
+}
+
+/* remembered arrays and objects are copied in and out, scalars are shared */
+static struct json_object *
+memo_copy(struct ut_state *s, struct json_object *v)
+{
+	struct ut_op *tag = json_object_get_userdata(v);
+	struct json_object *copy, *item;
+	struct lh_entry *e;
+	size_t i, len;
+
+	switch (json_object_get_type(v)) {
+	case json_type_array:
+		copy = json_object_new_array();
+
+		for (i = 0, len = json_object_array_length(v); copy && i < len; i++) {
+			item = json_object_array_get_idx(v, i);
+
+			if (json_object_array_add(copy, memo_copy(s, item)) ||
+			    (item && !json_object_array_get_idx(copy, i))) {
+				json_object_put(copy);
+				copy = NULL;
+			}
+		}
+
+		return copy;
+
+	case json_type_object:
+		copy = (tag && tag->type == T_LBRACE)
+			? ut_new_object(s, tag->tag.proto) : json_object_new_object();
+
+		for (e = copy ? json_object_get_object(v)->head : NULL; e; e = e->next) {
+			item = memo_copy(s, lh_entry_v(e));
+
+			if ((lh_entry_v(e) && !item) ||
+			    json_object_object_add(copy, (const char *)lh_entry_k(e), item)) {
+				json_object_put(item);
+				json_object_put(copy);
+				copy = NULL;
+				break;
+			}
+		}
+
+		return copy;
+
+	default:
+		return json_object_get(v);
+	}
+}
+
+/* an [ value, output ] pair, borrowed from the table */
+struct json_object *
+ut_memo_lookup(struct ut_state *s, uint32_t decl, const char *key)
+{
+	struct json_object *entry;
+
+	if (!ut_memo_enabled(s, decl) ||
+	    !json_object_object_get_ex(s->memo.tables[decl], key, &entry))
+		return NULL;
+
+	return entry;
+}
+
+bool
+ut_memo_store(struct ut_state *s, uint32_t decl, const char *key,
+              struct json_object *rv, const char *out, size_t len)
+{
+	struct json_object *table, *entry, *value;
+
+	if (!ut_memo_enabled(s, decl) || !memo_plain(rv, 0))
+		return false;
+
+	table = s->memo.tables[decl];
+
+	if (json_object_object_length(table) >= UT_MEMO_MAX_ENTRIES)
+		return false;
+
+	value = memo_copy(s, rv);
+
+	if (rv && !value)
+		return false;
+
+	entry = json_object_new_array();
+
+	if (!entry) {
+		json_object_put(value);
+
+		return false;
+	}
+
+	json_object_array_add(entry, value);
+	json_object_array_add(entry, json_object_new_string_len(out ? out : "", len));
+	json_object_object_add(table, key, entry);
+
+	return true;
+}
+
+/* a fresh copy of the value remembered in a looked up entry */
+struct json_object *
+ut_memo_result(struct ut_state *s, struct json_object *entry)
+{
+	return memo_copy(s, json_object_array_get_idx(entry, 0));
+}
+
+void
+ut_memo_reset(struct ut_state *s)
+{
+	uint32_t decl;
+
+	/* the ops present before the first run are the ones of the template */
+	if (!s->memo.base)
+		s->memo.base = s->poolsize;
+
+	for (decl = 0; decl < s->memo.size; decl++) {
+		if (s->memo_persist && decl <= s->memo.base)
+			continue;
+
+		json_object_put(s->memo.tables[decl]);
+		s->memo.tables[decl] = NULL;
+	}
+}
+
+void
+ut_memo_free(struct ut_state *s)
+{
+	uint32_t decl;
+
+	for (decl = 0; decl < s->memo.size; decl++)
+		json_object_put(s->memo.tables[decl]);
+
+	free(s->memo.tables);
+
+	s->memo.tables = NULL;
+	s->memo.size = 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __MEMO_H_
+#define __MEMO_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ast.h"
+
+/* calls remembered per function before further results are dropped */
+#define UT_MEMO_MAX_ENTRIES 1024
+
+/*
+ * Functions passed to memo() remember the value and the output of each call,
+ * keyed on their declaration and the serialized arguments, and replay them
+ * for later calls with the same arguments. Calls involving functions or
+ * ressources, as well as calls raising exceptions, are never remembered.
+ * Arrays and objects are copied when remembered and when replayed, so
+ * callers are free to modify the values they get.
+ *
+ * The remembered calls are forgotten when a state is run again, unless it
+ * keeps them across runs, in which case only the ones of functions declared
+ * by required modules, which get parsed anew by each run, are dropped.
+ */
+static inline bool ut_memo_enabled(struct ut_state *s, uint32_t decl) {
+	return (decl < s->memo.size && s->memo.tables[decl]);
+};
+
+bool ut_memo_enable(struct ut_state *s, uint32_t decl);
+char *ut_memo_key(struct json_object *args);
+struct json_object *ut_memo_lookup(struct ut_state *s, uint32_t decl, const char *key);
+struct json_object *ut_memo_result(struct ut_state *s, struct json_object *entry);
+bool ut_memo_store(struct ut_state *s, uint32_t decl, const char *key,
+                   struct json_object *rv, const char *out, size_t len);
+
+void ut_memo_reset(struct ut_state *s);
+void ut_memo_free(struct ut_state *s);
+
+#endif /* __MEMO_H_ */
@@ -22,13 +22,14 @@
 
 struct ut_ops {
 	bool (*register_function)(struct json_object *, const char *, ut_c_fn *);
-	bool (*register_type)(const char *, void (*)(void *));
-	struct json_object *(*set_type)(struct json_object *, struct json_object *, const char *, void *);
+	bool (*register_type)(struct ut_state *, const char *, struct json_object *, void (*)(void *));
+	struct json_object *(*set_type)(struct ut_state *, struct json_object *, const char *, void *);
 	void **(*get_type)(struct json_object *, const char *);
-	struct json_object *(*new_object)(struct json_object *);
+	struct json_object *(*new_object)(struct ut_state *, struct json_object *);
 	struct json_object *(*new_double)(double);
 	struct json_object *(*invoke)(struct ut_state *, uint32_t, struct json_object *, struct json_object *, struct json_object *);
 	enum json_type (*cast_number)(struct json_object *, int64_t *, double *);
+	char *(*read_file)(FILE *, size_t *);
 };
 
 extern const struct ut_ops ut;
@@ -0,0 +1,314 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "optimizer.h"
+#include "eval.h"
+#include "parser.h"
+#include "strbuf.h"
+
+#include <string.h>
+
+static bool
+is_const(struct ut_op *op)
+{
+	if (!op || op->tree.next)
+		return false;
+
+	switch (op->type) {
+	case T_NUMBER:
+	case T_DOUBLE:
+	case T_STRING:
+	case T_BOOL:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/* turn the given op into a literal node holding val, keeping its offset */
+static bool
+set_const(struct ut_op *op, struct json_object *val)
+{
+	int type;
+
+	switch (json_object_get_type(val)) {
+	case json_type_int:
+		type = T_NUMBER;
+		break;
+
+	case json_type_double:
+		type = T_DOUBLE;
+		break;
+
+	case json_type_string:
+		type = T_STRING;
+		break;
+
+	case json_type_boolean:
+		type = T_BOOL;
+		break;
+
+	default:
+		json_object_put(val);
+
+		return false;
+	}
+
+	json_object_put(op->val);
+
+	op->type = type;
+	op->val = val;
+	op->is_overflow = false;
+	memset(op->tree.operand, 0, sizeof(op->tree.operand));
+
+	return true;
+}
+
+/* integer division by zero or of INT64_MIN by -1 traps, leave it to runtime */
+static bool
+is_int_trap(int type, struct ut_op *op1, struct ut_op *op2)
+{
+	int64_t n1, n2;
+	double d;
+
+	if (type != T_DIV && type != T_MOD)
+		return false;
+
+	if (ut_cast_number(op1->val, &n1, &d) == json_type_double ||
+	    ut_cast_number(op2->val, &n2, &d) == json_type_double)
+		return false;
+
+	return (type == T_MOD && n2 == 0) || (n1 == INT64_MIN && n2 == -1);
+}
+
+static void
+fold(struct ut_state *s, struct ut_op *op)
+{
+	struct ut_op *op1 = ut_get_op(s, op->tree.operand[0]);
+	struct ut_op *op2 = ut_get_op(s, op->tree.operand[1]);
+	struct json_object *v1, *v2;
+
+	if (!is_const(op1) || (op->tree.operand[1] && !is_const(op2)))
+		return;
+
+	v1 = json_object_get(op1->val);
+	v2 = op2 ? json_object_get(op2->val) : NULL;
+
+	switch (op->type) {
+	case T_ADD:
+	case T_SUB:
+		if (!op2) {
+			set_const(op, ut_unary_arith(op->type, op1->is_overflow, v1));
+			break;
+		}
+
+		/* fall through */
+
+	case T_MUL:
+	case T_DIV:
+	case T_MOD:
+		if (!op2 || is_int_trap(op->type, op1, op2)) {
+			ut_putval(v1);
+			ut_putval(v2);
+			break;
+		}
+
+		set_const(op, ut_arith(op->type, v1, v2));
+		break;
+
+	case T_LSHIFT:
+	case T_RSHIFT:
+	case T_BAND:
+	case T_BXOR:
+	case T_BOR:
+		set_const(op, ut_bitop(op->type, v1, v2));
+		break;
+
+	case T_COMPL:
+		set_const(op, ut_compl(v1));
+		break;
+
+	case T_NOT:
+		set_const(op, json_object_new_boolean(!ut_val_is_truish(v1)));
+		ut_putval(v1);
+		break;
+
+	case T_LT:
+	case T_LE:
+	case T_GT:
+	case T_GE:
+	case T_EQ:
+	case T_NE:
+		set_const(op, ut_rel(op->type, v1, v2));
+		break;
+
+	case T_EQS:
+	case T_NES:
+		set_const(op, ut_equality(op->type, v1, v2));
+		break;
+
+	/* only fold if the outcome is a literal as well */
+	case T_AND:
+	case T_OR:
+		if (ut_val_is_truish(v1) == (op->type == T_OR))
+			set_const(op, json_object_get(v1));
+		else
+			set_const(op, json_object_get(v2));
+
+		ut_putval(v1);
+		ut_putval(v2);
+		break;
+
+	case T_QMARK:
+		ut_putval(v2);
+		op2 = ut_get_op(s, op->tree.operand[ut_val_is_truish(v1) ? 1 : 2]);
+		ut_putval(v1);
+
+		if (is_const(op2))
+			set_const(op, json_object_get(op2->val));
+
+		break;
+
+	default:
+		ut_putval(v1);
+		ut_putval(v2);
+		break;
+	}
+}
+
+/* replace the statement *link points to by the given list, which may be empty */
+static void
+splice(struct ut_state *s, uint32_t *link, uint32_t list)
+{
+	struct ut_op *op = ut_get_op(s, *link);
+	struct ut_op *last = ut_get_op(s, list);
+
+	if (last) {
+		while (last->tree.next)
+			last = ut_get_op(s, last->tree.next);
+
+		last->tree.next = op->tree.next;
+		*link = list;
+	}
+	else {
+		*link = op->tree.next;
+	}
+
+	/* unlinked ops must not refer to the tree anymore, see ut_cache_check() */
+	memset(&op->tree, 0, sizeof(op->tree));
+}
+
+/* concatenate runs of text nodes, which saves an output call per node */
+static void
+merge_text(struct ut_state *s, uint32_t off)
+{
+	struct ut_op *op, *next, *tmp;
+	struct ut_strbuf *sb;
+	struct json_object *str;
+
+	for (op = ut_get_op(s, off); op; op = ut_get_op(s, op->tree.next)) {
+		next = ut_get_op(s, op->tree.next);
+
+		if (op->type != T_TEXT || !next || next->type != T_TEXT)
+			continue;
+
+		sb = NULL;
+
+		if (!ut_strbuf_append_val(&sb, op->val)) {
+			ut_strbuf_put(sb);
+			continue;
+		}
+
+		while (next && next->type == T_TEXT && ut_strbuf_append_val(&sb, next->val))
+			next = ut_get_op(s, next->tree.next);
+
+		str = ut_strbuf_finish(sb);
+
+		if (!str)
+			continue;
+
+		json_object_put(op->val);
+		op->val = str;
+
+		while ((tmp = ut_get_op(s, op->tree.next)) != next) {
+			op->tree.next = tmp->tree.next;
+			tmp->tree.next = 0;
+		}
+	}
+}
+
+static void
+optimize_seq(struct ut_state *s, uint32_t *link)
+{
+	uint32_t *head = link;
+	struct ut_op *op, *cond;
+	size_t i;
+
+	while (*link) {
+		op = ut_get_op(s, *link);
+
+		for (i = 0; i < sizeof(op->tree.operand) / sizeof(op->tree.operand[0]); i++)
+			if (op->tree.operand[i])
+				optimize_seq(s, &op->tree.operand[i]);
+
+		cond = ut_get_op(s, op->tree.operand[0]);
+
+		switch (op->type) {
+		case T_IF:
+			if (!is_const(cond))
+				break;
+
+			splice(s, link, op->tree.operand[ut_val_is_truish(cond->val) ? 1 : 2]);
+			continue;
+
+		case T_WHILE:
+			if (!is_const(cond) || ut_val_is_truish(cond->val))
+				break;
+
+			splice(s, link, 0);
+			continue;
+
+		case T_LEXP:
+			if (!is_const(cond) || cond->type != T_STRING)
+				break;
+
+			json_object_put(op->val);
+			op->type = T_TEXT;
+			op->val = json_object_get(cond->val);
+			op->tree.operand[0] = 0;
+			break;
+
+		default:
+			fold(s, op);
+			break;
+		}
+
+		link = &op->tree.next;
+	}
+
+	merge_text(s, *head);
+}
+
+void
+ut_optimize(struct ut_state *s, uint32_t off)
+{
+	struct ut_op *op = ut_get_op(s, off);
+
+	if (op && op->type == T_FUNC)
+		optimize_seq(s, &op->tree.operand[2]);
+}
@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "output.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+static bool
+ut_output_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t n;
+
+	while (iovcnt > 0) {
+		n = writev(fd, iov, iovcnt);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return true;
+}
+
+/* pass the buffered data, followed by the given chunk, on to the target */
+static bool
+ut_output_emit(struct ut_output *out, const char *p, size_t len)
+{
+	struct iovec iov[2] = {
+		{ .iov_base = out->buf, .iov_len = out->len },
+		{ .iov_base = (char *)p, .iov_len = len }
+	};
+	bool ok;
+
+	if (out->type == UT_OUTPUT_CALLBACK) {
+		ok = (!out->len || out->cb(out->ud, out->buf, out->len) == out->len) &&
+		     (!len || out->cb(out->ud, p, len) == len);
+	}
+	else {
+		ok = ut_output_writev((out->type == UT_OUTPUT_FD) ? out->fd : STDOUT_FILENO,
+		                      iov, 2);
+	}
+
+	out->len = 0;
+
+	if (!ok)
+		out->error = true;
+
+	return ok;
+}
+
+static bool
+ut_output_grow(struct ut_output *out, size_t len)
+{
+	size_t size = out->size ? out->size : UT_OUTPUT_BUFSIZE;
+	char *tmp;
+
+	/* keep room for a terminating zero byte */
+	while (size - out->len <= len) {
+		if (size > SIZE_MAX / 2)
+			return false;
+
+		size *= 2;
+	}
+
+	if (size == out->size)
+		return true;
+
+	tmp = realloc(out->buf, size);
+
+	if (!tmp)
+		return false;
+
+	out->buf = tmp;
+	out->size = size;
+
+	return true;
+}
+
+void
+ut_output_fd(struct ut_output *out, int fd)
+{
+	ut_output_free(out);
+
+	out->type = UT_OUTPUT_FD;
+	out->fd = fd;
+}
+
+void
+ut_output_memory(struct ut_output *out)
+{
+	ut_output_free(out);
+
+	out->type = UT_OUTPUT_MEMORY;
+}
+
+void
+ut_output_callback(struct ut_output *out, ut_output_fn *cb, void *ud)
+{
+	ut_output_free(out);
+
+	out->type = UT_OUTPUT_CALLBACK;
+	out->cb = cb;
+	out->ud = ud;
+}
+
+size_t
+ut_output_write(struct ut_output *out, const char *p, size_t len)
+{
+	if (out->error || len == 0)
+		return 0;
+
+	if (out->type == UT_OUTPUT_MEMORY) {
+		if (!ut_output_grow(out, len)) {
+			out->error = true;
+
+			return 0;
+		}
+
+		memcpy(out->buf + out->len, p, len);
+		out->len += len;
+		out->buf[out->len] = 0;
+
+		return len;
+	}
+
+	if (!out->buf) {
+		out->buf = malloc(UT_OUTPUT_BUFSIZE);
+		out->size = out->buf ? UT_OUTPUT_BUFSIZE : 0;
+	}
+
+	/* chunks not fitting into the buffer are written along with it */
+	if (len > out->size - out->len)
+		return ut_output_emit(out, p, len) ? len : 0;
+
+	memcpy(out->buf + out->len, p, len);
+	out->len += len;
+
+	if (out->flush == UT_OUTPUT_FLUSH_ALWAYS ||
+	    (out->flush == UT_OUTPUT_FLUSH_LINE && memchr(p, '\n', len)))
+		return ut_output_emit(out, NULL, 0) ? len : 0;
+
+	return len;
+}
+
+bool
+ut_output_flush(struct ut_output *out)
+{
+	if (out->type != UT_OUTPUT_MEMORY && out->len > 0)
+		ut_output_emit(out, NULL, 0);
+
+	return !out->error;
+}
+
+char *
+ut_output_steal(struct ut_output *out, size_t *len)
+{
+	char *buf;
+
+	if (out->type != UT_OUTPUT_MEMORY)
+		return NULL;
+
+	if (!out->buf && !ut_output_grow(out, 0))
+		return NULL;
+
+	buf = out->buf;
+	buf[out->len] = 0;
+
+	if (len)
+		*len = out->len;
+
+	out->buf = NULL;
+	out->len = 0;
+	out->size = 0;
+
+	return buf;
+}
+
+void
+ut_output_free(struct ut_output *out)
+{
+	ut_output_flush(out);
+
+	free(out->buf);
+
+	out->buf = NULL;
+	out->len = 0;
+	out->size = 0;
+	out->error = false;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __OUTPUT_H_
+#define __OUTPUT_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#define UT_OUTPUT_BUFSIZE 65536
+
+enum ut_output_type {
+	UT_OUTPUT_STDOUT,
+	UT_OUTPUT_FD,
+	UT_OUTPUT_MEMORY,
+	UT_OUTPUT_CALLBACK,
+};
+
+enum ut_output_flush {
+	UT_OUTPUT_FLUSH_FULL,
+	UT_OUTPUT_FLUSH_LINE,
+	UT_OUTPUT_FLUSH_ALWAYS,
+};
+
+/* returns the amount of bytes consumed, anything short of len is an error */
+typedef size_t (ut_output_fn)(void *ud, const char *buf, size_t len);
+
+struct ut_output {
+	enum ut_output_type type;
+	enum ut_output_flush flush;
+	bool error;
+	int fd;
+	ut_output_fn *cb;
+	void *ud;
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+void ut_output_fd(struct ut_output *out, int fd);
+void ut_output_memory(struct ut_output *out);
+void ut_output_callback(struct ut_output *out, ut_output_fn *cb, void *ud);
+
+size_t ut_output_write(struct ut_output *out, const char *p, size_t len);
+bool ut_output_flush(struct ut_output *out);
+char *ut_output_steal(struct ut_output *out, size_t *len);
+void ut_output_free(struct ut_output *out);
+
+#endif /* __OUTPUT_H_ */
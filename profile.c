@@ -0,0 +1,641 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "profile.h"
+#include "lexer.h"
+#include "parser.h"
+#include "vm.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/time.h>
+
+volatile sig_atomic_t ut_profile_pending;
+
+struct ut_profile_func {
+	char *name;
+	uint32_t decl;
+	void *cfn;
+	uint64_t calls;
+	uint64_t self;
+	uint64_t total;
+	uint32_t active;
+};
+
+/* one node per distinct call path, for the folded stacks */
+struct ut_profile_node {
+	uint32_t func;
+	uint32_t child;
+	uint32_t sibling;
+	uint64_t samples;
+};
+
+struct ut_profile_frame {
+	uint32_t node;
+	uint32_t off;
+	uint64_t start;
+	uint64_t child;
+};
+
+struct ut_profile {
+	const char *source;
+	uint32_t nops;
+	uint32_t *lines;
+	uint32_t nlines, linesize;
+	struct ut_profile_func *funcs;
+	uint32_t nfuncs, funcsize;
+	uint32_t *index;
+	uint32_t indexsize;
+	struct ut_profile_node *nodes;
+	uint32_t nnodes, nodesize;
+	struct ut_profile_frame *frames;
+	uint32_t nframes, framesize;
+	uint64_t *opsamples;
+	uint32_t opsamplesize;
+	uint64_t samples;
+	uint64_t start;
+	struct sigaction oldact;
+};
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* make room for index need in the zero initialized array at ptr */
+static bool
+grow(void *ptr, uint32_t *size, uint32_t need, size_t elemsize)
+{
+	uint32_t n = *size ? *size : 16;
+	void *tmp;
+
+	if (need < *size)
+		return true;
+
+	while (n <= need)
+		n *= 2;
+
+	tmp = realloc(*(void **)ptr, n * elemsize);
+
+	if (!tmp)
+		return false;
+
+	memset((char *)tmp + *size * elemsize, 0, (n - *size) * elemsize);
+
+	*(void **)ptr = tmp;
+	*size = n;
+
+	return true;
+}
+
+static void
+sigprof_handler(int sig)
+{
+	ut_profile_pending++;
+}
+
+struct ut_profile *
+ut_profile_new(struct ut_state *s, const char *source)
+{
+	struct itimerval itv = { { 0, UT_PROFILE_INTERVAL }, { 0, UT_PROFILE_INTERVAL } };
+	struct sigaction sa = { .sa_handler = sigprof_handler, .sa_flags = SA_RESTART };
+	struct ut_profile *p = calloc(1, sizeof(*p));
+	const char *c;
+
+	if (!p)
+		return NULL;
+
+	p->source = source;
+	p->nops = s->poolsize;
+
+	for (c = source; c; c = strchr(c, '\n')) {
+		c += (c != source);
+
+		if (!grow(&p->lines, &p->linesize, p->nlines, sizeof(*p->lines)))
+			goto fail;
+
+		p->lines[p->nlines++] = c - source;
+	}
+
+	/* node 0 is the root of all call paths */
+	if (!grow(&p->nodes, &p->nodesize, 0, sizeof(*p->nodes)))
+		goto fail;
+
+	p->nodes[0].func = UINT32_MAX;
+	p->nnodes = 1;
+	p->start = now();
+
+	sigemptyset(&sa.sa_mask);
+	ut_profile_pending = 0;
+
+	if (sigaction(SIGPROF, &sa, &p->oldact))
+		goto fail;
+
+	if (setitimer(ITIMER_PROF, &itv, NULL)) {
+		sigaction(SIGPROF, &p->oldact, NULL);
+		goto fail;
+	}
+
+	s->profile = p;
+
+	return p;
+
+fail:
+	free(p->lines);
+	free(p->nodes);
+	free(p);
+
+	return NULL;
+}
+
+void
+ut_profile_free(struct ut_profile *p)
+{
+	struct itimerval itv = { { 0, 0 }, { 0, 0 } };
+	uint32_t i;
+
+	if (!p)
+		return;
+
+	setitimer(ITIMER_PROF, &itv, NULL);
+	sigaction(SIGPROF, &p->oldact, NULL);
+
+	for (i = 0; i < p->nfuncs; i++)
+		free(p->funcs[i].name);
+
+	free(p->lines);
+	free(p->funcs);
+	free(p->index);
+	free(p->nodes);
+	free(p->frames);
+	free(p->opsamples);
+	free(p);
+}
+
+/* source line of the given op, zero if unknown and past the last line for
+ * ops of required modules, whose source is not at hand */
+static uint32_t
+line_of(struct ut_state *s, uint32_t off)
+{
+	struct ut_profile *p = s->profile;
+	uint32_t lo = 0, hi = p->nlines, mid;
+	size_t pos;
+
+	if (!off)
+		return 0;
+
+	if (off > p->nops)
+		return p->nlines + 1;
+
+	pos = ut_get_op(s, off)->off;
+
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+
+		if (p->lines[mid] > pos)
+			hi = mid;
+		else
+			lo = mid;
+	}
+
+	return lo + 1;
+}
+
+/* anonymous functions are named after the call site, unless called by a native */
+static char *
+call_name(struct ut_state *s, uint32_t off, uint32_t decl)
+{
+	struct ut_op *op = ut_get_op(s, decl);
+	struct ut_op *callee, *label;
+	struct ut_profile *p;
+	char *name;
+
+	if (op && (label = ut_get_op(s, op->tree.operand[0])) != NULL)
+		return strdup(json_object_get_string(label->val));
+
+	if (decl && decl == s->main)
+		return strdup("main");
+
+	p = s->profile;
+	op = ut_get_op(s, off);
+	callee = (op && op->type == T_LPAREN) ? ut_get_child(s, off, 0) : NULL;
+
+	if (p->nframes && !p->funcs[p->nodes[p->frames[p->nframes - 1].node].func].decl)
+		callee = NULL;
+
+	switch (callee ? callee->type : 0) {
+	case T_LABEL:
+		return strdup(json_object_get_string(callee->val));
+
+	case T_DOT:
+		op = ut_get_op(s, callee->tree.operand[0]);
+		label = ut_get_op(s, callee->tree.operand[1]);
+
+		if (!label || label->type != T_LABEL)
+			break;
+
+		if (!op || op->type != T_LABEL)
+			return strdup(json_object_get_string(label->val));
+
+		if (asprintf(&name, "%s.%s", json_object_get_string(op->val),
+		             json_object_get_string(label->val)) < 0)
+			return NULL;
+
+		return name;
+	}
+
+	return strdup(decl ? "<anonymous>" : "<native>");
+}
+
+static uint32_t
+find_func(struct ut_state *s, uint32_t off, struct ut_op *tag)
+{
+	struct ut_profile *p = s->profile;
+	uint32_t decl = (tag->type == T_FUNC) ? tag->tag.decl : 0;
+	void *cfn = decl ? NULL : tag->tag.data;
+	struct ut_profile_func *f;
+	uint32_t i;
+
+	if (decl) {
+		if (decl < p->indexsize && p->index[decl])
+			return p->index[decl] - 1;
+
+		if (!grow(&p->index, &p->indexsize, decl, sizeof(*p->index)))
+			return UINT32_MAX;
+	}
+	else {
+		for (i = 0; i < p->nfuncs; i++)
+			if (!p->funcs[i].decl && p->funcs[i].cfn == cfn)
+				return i;
+	}
+
+	if (!grow(&p->funcs, &p->funcsize, p->nfuncs, sizeof(*p->funcs)))
+		return UINT32_MAX;
+
+	f = &p->funcs[p->nfuncs];
+	f->name = call_name(s, off, decl);
+	f->decl = decl;
+	f->cfn = cfn;
+
+	if (!f->name)
+		return UINT32_MAX;
+
+	if (decl)
+		p->index[decl] = p->nfuncs + 1;
+
+	return p->nfuncs++;
+}
+
+static uint32_t
+find_node(struct ut_profile *p, uint32_t parent, uint32_t func)
+{
+	struct ut_profile_node *node;
+	uint32_t i;
+
+	for (i = p->nodes[parent].child; i; i = p->nodes[i].sibling)
+		if (p->nodes[i].func == func)
+			return i;
+
+	if (!grow(&p->nodes, &p->nodesize, p->nnodes, sizeof(*p->nodes)))
+		return UINT32_MAX;
+
+	node = &p->nodes[p->nnodes];
+	node->func = func;
+	node->sibling = p->nodes[parent].child;
+	p->nodes[parent].child = p->nnodes;
+
+	return p->nnodes++;
+}
+
+bool
+ut_profile_enter(struct ut_state *s, uint32_t off, struct json_object *func)
+{
+	struct ut_profile *p = s->profile;
+	struct ut_op *tag = json_object_get_userdata(func);
+	struct ut_profile_frame *frame;
+	uint32_t f, node;
+
+	if (!tag || (tag->type != T_FUNC && tag->type != T_CFUNC))
+		return false;
+
+	f = find_func(s, off, tag);
+
+	if (f == UINT32_MAX)
+		return false;
+
+	node = find_node(p, p->nframes ? p->frames[p->nframes - 1].node : 0, f);
+
+	if (node == UINT32_MAX ||
+	    !grow(&p->frames, &p->framesize, p->nframes, sizeof(*p->frames)))
+		return false;
+
+	frame = &p->frames[p->nframes++];
+	frame->node = node;
+	frame->off = off;
+	frame->child = 0;
+
+	p->funcs[f].calls++;
+	p->funcs[f].active++;
+
+	frame->start = now();
+
+	return true;
+}
+
+void
+ut_profile_leave(struct ut_state *s)
+{
+	struct ut_profile *p = s->profile;
+	struct ut_profile_frame *frame;
+	struct ut_profile_func *f;
+	uint64_t elapsed;
+
+	/* samples taken while in a native function are attributed to its caller */
+	if (ut_profile_pending)
+		ut_profile_tick(s, p->frames[p->nframes - 1].off);
+
+	frame = &p->frames[--p->nframes];
+	f = &p->funcs[p->nodes[frame->node].func];
+	elapsed = now() - frame->start;
+
+	f->self += elapsed - frame->child;
+
+	/* count recursive calls towards the total time only once */
+	if (--f->active == 0)
+		f->total += elapsed;
+
+	if (p->nframes)
+		p->frames[p->nframes - 1].child += elapsed;
+}
+
+void
+ut_profile_tick(struct ut_state *s, uint32_t off)
+{
+	struct ut_profile *p = s->profile;
+	uint64_t n = __atomic_exchange_n(&ut_profile_pending, 0, __ATOMIC_RELAXED);
+	uint32_t node;
+
+	if (!p)
+		return;
+
+	node = p->nframes ? p->frames[p->nframes - 1].node : 0;
+	p->nodes[node].samples += n;
+	p->samples += n;
+
+	if (grow(&p->opsamples, &p->opsamplesize, off, sizeof(*p->opsamples)))
+		p->opsamples[off] += n;
+}
+
+static struct ut_profile *sort_profile;
+
+static int
+cmp_func(const void *a, const void *b)
+{
+	const struct ut_profile_func *f1 = &sort_profile->funcs[*(const uint32_t *)a];
+	const struct ut_profile_func *f2 = &sort_profile->funcs[*(const uint32_t *)b];
+
+	return (f1->self < f2->self) - (f1->self > f2->self);
+}
+
+static uint64_t *sort_samples;
+
+static int
+cmp_line(const void *a, const void *b)
+{
+	uint64_t n1 = sort_samples[*(const uint32_t *)a];
+	uint64_t n2 = sort_samples[*(const uint32_t *)b];
+
+	return (n1 < n2) - (n1 > n2);
+}
+
+static struct ut_propcache *sort_caches;
+
+static int
+cmp_cache(const void *a, const void *b)
+{
+	uint32_t n1 = sort_caches[*(const uint32_t *)a].misses;
+	uint32_t n2 = sort_caches[*(const uint32_t *)b].misses;
+
+	return (n1 < n2) - (n1 > n2);
+}
+
+/* totals of the inline caches and the property reads missing them most */
+static void
+print_caches(FILE *fp, struct ut_state *s)
+{
+	struct ut_propcache *pc = s->propcache.entries;
+	uint64_t hits = 0, misses = 0;
+	struct ut_op *label;
+	uint32_t *order;
+	uint32_t i, n;
+
+	for (i = 0, n = 0; i < s->propcache.size; i++) {
+		hits += pc[i].hits;
+		misses += pc[i].misses;
+		n += (pc[i].misses > 0);
+	}
+
+	if (!hits && !misses)
+		return;
+
+	fprintf(fp, "\nProperty caches: %" PRIu64 " hits, %" PRIu64 " misses (%.2f%% hit rate)\n",
+	        hits, misses, 100.0 * hits / (hits + misses));
+
+	order = calloc(n, sizeof(*order));
+
+	if (!order)
+		return;
+
+	for (i = 0, n = 0; i < s->propcache.size; i++)
+		if (pc[i].misses)
+			order[n++] = i;
+
+	sort_caches = pc;
+	qsort(order, n, sizeof(*order), cmp_cache);
+
+	fprintf(fp, "\n%10s %10s  %s\n", "misses", "hits", "property");
+
+	for (i = 0; i < n && i < 10; i++) {
+		pc = &s->propcache.entries[order[i]];
+		label = ut_get_op(s, ut_get_op(s, pc->off)->tree.operand[1]);
+
+		fprintf(fp, "%10" PRIu32 " %10" PRIu32 "  .%s", pc->misses, pc->hits,
+		        json_object_get_string(label->val));
+
+		if (line_of(s, pc->off) <= s->profile->nlines)
+			fprintf(fp, " (line %" PRIu32 ")\n", line_of(s, pc->off));
+		else
+			fprintf(fp, " (module)\n");
+	}
+
+	free(order);
+}
+
+static void
+print_line(FILE *fp, struct ut_profile *p, uint32_t line)
+{
+	const char *c = p->source + p->lines[line - 1];
+	size_t len;
+
+	while (*c == ' ' || *c == '\t')
+		c++;
+
+	len = strcspn(c, "\r\n");
+
+	if (len > 60)
+		fprintf(fp, "%5" PRIu32 "  %.57s...\n", line, c);
+	else
+		fprintf(fp, "%5" PRIu32 "  %.*s\n", line, (int)len, c);
+}
+
+void
+ut_profile_report(struct ut_state *s, FILE *fp)
+{
+	struct ut_profile *p = s->profile;
+	uint64_t *samples = NULL;
+	uint32_t *order = NULL;
+	struct ut_profile_func *f;
+	uint32_t i, n;
+
+	if (!p)
+		return;
+
+	fprintf(fp, "Profile: %.3f ms wall time, %" PRIu64 " samples every %d usec of CPU time\n\n",
+	        (now() - p->start) / 1e6, p->samples, UT_PROFILE_INTERVAL);
+
+	order = calloc(p->nfuncs > p->nlines + 2 ? p->nfuncs : p->nlines + 2, sizeof(*order));
+	samples = calloc(p->nlines + 2, sizeof(*samples));
+
+	if (!order || !samples)
+		goto out;
+
+	for (i = 0; i < p->nfuncs; i++)
+		order[i] = i;
+
+	sort_profile = p;
+	qsort(order, p->nfuncs, sizeof(*order), cmp_func);
+
+	fprintf(fp, "%10s %10s %10s  %s\n", "self ms", "total ms", "calls", "function");
+
+	for (i = 0; i < p->nfuncs; i++) {
+		f = &p->funcs[order[i]];
+
+		fprintf(fp, "%10.3f %10.3f %10" PRIu64 "  %s", f->self / 1e6, f->total / 1e6, f->calls, f->name);
+
+		if (!f->decl)
+			fprintf(fp, " [native]\n");
+		else if (f->decl == s->main)
+			fprintf(fp, "\n");
+		else if ((n = line_of(s, f->decl)) <= p->nlines)
+			fprintf(fp, " (line %" PRIu32 ")\n", n);
+		else
+			fprintf(fp, " (module)\n");
+	}
+
+	print_caches(fp, s);
+
+	if (!p->samples)
+		goto out;
+
+	for (i = 0; i < p->opsamplesize; i++)
+		if (p->opsamples[i])
+			samples[line_of(s, i)] += p->opsamples[i];
+
+	for (i = 0, n = 0; i <= p->nlines + 1; i++)
+		if (samples[i])
+			order[n++] = i;
+
+	sort_samples = samples;
+	qsort(order, n, sizeof(*order), cmp_line);
+
+	fprintf(fp, "\n%10s %10s  %s\n", "samples", "percent", "line");
+
+	for (i = 0; i < n; i++) {
+		fprintf(fp, "%10" PRIu64 " %9.2f%%  ", samples[order[i]], 100.0 * samples[order[i]] / p->samples);
+
+		if (!order[i])
+			fprintf(fp, "    -  (no source position)\n");
+		else if (order[i] > p->nlines)
+			fprintf(fp, "    -  (required modules)\n");
+		else
+			print_line(fp, p, order[i]);
+	}
+
+out:
+	free(samples);
+	free(order);
+}
+
+static bool
+print_folded(FILE *fp, struct ut_profile *p, uint32_t node, char **path, size_t *size, size_t len)
+{
+	const char *name = p->funcs[p->nodes[node].func].name;
+	size_t n = strlen(name);
+	uint32_t i;
+	char *tmp;
+
+	if (len + n + 2 > *size) {
+		tmp = realloc(*path, len + n + 256);
+
+		if (!tmp)
+			return false;
+
+		*path = tmp;
+		*size = len + n + 256;
+	}
+
+	if (len)
+		(*path)[len++] = ';';
+
+	memcpy(*path + len, name, n + 1);
+	len += n;
+
+	if (p->nodes[node].samples)
+		fprintf(fp, "%s %" PRIu64 "\n", *path, p->nodes[node].samples);
+
+	for (i = p->nodes[node].child; i; i = p->nodes[i].sibling)
+		if (!print_folded(fp, p, i, path, size, len))
+			return false;
+
+	return true;
+}
+
+/* one line per call path and its sample count, as consumed by flamegraph.pl */
+void
+ut_profile_folded(struct ut_state *s, FILE *fp)
+{
+	struct ut_profile *p = s->profile;
+	char *path = NULL;
+	size_t size = 0;
+	uint32_t i;
+
+	if (!p)
+		return;
+
+	for (i = p->nodes[0].child; i; i = p->nodes[i].sibling)
+		if (!print_folded(fp, p, i, &path, &size, 0))
+			break;
+
+	free(path);
+}
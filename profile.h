@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __PROFILE_H_
+#define __PROFILE_H_
+
+#include <stdio.h>
+#include <signal.h>
+
+#include "ast.h"
+
+#define UT_PROFILE_INTERVAL 1000 /* usec of CPU time between samples */
+
+/*
+ * Function calls are timed when entering and leaving ut_invoke(), while the
+ * current op is sampled through SIGPROF to attribute time to source lines.
+ * The signal handler merely counts; the executing loops look at the counter
+ * and hand pending samples to ut_profile_tick().
+ */
+/* not exported, which keeps the check in the dispatch loop cheap */
+extern volatile sig_atomic_t ut_profile_pending __attribute__((visibility("hidden")));
+
+struct ut_profile *ut_profile_new(struct ut_state *s, const char *source);
+void ut_profile_free(struct ut_profile *p);
+
+bool ut_profile_enter(struct ut_state *s, uint32_t off, struct json_object *func);
+void ut_profile_leave(struct ut_state *s);
+void ut_profile_tick(struct ut_state *s, uint32_t off);
+
+void ut_profile_report(struct ut_state *s, FILE *fp);
+void ut_profile_folded(struct ut_state *s, FILE *fp);
+
+#endif /* __PROFILE_H_ */
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "program.h"
+#include "compiler.h"
+#include "parser.h"
+
+#include <stdlib.h>
+
+/*
+ * Takes over the given, successfully parsed state. All functions are compiled
+ * right away since contexts must not fill the bytecode cache of the program
+ * concurrently.
+ */
+struct ut_program *
+ut_program_new(struct ut_state *s)
+{
+	struct ut_program *prog;
+	uint32_t off;
+
+	if (!ut_get_op(s, s->main))
+		return NULL;
+
+	for (off = 1; off <= s->poolsize; off++)
+		if (ut_get_op(s, off)->type == T_FUNC && !ut_compile(s, off))
+			return NULL;
+
+	prog = calloc(1, sizeof(*prog));
+
+	if (!prog)
+		return NULL;
+
+	prog->state = s;
+	prog->refcount = 1;
+
+	return prog;
+}
+
+struct ut_program *
+ut_program_get(struct ut_program *prog)
+{
+	if (prog)
+		__atomic_add_fetch(&prog->refcount, 1, __ATOMIC_RELAXED);
+
+	return prog;
+}
+
+void
+ut_program_put(struct ut_program *prog)
+{
+	if (!prog || __atomic_sub_fetch(&prog->refcount, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	ut_free(prog->state);
+	free(prog);
+}
+
+/*
+ * Contexts start out borrowing the ops of the program. Ops added later on,
+ * e.g. by loading modules, go into a private copy of the pool.
+ */
+struct ut_state *
+ut_context_new(struct ut_program *prog)
+{
+	struct ut_state *s = calloc(1, sizeof(*s));
+
+	if (!s)
+		return NULL;
+
+	s->prog = ut_program_get(prog);
+	s->pool = prog->state->pool;
+	s->poolsize = prog->state->poolsize;
+	s->poolcap = prog->state->poolsize;
+	s->main = prog->state->main;
+	s->lstrip_blocks = prog->state->lstrip_blocks;
+	s->trim_blocks = prog->state->trim_blocks;
+	s->cache_dir = prog->state->cache_dir;
+	s->maxdepth = prog->state->maxdepth;
+
+	return s;
+}
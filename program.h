@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __PROGRAM_H_
+#define __PROGRAM_H_
+
+#include "ast.h"
+
+/*
+ * A program holds the ops and the bytecode of a parsed template and is never
+ * modified once created. Any number of contexts, possibly running on
+ * different threads, may execute it at the same time; each context is a
+ * struct ut_state carrying the complete runtime state of its executions.
+ */
+struct ut_program {
+	struct ut_state *state;
+	unsigned int refcount;
+};
+
+struct ut_program *ut_program_new(struct ut_state *s);
+struct ut_program *ut_program_get(struct ut_program *prog);
+void ut_program_put(struct ut_program *prog);
+
+struct ut_state *ut_context_new(struct ut_program *prog);
+
+#endif /* __PROGRAM_H_ */
@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "region.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct ut_region_item {
+	union {
+		struct ut_region *region;
+		struct ut_region_item *next;
+	};
+	char data[];
+};
+
+struct ut_region_slab {
+	struct ut_region_slab *next;
+	char items[];
+};
+
+static void
+ut_region_free(struct ut_region *r)
+{
+	struct ut_region_slab *slab;
+
+	while (r->slabs) {
+		slab = r->slabs;
+		r->slabs = slab->next;
+		free(slab);
+	}
+
+	free(r);
+}
+
+struct ut_region *
+ut_region_new(size_t size)
+{
+	struct ut_region *r = calloc(1, sizeof(*r));
+	size_t align = sizeof(void *);
+
+	if (!r)
+		return NULL;
+
+	r->size = (sizeof(struct ut_region_item) + size + align - 1) & ~(align - 1);
+
+	return r;
+}
+
+void *
+ut_region_alloc(struct ut_region *r)
+{
+	struct ut_region_slab *slab;
+	struct ut_region_item *item;
+
+	if (r->free) {
+		item = r->free;
+		r->free = item->next;
+	}
+	else {
+		if (r->cur == r->end) {
+			slab = malloc(sizeof(*slab) + UT_REGION_SLAB_ITEMS * r->size);
+
+			if (!slab)
+				return NULL;
+
+			slab->next = r->slabs;
+			r->slabs = slab;
+			r->cur = slab->items;
+			r->end = slab->items + UT_REGION_SLAB_ITEMS * r->size;
+			r->stats.slabs++;
+		}
+
+		item = (struct ut_region_item *)r->cur;
+		r->cur += r->size;
+	}
+
+	memset(item, 0, r->size);
+	item->region = r;
+
+	r->stats.allocs++;
+
+	if (++r->stats.live * r->size > r->stats.peak)
+		r->stats.peak = r->stats.live * r->size;
+
+	return item->data;
+}
+
+void
+ut_region_release(void *p)
+{
+	struct ut_region_item *item;
+	struct ut_region *r;
+
+	if (!p)
+		return;
+
+	item = (struct ut_region_item *)((char *)p - offsetof(struct ut_region_item, data));
+	r = item->region;
+
+	item->next = r->free;
+	r->free = item;
+
+	if (--r->stats.live == 0 && r->orphaned)
+		ut_region_free(r);
+}
+
+/* drop the owning reference, the slabs go once no item is in use anymore */
+void
+ut_region_put(struct ut_region *r)
+{
+	if (!r)
+		return;
+
+	if (r->stats.live == 0)
+		ut_region_free(r);
+	else
+		r->orphaned = true;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __REGION_H_
+#define __REGION_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* items carved from each slab of a region */
+#define UT_REGION_SLAB_ITEMS 256
+
+struct ut_region_item;
+struct ut_region_slab;
+
+/*
+ * A region hands out zeroed items of one fixed size, carved from slabs which
+ * are only released as a whole. Released items are recycled by later
+ * allocations, so values being created and dropped over and over again do
+ * not reach malloc() at all.
+ *
+ * Items may outlive the owner of their region, e.g. when stored in a context
+ * passed to a run, in which case the slabs are kept until the last item has
+ * been released. A region is not thread safe, its items must only be released
+ * by the thread using it or after that thread has finished.
+ */
+struct ut_region {
+	size_t size;
+	struct ut_region_slab *slabs;
+	struct ut_region_item *free;
+	char *cur, *end;
+	bool orphaned;
+	struct {
+		size_t allocs;
+		size_t slabs;
+		size_t live;
+		size_t peak;
+	} stats;
+};
+
+struct ut_region *ut_region_new(size_t size);
+void *ut_region_alloc(struct ut_region *r);
+void ut_region_release(void *p);
+void ut_region_put(struct ut_region *r);
+
+#endif /* __REGION_H_ */
@@ -2,6 +2,14 @@
 
 line='........................................'
 
+# each test runs with every set of utpl options, by default both in the VM
+# and under the AST walker; given options replace the default sets
+if [ $# -gt 0 ]; then
+	utpl_modes=("$*")
+else
+	utpl_modes=("" "-w")
+fi
+
 extract_section() {
 	local file=$1
 	local tag=$2
@@ -12,7 +20,7 @@ extract_section() {
 run_test() {
 	local file=$1
 	local name=${file##*/}
-	local res
+	local mode res=0
 
 	printf "%s %s " "$name" "${line:${#name}}"
 
@@ -20,36 +28,38 @@ run_test() {
 	extract_section "$file" "Expect stderr" >"/tmp/$$.experr"
 	extract_section "$file" "Testcase" >"/tmp/$$.in"
 
-	./utpl -i "/tmp/$$.in" >"/tmp/$$.out" 2>"/tmp/$$.err"
-
-	local rc=$?
-
-	if ! cmp -s "/tmp/$$.err" "/tmp/$$.experr"; then
-		printf "FAILED:\n"
-		diff -u --color=always --label="Expected stderr" --label="Resulting stderr" "/tmp/$$.experr" "/tmp/$$.err"
-		printf -- "---\n"
-		res=1
-	elif ! cmp -s "/tmp/$$.out" "/tmp/$$.expout"; then
-		printf "FAILED:\n"
-		diff -u --color=always --label="Expected stdout" --label="Resulting stdout" "/tmp/$$.expout" "/tmp/$$.out"
-		printf -- "---\n"
-		res=1
-	#elif [ "$rc" != 0 ]; then
-	#	local err="$(cat "/tmp/$$.err")"
-	#	printf "FAILED:\n"
-	#	printf "Terminated with exit code %d:\n%s\n---\n" $rc "${err:-(no error output)}"
-	#	res=1
-	else
-		printf "OK\n"
-		res=0
-	fi
+	for mode in "${utpl_modes[@]}"; do
+		./utpl $mode -i "/tmp/$$.in" >"/tmp/$$.out" 2>"/tmp/$$.err"
+
+		local rc=$?
+
+		if ! cmp -s "/tmp/$$.err" "/tmp/$$.experr"; then
+			printf "FAILED%s:\n" "${mode:+ ($mode)}"
+			diff -u --color=always --label="Expected stderr" --label="Resulting stderr" "/tmp/$$.experr" "/tmp/$$.err"
+			printf -- "---\n"
+			res=1
+			break
+		elif ! cmp -s "/tmp/$$.out" "/tmp/$$.expout"; then
+			printf "FAILED%s:\n" "${mode:+ ($mode)}"
+			diff -u --color=always --label="Expected stdout" --label="Resulting stdout" "/tmp/$$.expout" "/tmp/$$.out"
+			printf -- "---\n"
+			res=1
+			break
+		#elif [ "$rc" != 0 ]; then
+		#	local err="$(cat "/tmp/$$.err")"
+		#	printf "FAILED:\n"
+		#	printf "Terminated with exit code %d:\n%s\n---\n" $rc "${err:-(no error output)}"
+		#	res=1
+		fi
+	done
+
+	[ $res = 0 ] && printf "OK\n"
 
 	rm -f "/tmp/$$.in" "/tmp/$$.out" "/tmp/$$.err" "/tmp/$$.expout" "/tmp/$$.experr"
 
 	return $res
 }
 
-
 n_tests=0
 n_fails=0
 
@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "server.h"
+#include "eval.h"
+#include "lib.h"
+#include "cache.h"
+
+struct ut_template {
+	struct ut_template *next;
+	char *path;
+	char *source;
+	struct stat st;
+	struct ut_state *state;
+};
+
+static volatile sig_atomic_t stop;
+
+static void
+stop_handler(int sig)
+{
+	stop = 1;
+}
+
+static void
+template_free(struct ut_template *tpl)
+{
+	ut_free(tpl->state);
+	free(tpl->source);
+	free(tpl->path);
+	free(tpl);
+}
+
+static struct ut_template *
+template_load(struct ut_state *opts, const char *path, const struct stat *st, char **err)
+{
+	struct ut_template *tpl = calloc(1, sizeof(*tpl));
+	uint32_t base;
+	FILE *fp;
+
+	if (!tpl)
+		goto oom;
+
+	tpl->path = strdup(path);
+	tpl->state = calloc(1, sizeof(*tpl->state));
+
+	if (!tpl->path || !tpl->state)
+		goto oom;
+
+	tpl->st = *st;
+	tpl->state->lstrip_blocks = opts->lstrip_blocks;
+	tpl->state->trim_blocks = opts->trim_blocks;
+	tpl->state->walk_ast = opts->walk_ast;
+	tpl->state->memo_persist = opts->memo_persist;
+	tpl->state->cache_dir = opts->cache_dir;
+	tpl->state->maxdepth = opts->maxdepth;
+
+	fp = fopen(path, "r");
+
+	if (!fp) {
+		if (asprintf(err, "Failed to open %s: %s", path, strerror(errno)) < 0)
+			*err = NULL;
+
+		template_free(tpl);
+
+		return NULL;
+	}
+
+	tpl->source = ut_read_file(fp, NULL);
+	fclose(fp);
+
+	if (!tpl->source)
+		goto oom;
+
+	if (!ut_cache_load(tpl->state, path, st)) {
+		base = tpl->state->poolsize;
+
+		if (ut_parse(tpl->state, tpl->source)) {
+			*err = ut_format_error(tpl->state, tpl->source);
+			template_free(tpl);
+
+			return NULL;
+		}
+
+		ut_cache_store(tpl->state, path, st, base);
+	}
+
+	return tpl;
+
+oom:
+	*err = strdup(UT_ERRMSG_OOM);
+
+	if (tpl)
+		template_free(tpl);
+
+	return NULL;
+}
+
+/* look up the parsed template, reloading it if the file changed */
+static struct ut_template *
+template_get(struct ut_state *opts, struct ut_template **list, const char *name, char **err)
+{
+	struct ut_template **tp, *tpl;
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (!realpath(name, path) || stat(path, &st)) {
+		if (asprintf(err, "Failed to open %s: %s", name, strerror(errno)) < 0)
+			*err = NULL;
+
+		return NULL;
+	}
+
+	for (tp = list; *tp; tp = &(*tp)->next) {
+		tpl = *tp;
+
+		if (strcmp(tpl->path, path))
+			continue;
+
+		if (tpl->st.st_ino == st.st_ino && tpl->st.st_size == st.st_size &&
+		    tpl->st.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+		    tpl->st.st_mtim.tv_nsec == st.st_mtim.tv_nsec)
+			return tpl;
+
+		*tp = tpl->next;
+		template_free(tpl);
+		break;
+	}
+
+	tpl = template_load(opts, path, &st, err);
+
+	if (tpl) {
+		tpl->next = *list;
+		*list = tpl;
+	}
+
+	return tpl;
+}
+
+static struct json_object *
+read_request(int fd)
+{
+	struct json_object *req = NULL;
+	char *buf, *nl = NULL;
+	size_t len = 0;
+	ssize_t n;
+
+	buf = malloc(UT_SERVER_MAXREQUEST + 1);
+
+	if (!buf)
+		return NULL;
+
+	while (!nl && len < UT_SERVER_MAXREQUEST) {
+		n = read(fd, buf + len, UT_SERVER_MAXREQUEST - len);
+
+		if (n < 0 && errno == EINTR && !stop)
+			continue;
+
+		if (n <= 0)
+			break;
+
+		nl = memchr(buf + len, '\n', n);
+		len += n;
+	}
+
+	buf[nl ? nl - buf : len] = 0;
+
+	if (nl || (len > 0 && len < UT_SERVER_MAXREQUEST))
+		req = json_tokener_parse(buf);
+
+	free(buf);
+
+	return req;
+}
+
+static void
+handle_request(struct ut_state *opts, struct ut_template **list, int fd)
+{
+	struct json_object *req = read_request(fd);
+	struct json_object *name, *env, *status;
+	enum ut_error_type rv = UT_ERROR_EXCEPTION;
+	struct ut_template *tpl = NULL;
+	struct ut_output out = { 0 };
+	char *err = NULL;
+	const char *s;
+
+	if (!json_object_object_get_ex(req, "template", &name) ||
+	    !json_object_is_type(name, json_type_string)) {
+		err = strdup("Invalid request, expecting a template path");
+	}
+	else if ((tpl = template_get(opts, list, json_object_get_string(name), &err)) != NULL) {
+		if (!json_object_object_get_ex(req, "context", &env))
+			env = NULL;
+
+		ut_output_fd(&tpl->state->output, fd);
+		rv = ut_run(tpl->state, env);
+
+		if (rv)
+			err = ut_format_error(tpl->state, tpl->source);
+
+		ut_output_free(&tpl->state->output);
+	}
+
+	status = json_object_new_object();
+	json_object_object_add(status, "status", json_object_new_int64(err ? rv : 0));
+
+	if (err)
+		json_object_object_add(status, "error", json_object_new_string(err));
+
+	s = json_object_to_json_string(status);
+
+	ut_output_fd(&out, fd);
+	ut_output_write(&out, "", 1);
+	ut_output_write(&out, s, strlen(s));
+	ut_output_write(&out, "\n", 1);
+	ut_output_free(&out);
+
+	json_object_put(status);
+	json_object_put(req);
+	free(err);
+}
+
+int
+ut_server_run(struct ut_state *opts, const char *path)
+{
+	struct timeval tv = { .tv_sec = UT_SERVER_TIMEOUT };
+	struct sigaction sa = { .sa_handler = stop_handler };
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	struct ut_template *list = NULL, *tpl;
+	int fd, cfd;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "Socket path %s too long\n", path);
+
+		return UT_ERROR_EXCEPTION;
+	}
+
+	strcpy(sun.sun_path, path);
+
+	/* no SA_RESTART, a signal has to interrupt accept() */
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (fd == -1 || (unlink(path) && errno != ENOENT) ||
+	    bind(fd, (struct sockaddr *)&sun, sizeof(sun)) || listen(fd, 16)) {
+		fprintf(stderr, "Unable to listen on %s: %s\n", path, strerror(errno));
+
+		if (fd != -1)
+			close(fd);
+
+		return UT_ERROR_EXCEPTION;
+	}
+
+	while (!stop) {
+		cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+
+		if (cfd == -1) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				fprintf(stderr, "Unable to accept connection: %s\n", strerror(errno));
+
+			continue;
+		}
+
+		setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+		handle_request(opts, &list, cfd);
+		close(cfd);
+	}
+
+	close(fd);
+	unlink(path);
+
+	while (list) {
+		tpl = list;
+		list = tpl->next;
+		template_free(tpl);
+	}
+
+	return 0;
+}
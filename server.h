@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __SERVER_H_
+#define __SERVER_H_
+
+#include "ast.h"
+
+#define UT_SERVER_MAXREQUEST (1024 * 1024)
+#define UT_SERVER_TIMEOUT 10 /* seconds to wait for a stalled client */
+
+/*
+ * Serves render requests on a unix socket until terminated. A client sends
+ * a single JSON object terminated by a newline or by shutting down its end
+ * of the connection:
+ *
+ *   { "template": "/path/to/file", "context": { ... } }
+ *
+ * The output of the template is streamed back, followed by a zero byte and
+ * a JSON status object like { "status": 0 }, which carries an "error"
+ * message if the status is not zero. Templates are parsed once and kept
+ * along with their loaded modules until the file changes; the lexer and
+ * runtime options are taken from the given state.
+ */
+int ut_server_run(struct ut_state *opts, const char *path);
+
+#endif /* __SERVER_H_ */
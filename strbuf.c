@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "strbuf.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+static struct ut_strbuf *
+ut_strbuf_alloc(size_t size)
+{
+	struct ut_strbuf *sb;
+
+	if (size > SIZE_MAX - sizeof(*sb) - 1)
+		return NULL;
+
+	sb = malloc(sizeof(*sb) + size + 1);
+
+	if (!sb)
+		return NULL;
+
+	sb->refcount = 1;
+	sb->len = 0;
+	sb->size = size;
+
+	return sb;
+}
+
+/* make room for len more bytes, moving to a private buffer if shared */
+static bool
+ut_strbuf_reserve(struct ut_strbuf **sb, size_t len)
+{
+	struct ut_strbuf *tmp = *sb;
+	size_t size;
+
+	if (tmp->size - tmp->len >= len)
+		return true;
+
+	if (len > SIZE_MAX / 2 - tmp->len)
+		return false;
+
+	size = tmp->size * 2;
+
+	if (size < tmp->len + len)
+		size = tmp->len + len;
+
+	if (tmp->refcount == 1) {
+		if (size > SIZE_MAX - sizeof(*tmp) - 1)
+			return false;
+
+		tmp = realloc(tmp, sizeof(*tmp) + size + 1);
+
+		if (!tmp)
+			return false;
+
+		tmp->size = size;
+	}
+	else {
+		tmp = ut_strbuf_alloc(size);
+
+		if (!tmp)
+			return false;
+
+		memcpy(tmp->data, (*sb)->data, (*sb)->len);
+		tmp->len = (*sb)->len;
+
+		ut_strbuf_put(*sb);
+	}
+
+	*sb = tmp;
+
+	return true;
+}
+
+struct ut_strbuf *
+ut_strbuf_new(const char *p, size_t len, size_t hint)
+{
+	struct ut_strbuf *sb = ut_strbuf_alloc((hint > len) ? hint : len);
+
+	if (!sb)
+		return NULL;
+
+	if (len)
+		memcpy(sb->data, p, len);
+
+	sb->len = len;
+	sb->data[len] = 0;
+
+	return sb;
+}
+
+struct ut_strbuf *
+ut_strbuf_get(struct ut_strbuf *sb)
+{
+	if (sb)
+		sb->refcount++;
+
+	return sb;
+}
+
+void
+ut_strbuf_put(struct ut_strbuf *sb)
+{
+	if (sb && --sb->refcount == 0)
+		free(sb);
+}
+
+bool
+ut_strbuf_append(struct ut_strbuf **sb, const char *p, size_t len)
+{
+	if (!*sb) {
+		*sb = ut_strbuf_new(p, len, 64);
+
+		return (*sb != NULL);
+	}
+
+	if (!ut_strbuf_reserve(sb, len))
+		return false;
+
+	memcpy((*sb)->data + (*sb)->len, p, len);
+	(*sb)->len += len;
+	(*sb)->data[(*sb)->len] = 0;
+
+	return true;
+}
+
+/* append the string representation of the value, null yields "null" */
+bool
+ut_strbuf_append_val(struct ut_strbuf **sb, struct json_object *val)
+{
+	const char *p;
+
+	if (json_object_is_type(val, json_type_string))
+		return ut_strbuf_append(sb, json_object_get_string(val),
+		                        json_object_get_string_len(val));
+
+	p = val ? json_object_get_string(val) : "null";
+
+	return ut_strbuf_append(sb, p, strlen(p));
+}
+
+bool
+ut_strbuf_printf(struct ut_strbuf **sb, const char *fmt, ...)
+{
+	size_t avail;
+	va_list ap;
+	int n;
+
+	if (!*sb && !ut_strbuf_append(sb, "", 0))
+		return false;
+
+	/* try to format into the spare room right away, retry after growing */
+	avail = (*sb)->size - (*sb)->len + 1;
+
+	va_start(ap, fmt);
+	n = vsnprintf((*sb)->data + (*sb)->len, avail, fmt, ap);
+	va_end(ap);
+
+	if (n < 0)
+		return false;
+
+	if ((size_t)n >= avail) {
+		if (!ut_strbuf_reserve(sb, n))
+			return false;
+
+		va_start(ap, fmt);
+		vsnprintf((*sb)->data + (*sb)->len, n + 1, fmt, ap);
+		va_end(ap);
+	}
+
+	(*sb)->len += n;
+
+	return true;
+}
+
+/* turn the buffer into a json string, the buffer reference is consumed */
+struct json_object *
+ut_strbuf_finish(struct ut_strbuf *sb)
+{
+	struct json_object *rv;
+
+	if (!sb)
+		return json_object_new_string("");
+
+	rv = json_object_new_string_len(sb->data, sb->len);
+
+	ut_strbuf_put(sb);
+
+	return rv;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __STRBUF_H_
+#define __STRBUF_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef JSONC
+	#include <json.h>
+#else
+	#include <json-c/json.h>
+#endif
+
+/*
+ * Growable, reference counted string buffer. Holders sharing a buffer may
+ * each only use a prefix of it, so the data is not necessarily terminated
+ * at a holder's length; appending never alters bytes below the current
+ * length, which lets any holder of the full length keep appending in place.
+ */
+struct ut_strbuf {
+	unsigned int refcount;
+	size_t len;
+	size_t size;
+	char data[];
+};
+
+struct ut_strbuf *ut_strbuf_new(const char *p, size_t len, size_t hint);
+struct ut_strbuf *ut_strbuf_get(struct ut_strbuf *sb);
+void ut_strbuf_put(struct ut_strbuf *sb);
+
+bool ut_strbuf_append(struct ut_strbuf **sb, const char *p, size_t len);
+bool ut_strbuf_append_val(struct ut_strbuf **sb, struct json_object *val);
+
+__attribute__((format(printf, 2, 3)))
+bool ut_strbuf_printf(struct ut_strbuf **sb, const char *fmt, ...);
+
+struct json_object *ut_strbuf_finish(struct ut_strbuf *sb);
+
+#endif /* __STRBUF_H_ */
@@ -0,0 +1,1374 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "vm.h"
+#include "eval.h"
+#include "lexer.h"
+#include "parser.h"
+#include "program.h"
+#include "iter.h"
+#include "profile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__GNUC__) && !defined(UT_VM_NO_COMPUTED_GOTO)
+#define UT_VM_COMPUTED_GOTO
+#endif
+
+#ifdef UT_VM_COMPUTED_GOTO
+#define vm_case(name) do_##name
+#define vm_dispatch() goto *dispatch[(insn = &code[pc++])->code]
+#else
+#define vm_case(name) case I_##name
+#define vm_dispatch() goto next
+#endif
+
+#define vm_next() \
+	do { \
+		if (ut_profile_pending) \
+			ut_profile_tick(s, code[pc].off); \
+		vm_dispatch(); \
+	} while (0)
+
+#define push(v) (stack[sp++] = (v))
+#define pop() (stack[--sp])
+#define top() (stack[sp - 1])
+#define push_obj(o) push(val_obj(o))
+#define pop_obj() val_box(pop())
+#define op_at(off) (&s->pool[(off) - 1])
+
+struct ut_vm_iter {
+	struct ut_iter iter;
+	struct ut_slot *slot;
+	struct json_object *scope;
+	struct json_object *key;
+};
+
+static struct ut_value
+val_obj(struct json_object *obj)
+{
+	return (struct ut_value){ .u.obj = obj, .type = UT_VAL_OBJ };
+}
+
+static struct ut_value
+val_int(int64_t n)
+{
+	return (struct ut_value){ .u.n = n, .type = UT_VAL_INT };
+}
+
+static struct ut_value
+val_double(double d)
+{
+	return (struct ut_value){ .u.d = d, .type = UT_VAL_DOUBLE };
+}
+
+static struct ut_value
+val_bool(bool b)
+{
+	return (struct ut_value){ .u.b = b, .type = UT_VAL_BOOL };
+}
+
+static struct ut_value
+val_str(struct ut_strbuf *sb)
+{
+	/* too long strings are flattened right away */
+	if (sb && sb->len > UINT32_MAX)
+		return val_obj(ut_strbuf_finish(sb));
+
+	return (struct ut_value){ .u.sb = sb, .len = sb ? sb->len : 0, .type = UT_VAL_STR };
+}
+
+/* turn value into a json object, the value is consumed */
+static struct json_object *
+val_box(struct ut_value v)
+{
+	struct json_object *obj;
+
+	switch (v.type) {
+	case UT_VAL_INT:
+		return json_object_new_int64(v.u.n);
+
+	case UT_VAL_DOUBLE:
+		return ut_new_double(v.u.d);
+
+	case UT_VAL_BOOL:
+		return json_object_new_boolean(v.u.b);
+
+	case UT_VAL_STR:
+		obj = json_object_new_string_len(v.u.sb->data, v.len);
+		ut_strbuf_put(v.u.sb);
+
+		return obj;
+
+	default:
+		return v.u.obj;
+	}
+}
+
+static struct ut_value
+val_flatten(struct ut_value v)
+{
+	return (v.type == UT_VAL_STR) ? val_obj(val_box(v)) : v;
+}
+
+static struct ut_value
+val_get(struct ut_value v)
+{
+	if (v.type == UT_VAL_OBJ)
+		json_object_get(v.u.obj);
+	else if (v.type == UT_VAL_STR)
+		ut_strbuf_get(v.u.sb);
+
+	return v;
+}
+
+static void
+val_put(struct ut_value v)
+{
+	if (v.type == UT_VAL_OBJ)
+		ut_putval(v.u.obj);
+	else if (v.type == UT_VAL_STR)
+		ut_strbuf_put(v.u.sb);
+}
+
+static bool
+val_is_truish(struct ut_value v)
+{
+	switch (v.type) {
+	case UT_VAL_INT:
+		return (v.u.n != 0);
+
+	case UT_VAL_DOUBLE:
+		return (v.u.d != 0 && !isnan(v.u.d));
+
+	case UT_VAL_BOOL:
+		return v.u.b;
+
+	case UT_VAL_STR:
+		return (v.len > 0);
+
+	default:
+		return ut_val_is_truish(v.u.obj);
+	}
+}
+
+static enum json_type
+val_get_type(struct ut_value v)
+{
+	switch (v.type) {
+	case UT_VAL_INT:
+		return json_type_int;
+
+	case UT_VAL_DOUBLE:
+		return json_type_double;
+
+	case UT_VAL_BOOL:
+		return json_type_boolean;
+
+	case UT_VAL_STR:
+		return json_type_string;
+
+	default:
+		return json_object_get_type(v.u.obj);
+	}
+}
+
+static enum json_type
+val_cast_number(struct ut_value v, int64_t *n, double *d)
+{
+	struct json_object *obj;
+	enum json_type t;
+
+	*d = 0.0;
+	*n = 0;
+
+	switch (v.type) {
+	case UT_VAL_INT:
+		*n = v.u.n;
+
+		return json_type_int;
+
+	case UT_VAL_DOUBLE:
+		*d = v.u.d;
+
+		return json_type_double;
+
+	case UT_VAL_BOOL:
+		*n = v.u.b;
+
+		return json_type_int;
+
+	case UT_VAL_STR:
+		obj = val_box(val_get(v));
+		t = ut_cast_number(obj, n, d);
+		ut_putval(obj);
+
+		return t;
+
+	default:
+		return ut_cast_number(v.u.obj, n, d);
+	}
+}
+
+static int64_t
+val_cast_int(struct ut_value v)
+{
+	int64_t n;
+	double d;
+
+	if (val_cast_number(v, &n, &d) == json_type_double)
+		n = isnan(d) ? 0 : (int64_t)d;
+
+	return n;
+}
+
+static bool
+is_ref(struct json_object *val)
+{
+	return (json_object_is_type(val, json_type_object) ||
+	        json_object_is_type(val, json_type_array));
+}
+
+static bool
+is_exception(struct ut_value v)
+{
+	struct ut_op *tag;
+
+	if (v.type != UT_VAL_OBJ)
+		return false;
+
+	tag = json_object_get_userdata(v.u.obj);
+
+	return (tag && tag->type == T_EXCEPTION);
+}
+
+/* push constants of number and boolean literals unboxed */
+static struct ut_value
+ut_vm_const(struct ut_state *s, uint32_t off)
+{
+	struct ut_op *op = op_at(off);
+	size_t base;
+
+	switch (op->type) {
+	case T_NUMBER:
+		return val_int(json_object_get_int64(op->val));
+
+	case T_DOUBLE:
+		return val_double(json_object_get_double(op->val));
+
+	case T_BOOL:
+		return val_bool(json_object_get_boolean(op->val));
+
+	default:
+		base = s->prog ? s->prog->state->poolsize : 0;
+
+		if (!op->val || off > base)
+			return val_obj(json_object_get(op->val));
+
+		/* json-c refcounts are not atomic, so contexts never reference the
+		 * string constants of a shared program but use a private copy */
+		if (!s->consts)
+			s->consts = calloc(base, sizeof(*s->consts));
+
+		if (!s->consts)
+			return val_obj(NULL);
+
+		if (!s->consts[off - 1])
+			s->consts[off - 1] = json_object_new_string_len(
+				json_object_get_string(op->val),
+				json_object_get_string_len(op->val));
+
+		return val_obj(json_object_get(s->consts[off - 1]));
+	}
+}
+
+/*
+ * String concatenation appends to the buffer of the left operand if that
+ * holds exactly its value, which makes building a string by repeatedly
+ * adding to a variable linear.
+ */
+static struct ut_value
+ut_vm_concat(struct ut_value v1, struct ut_value v2)
+{
+	struct ut_strbuf *sb = NULL;
+	struct json_object *obj;
+	bool ok;
+
+	if (v1.type == UT_VAL_STR && v1.len == v1.u.sb->len) {
+		sb = v1.u.sb;
+	}
+	else if (v1.type == UT_VAL_STR) {
+		sb = ut_strbuf_new(v1.u.sb->data, v1.len, v1.len * 2);
+		ut_strbuf_put(v1.u.sb);
+	}
+	else {
+		obj = val_box(v1);
+		ok = ut_strbuf_append_val(&sb, obj);
+		ut_putval(obj);
+
+		if (!ok) {
+			val_put(v2);
+
+			return val_obj(NULL);
+		}
+	}
+
+	if (v2.type == UT_VAL_STR) {
+		ok = sb && ut_strbuf_append(&sb, v2.u.sb->data, v2.len);
+		ut_strbuf_put(v2.u.sb);
+	}
+	else {
+		obj = val_box(v2);
+		ok = sb && ut_strbuf_append_val(&sb, obj);
+		ut_putval(obj);
+	}
+
+	if (!ok) {
+		ut_strbuf_put(sb);
+
+		return val_obj(NULL);
+	}
+
+	return val_str(sb);
+}
+
+/* arithmetic following ut_arith() semantics, operands are consumed */
+static struct ut_value
+ut_vm_arith(int type, struct ut_value v1, struct ut_value v2)
+{
+	enum json_type t1, t2;
+	int64_t n1, n2;
+	double d1, d2;
+
+	if (type == T_ADD &&
+	    (val_get_type(v1) == json_type_string || val_get_type(v2) == json_type_string))
+		return ut_vm_concat(v1, v2);
+
+	t1 = val_cast_number(v1, &n1, &d1);
+	t2 = val_cast_number(v2, &n2, &d2);
+
+	val_put(v1);
+	val_put(v2);
+
+	if (t1 == json_type_double || t2 == json_type_double) {
+		d1 = (t1 == json_type_double) ? d1 : (double)n1;
+		d2 = (t2 == json_type_double) ? d2 : (double)n2;
+
+		switch (type) {
+		case T_ADD:
+			return val_double(d1 + d2);
+
+		case T_SUB:
+			return val_double(d1 - d2);
+
+		case T_MUL:
+			return val_double(d1 * d2);
+
+		case T_DIV:
+			if (d2 == 0.0)
+				return val_double(INFINITY);
+			else if (isnan(d2))
+				return val_double(NAN);
+			else if (!isfinite(d2))
+				return val_double(isfinite(d1) ? 0.0 : NAN);
+
+			return val_double(d1 / d2);
+
+		default:
+			return val_double(NAN);
+		}
+	}
+
+	switch (type) {
+	case T_ADD:
+		return val_int(n1 + n2);
+
+	case T_SUB:
+		return val_int(n1 - n2);
+
+	case T_MUL:
+		return val_int(n1 * n2);
+
+	case T_DIV:
+		if (n2 == 0)
+			return val_double(INFINITY);
+
+		return val_int(n1 / n2);
+
+	case T_MOD:
+		return val_int(n1 % n2);
+
+	default:
+		return val_double(NAN);
+	}
+}
+
+static struct ut_value
+ut_vm_bitop(int type, struct ut_value v1, struct ut_value v2)
+{
+	int64_t n1 = val_cast_int(v1);
+	int64_t n2 = val_cast_int(v2);
+
+	val_put(v1);
+	val_put(v2);
+
+	switch (type) {
+	case T_LSHIFT:
+		return val_int(n1 << n2);
+
+	case T_RSHIFT:
+		return val_int(n1 >> n2);
+
+	case T_BAND:
+		return val_int(n1 & n2);
+
+	case T_BXOR:
+		return val_int(n1 ^ n2);
+
+	default:
+		return val_int(n1 | n2);
+	}
+}
+
+/*
+ * Comparisons of strings, arrays and objects need both operands to be json
+ * objects, if either side is unboxed the comparison is numeric like in
+ * ut_cmp().
+ */
+static struct ut_value
+ut_vm_rel(int type, struct ut_value v1, struct ut_value v2)
+{
+	enum json_type t1, t2;
+	int64_t n1, n2, delta;
+	double d1, d2;
+	bool rv;
+
+	v1 = val_flatten(v1);
+	v2 = val_flatten(v2);
+
+	if (v1.type == UT_VAL_OBJ && v2.type == UT_VAL_OBJ) {
+		rv = ut_cmp(type, v1.u.obj, v2.u.obj);
+		val_put(v1);
+		val_put(v2);
+
+		return val_bool(rv);
+	}
+
+	t1 = val_cast_number(v1, &n1, &d1);
+	t2 = val_cast_number(v2, &n2, &d2);
+
+	val_put(v1);
+	val_put(v2);
+
+	if (t1 == json_type_double || t2 == json_type_double) {
+		d1 = (t1 == json_type_double) ? d1 : (double)n1;
+		d2 = (t2 == json_type_double) ? d2 : (double)n2;
+
+		if (d1 == d2)
+			delta = 0;
+		else if (d1 < d2)
+			delta = -1;
+		else
+			delta = 1;
+	}
+	else {
+		delta = n1 - n2;
+	}
+
+	switch (type) {
+	case T_LT:
+		return val_bool(delta < 0);
+
+	case T_LE:
+		return val_bool(delta <= 0);
+
+	case T_GT:
+		return val_bool(delta > 0);
+
+	case T_GE:
+		return val_bool(delta >= 0);
+
+	case T_EQ:
+		return val_bool(delta == 0);
+
+	default:
+		return val_bool(delta != 0);
+	}
+}
+
+static struct ut_value
+ut_vm_equality(int type, struct ut_value v1, struct ut_value v2)
+{
+	struct json_object *rv;
+	enum json_type t;
+	int64_t n1, n2;
+	double d1, d2;
+	bool equal;
+
+	v1 = val_flatten(v1);
+	v2 = val_flatten(v2);
+
+	if (v1.type == UT_VAL_OBJ && v2.type == UT_VAL_OBJ) {
+		rv = ut_equality(type, v1.u.obj, v2.u.obj);
+		equal = json_object_get_boolean(rv);
+		ut_putval(rv);
+
+		return val_bool(equal);
+	}
+
+	if (val_get_type(v1) != val_get_type(v2)) {
+		equal = false;
+	}
+	else {
+		t = val_cast_number(v1, &n1, &d1);
+		val_cast_number(v2, &n2, &d2);
+		equal = (t == json_type_double) ? (d1 == d2) : (n1 == n2);
+	}
+
+	val_put(v1);
+	val_put(v2);
+
+	return val_bool((type == T_EQS) ? equal : !equal);
+}
+
+static struct ut_value
+ut_vm_unary_arith(int type, bool overflow, struct ut_value v)
+{
+	enum json_type t;
+	int64_t n;
+	double d;
+
+	t = val_cast_number(v, &n, &d);
+
+	val_put(v);
+
+	if (t == json_type_double)
+		return val_double((type == T_SUB) ? -d : d);
+
+	if (overflow)
+		return val_int(((n >= 0) == (type == T_SUB)) ? INT64_MIN : INT64_MAX);
+
+	return val_int((type == T_SUB) ? -n : n);
+}
+
+static struct ut_value
+ut_vm_inc_dec(int type, struct ut_value v)
+{
+	int64_t n;
+	double d;
+
+	if (val_cast_number(v, &n, &d) == json_type_double)
+		return val_double(d + (type == T_INC ? 1.0 : -1.0));
+
+	return val_int(n + (type == T_INC ? 1 : -1));
+}
+
+/*
+ * Resolve a variable access: the slot of the current frame if the name has
+ * been declared there already, else the innermost calling frame holding a
+ * bound slot for the symbol. NULL means the name lives in the global scope.
+ */
+static struct ut_slot *
+ut_vm_lookup(struct ut_state *s, struct ut_insn *insn)
+{
+	struct ut_frame *frame = s->stack.frames[s->stack.nframes - 1];
+	uint32_t i;
+	uint16_t k;
+
+	if (insn->slot != UT_NOSLOT && frame->slots[insn->slot].bound)
+		return &frame->slots[insn->slot];
+
+	for (i = s->stack.nframes - 1; i-- > 0; ) {
+		frame = s->stack.frames[i];
+
+		for (k = 0; k < frame->nslots; k++)
+			if (frame->symbols[k] == insn->arg && frame->slots[k].bound)
+				return &frame->slots[k];
+	}
+
+	return NULL;
+}
+
+static struct ut_value
+ut_vm_bind(struct ut_slot *slot, struct ut_value val)
+{
+	val_put(slot->val);
+	slot->val = val;
+	slot->bound = true;
+
+	return val_get(val);
+}
+
+static struct ut_propcache *
+ut_vm_propcache(struct ut_state *s, uint32_t idx, uint32_t off)
+{
+	struct ut_propcache *tmp;
+	uint32_t size;
+
+	if (idx >= s->propcache.size) {
+		size = (s->code.ncaches > idx) ? s->code.ncaches : idx + 1;
+		tmp = realloc(s->propcache.entries, size * sizeof(*tmp));
+
+		if (!tmp)
+			return NULL;
+
+		memset(tmp + s->propcache.size, 0, (size - s->propcache.size) * sizeof(*tmp));
+		s->propcache.entries = tmp;
+		s->propcache.size = size;
+	}
+
+	s->propcache.entries[idx].off = off;
+
+	return &s->propcache.entries[idx];
+}
+
+/*
+ * A cached entry is still valid as long as the table of the holder was not
+ * resized and the entry still carries the key, provided that none of the
+ * objects before the holder in the prototype chain gained the key since.
+ */
+static struct json_object *
+ut_vm_getprop(struct ut_state *s, struct ut_insn *insn, struct json_object *obj)
+{
+	struct ut_op *label = ut_get_op(s, op_at(insn->off)->tree.operand[1]);
+	struct ut_propcache *pc;
+	struct json_object *o;
+	struct lh_table *t;
+	struct lh_entry *e;
+	const char *key;
+	uint32_t depth;
+
+	if (!label || !json_object_is_type(obj, json_type_object))
+		return ut_getval(obj, label ? label->val : NULL, label ? label->hash : 0);
+
+	pc = ut_vm_propcache(s, insn->arg, insn->off);
+
+	if (!pc || !label->hash)
+		return ut_getval(obj, label->val, label->hash);
+
+	key = json_object_get_string(label->val);
+
+	for (o = obj, depth = 0; o && depth < pc->depth; o = ut_getproto(o), depth++) {
+		t = json_object_get_object(o);
+
+		if (t && t->count && lh_table_lookup_entry_w_hash(t, key, label->hash))
+			break;
+	}
+
+	if (o && o == pc->holder && depth == pc->depth) {
+		t = json_object_get_object(o);
+
+		if (t->table == pc->table && pc->entry->k == pc->key && !strcmp(pc->key, key)) {
+			pc->hits++;
+
+			return json_object_get(lh_entry_v(pc->entry));
+		}
+	}
+
+	pc->misses++;
+
+	for (o = obj, depth = 0; o; o = ut_getproto(o), depth++) {
+		t = json_object_get_object(o);
+
+		if (!t)
+			continue;
+
+		e = lh_table_lookup_entry_w_hash(t, key, label->hash);
+
+		if (!e)
+			continue;
+
+		if (depth <= UINT8_MAX) {
+			pc->holder = o;
+			pc->table = t->table;
+			pc->entry = e;
+			pc->key = e->k;
+			pc->depth = depth;
+		}
+
+		return json_object_get(lh_entry_v(e));
+	}
+
+	return NULL;
+}
+
+static struct json_object *
+ut_vm_raise(struct ut_state *s, uint8_t kind, uint32_t off)
+{
+	struct ut_op *op = ut_get_op(s, off);
+
+	switch (kind) {
+	case UT_RAISE_LHS:
+		return ut_ref_exception(s, off);
+
+	case UT_RAISE_LOOPCTL:
+		return ut_exception(s, off, "Syntax error: %s statement must be inside loop",
+		                    tokennames[op->type]);
+
+	case UT_RAISE_FORIN_INIT:
+		return ut_exception(s, off, "Syntax error: missing ';' after for loop initializer");
+
+	case UT_RAISE_FORIN_LHS:
+		return ut_exception(s, off, "Syntax error: invalid for-in left-hand side");
+
+	default:
+		return ut_exception(s, off, "Runtime error: Unrecognized opcode %d", op ? op->type : 0);
+	}
+}
+
+static struct json_object *
+ut_vm_run(struct ut_state *s, struct ut_frame *frame, struct ut_insn *code,
+          uint16_t maxstack, uint16_t niters)
+{
+#ifdef UT_VM_COMPUTED_GOTO
+#define UT_INSN_LABEL(name, effect) [I_##name] = &&do_##name,
+	static const void *dispatch[] = { UT_INSNS(UT_INSN_LABEL) };
+#undef UT_INSN_LABEL
+#endif
+	struct ut_value stack[maxstack + 1];
+	struct ut_vm_iter iters[niters + 1];
+	struct ut_value rv = val_obj(NULL), v, v2;
+	struct json_object *obj, *key, *ctx;
+	struct ut_vm_iter *it;
+	struct ut_slot *sl;
+	struct ut_insn *insn;
+	struct ut_op *op;
+	uint32_t pc = 0;
+	uint16_t sp = 0;
+	uint16_t n;
+	int64_t n64;
+	bool b;
+
+	memset(iters, 0, sizeof(iters));
+
+#ifdef UT_VM_COMPUTED_GOTO
+	vm_next();
+#else
+next:
+	insn = &code[pc++];
+
+	switch (insn->code) {
+#endif
+
+	vm_case(NULL):
+		push_obj(NULL);
+		vm_next();
+
+	vm_case(CONST):
+		push(ut_vm_const(s, insn->off));
+		vm_next();
+
+	vm_case(POP):
+		val_put(pop());
+		vm_next();
+
+	vm_case(THIS):
+		push_obj(json_object_get(frame->ctx));
+		vm_next();
+
+	vm_case(FUNC):
+		op = op_at(insn->off);
+		obj = ut_new_func(s, insn->off);
+
+		if (!obj)
+			obj = ut_exception(s, insn->off, UT_ERRMSG_OOM);
+		else if (op->tree.operand[0])
+			val_put(ut_vm_bind(&frame->slots[insn->slot], val_obj(json_object_get(obj))));
+
+		push_obj(obj);
+		vm_next();
+
+	vm_case(LOAD):
+		sl = ut_vm_lookup(s, insn);
+		obj = s->stack.scope[0];
+
+		push(sl ? val_get(sl->val) : val_obj(ut_getval(obj, op_at(insn->off)->val, op_at(insn->off)->hash)));
+		vm_next();
+
+	vm_case(STORE):
+		sl = ut_vm_lookup(s, insn);
+		v = pop();
+
+		if (sl)
+			push(ut_vm_bind(sl, v));
+		else
+			push_obj(ut_setval(s->stack.scope[0], op_at(insn->off)->val, op_at(insn->off)->hash,
+			                   val_box(v)));
+
+		vm_next();
+
+	vm_case(DECLARE):
+		v = pop();
+		push(ut_vm_bind(&frame->slots[insn->slot], v));
+		vm_next();
+
+	vm_case(GETPROP):
+		obj = pop_obj();
+
+		if (!is_ref(obj)) {
+			ut_putval(obj);
+			push_obj(ut_ref_exception(s, insn->off));
+			vm_next();
+		}
+
+		push_obj(ut_vm_getprop(s, insn, obj));
+		ut_putval(obj);
+		vm_next();
+
+	vm_case(GETIDX):
+		obj = pop_obj();
+		key = pop_obj();
+
+		if (!is_ref(obj)) {
+			ut_putval(obj);
+			ut_putval(key);
+			push_obj(ut_ref_exception(s, insn->off));
+			vm_next();
+		}
+
+		push_obj(ut_getval(obj, key, 0));
+		ut_putval(obj);
+		ut_putval(key);
+		vm_next();
+
+	vm_case(GETMETHOD):
+		obj = pop_obj();
+		push_obj(obj);
+
+		if (!is_ref(obj)) {
+			push_obj(ut_ref_exception(s, insn->off));
+			vm_next();
+		}
+
+		push_obj(ut_vm_getprop(s, insn, obj));
+		vm_next();
+
+	vm_case(GETMETHOD_IDX):
+		obj = pop_obj();
+		key = pop_obj();
+		push_obj(obj);
+
+		if (!is_ref(obj)) {
+			ut_putval(key);
+			push_obj(ut_ref_exception(s, insn->off));
+			vm_next();
+		}
+
+		push_obj(ut_getval(obj, key, 0));
+		ut_putval(key);
+		vm_next();
+
+	vm_case(CHKREF):
+		if (top().type != UT_VAL_OBJ || !is_ref(top().u.obj)) {
+			for (n = 0; n <= insn->n; n++)
+				val_put(pop());
+
+			push_obj(ut_ref_exception(s, insn->off));
+			pc = insn->arg;
+		}
+
+		vm_next();
+
+	vm_case(SETPROP):
+		op = ut_get_op(s, op_at(insn->off)->tree.operand[1]);
+		v = pop();
+		obj = pop_obj();
+
+		push_obj(ut_setval(obj, op ? op->val : NULL, op ? op->hash : 0, val_box(v)));
+		ut_putval(obj);
+		vm_next();
+
+	vm_case(SETIDX):
+		v = pop();
+		obj = pop_obj();
+		key = pop_obj();
+
+		push_obj(ut_setval(obj, key, 0, val_box(v)));
+		ut_putval(obj);
+		ut_putval(key);
+		vm_next();
+
+	vm_case(INCDEC):
+		op = op_at(insn->off);
+		sl = ut_vm_lookup(s, insn);
+
+		if (!sl) {
+			push_obj(ut_inc_dec(op, s->stack.scope[0], op_at(op->tree.operand[0])->val,
+			                    op_at(op->tree.operand[0])->hash));
+			vm_next();
+		}
+
+		v = val_get(sl->val);
+		v2 = ut_vm_bind(sl, ut_vm_inc_dec(op->type, v));
+
+		/* postfix inc/dec, return old val */
+		if (op->is_postfix) {
+			val_put(v2);
+			push(v);
+		}
+		else {
+			val_put(v);
+			push(v2);
+		}
+
+		vm_next();
+
+	vm_case(INCDEC_PROP):
+		op = op_at(insn->off);
+		obj = pop_obj();
+
+		if (!is_ref(obj)) {
+			ut_putval(obj);
+			push_obj(ut_ref_exception(s, op->tree.operand[0]));
+			vm_next();
+		}
+
+		op = ut_get_op(s, op_at(op->tree.operand[0])->tree.operand[1]);
+
+		push_obj(ut_inc_dec(op_at(insn->off), obj, op ? op->val : NULL, op ? op->hash : 0));
+		ut_putval(obj);
+		vm_next();
+
+	vm_case(INCDEC_IDX):
+		op = op_at(insn->off);
+		obj = pop_obj();
+		key = pop_obj();
+
+		if (!is_ref(obj)) {
+			ut_putval(obj);
+			ut_putval(key);
+			push_obj(ut_ref_exception(s, op->tree.operand[0]));
+			vm_next();
+		}
+
+		push_obj(ut_inc_dec(op, obj, key, 0));
+		ut_putval(obj);
+		ut_putval(key);
+		vm_next();
+
+	vm_case(ADD):
+		v2 = pop();
+		v = pop();
+		push(ut_vm_arith(T_ADD, v, v2));
+		vm_next();
+
+	vm_case(SUB):
+		v2 = pop();
+		v = pop();
+		push(ut_vm_arith(T_SUB, v, v2));
+		vm_next();
+
+	vm_case(MUL):
+		v2 = pop();
+		v = pop();
+		push(ut_vm_arith(T_MUL, v, v2));
+		vm_next();
+
+	vm_case(DIV):
+		v2 = pop();
+		v = pop();
+		push(ut_vm_arith(T_DIV, v, v2));
+		vm_next();
+
+	vm_case(MOD):
+		v2 = pop();
+		v = pop();
+		push(ut_vm_arith(T_MOD, v, v2));
+		vm_next();
+
+	vm_case(LSHIFT):
+		v2 = pop();
+		v = pop();
+		push(ut_vm_bitop(T_LSHIFT, v, v2));
+		vm_next();
+
+	vm_case(RSHIFT):
+		v2 = pop();
+		v = pop();
+		push(ut_vm_bitop(T_RSHIFT, v, v2));
+		vm_next();
+
+	vm_case(BAND):
+		v2 = pop();
+		v = pop();
+		push(ut_vm_bitop(T_BAND, v, v2));
+		vm_next();
+
+	vm_case(BXOR):
+		v2 = pop();
+		v = pop();
+		push(ut_vm_bitop(T_BXOR, v, v2));
+		vm_next();
+
+	vm_case(BOR):
+		v2 = pop();
+		v = pop();
+		push(ut_vm_bitop(T_BOR, v, v2));
+		vm_next();
+
+	vm_case(LT):
+		v2 = pop();
+		v = pop();
+		push(ut_vm_rel(T_LT, v, v2));
+		vm_next();
+
+	vm_case(LE):
+		v2 = pop();
+		v = pop();
+		push(ut_vm_rel(T_LE, v, v2));
+		vm_next();
+
+	vm_case(GT):
+		v2 = pop();
+		v = pop();
+		push(ut_vm_rel(T_GT, v, v2));
+		vm_next();
+
+	vm_case(GE):
+		v2 = pop();
+		v = pop();
+		push(ut_vm_rel(T_GE, v, v2));
+		vm_next();
+
+	vm_case(EQ):
+		v2 = pop();
+		v = pop();
+		push(ut_vm_rel(T_EQ, v, v2));
+		vm_next();
+
+	vm_case(NE):
+		v2 = pop();
+		v = pop();
+		push(ut_vm_rel(T_NE, v, v2));
+		vm_next();
+
+	vm_case(EQS):
+		v2 = pop();
+		v = pop();
+		push(ut_vm_equality(T_EQS, v, v2));
+		vm_next();
+
+	vm_case(NES):
+		v2 = pop();
+		v = pop();
+		push(ut_vm_equality(T_NES, v, v2));
+		vm_next();
+
+	vm_case(IN):
+		key = pop_obj();
+		obj = pop_obj();
+		push_obj(ut_in(obj, key));
+		vm_next();
+
+	vm_case(PLUS):
+		v = pop();
+		push(ut_vm_unary_arith(T_ADD, insn->n, v));
+		vm_next();
+
+	vm_case(MINUS):
+		v = pop();
+		push(ut_vm_unary_arith(T_SUB, insn->n, v));
+		vm_next();
+
+	vm_case(NOT):
+		v = pop();
+		push(val_bool(!val_is_truish(v)));
+		val_put(v);
+		vm_next();
+
+	vm_case(COMPL):
+		v = pop();
+		push(val_int(~val_cast_int(v)));
+		val_put(v);
+		vm_next();
+
+	vm_case(ARRAY):
+		obj = json_object_new_array();
+		push_obj(obj ? obj : ut_exception(s, insn->off, UT_ERRMSG_OOM));
+		vm_next();
+
+	vm_case(APPEND):
+		obj = pop_obj();
+
+		if (json_object_is_type(top().u.obj, json_type_array))
+			json_object_array_add(top().u.obj, obj);
+		else
+			ut_putval(obj);
+
+		vm_next();
+
+	vm_case(OBJECT):
+		obj = ut_new_object(s, NULL);
+		push_obj(obj ? obj : ut_exception(s, insn->off, UT_ERRMSG_OOM));
+		vm_next();
+
+	vm_case(SETKEY):
+		obj = pop_obj();
+
+		if (json_object_is_type(top().u.obj, json_type_object))
+			json_object_object_add(top().u.obj, json_object_get_string(op_at(insn->off)->val), obj);
+		else
+			ut_putval(obj);
+
+		vm_next();
+
+	vm_case(CALL):
+		key = pop_obj();
+		obj = pop_obj();
+		push_obj(ut_call(s, insn->off, s->stack.scope[0], obj, key));
+		vm_next();
+
+	vm_case(CALL_METHOD):
+		key = pop_obj();
+		obj = pop_obj();
+		ctx = pop_obj();
+		push_obj(ut_call(s, insn->off, ctx, obj, key));
+		ut_putval(ctx);
+		vm_next();
+
+	vm_case(JMP):
+		pc = insn->arg;
+		vm_next();
+
+	vm_case(JFALSE):
+		v = pop();
+		b = val_is_truish(v);
+		val_put(v);
+
+		if (!b)
+			pc = insn->arg;
+
+		vm_next();
+
+	vm_case(JTRUE_KEEP):
+		if (val_is_truish(top()))
+			pc = insn->arg;
+		else
+			val_put(pop());
+
+		vm_next();
+
+	vm_case(JFALSE_KEEP):
+		if (!val_is_truish(top()))
+			pc = insn->arg;
+		else
+			val_put(pop());
+
+		vm_next();
+
+	vm_case(JEXC):
+		if (is_exception(top()))
+			pc = insn->arg;
+
+		vm_next();
+
+	vm_case(TEXT):
+		ut_output_write(&s->output, json_object_get_string(op_at(insn->off)->val),
+		                json_object_get_string_len(op_at(insn->off)->val));
+		val_put(rv);
+		rv = val_obj(NULL);
+		vm_next();
+
+	vm_case(PRINT):
+		v = pop();
+
+		if (v.type == UT_VAL_STR) {
+			ut_output_write(&s->output, v.u.sb->data, v.len);
+			val_put(v);
+		}
+		else {
+			ut_write_val(s, val_box(v));
+		}
+
+		val_put(rv);
+		rv = val_obj(NULL);
+		vm_next();
+
+	vm_case(STMT):
+		val_put(rv);
+		rv = pop();
+
+		if (is_exception(rv))
+			goto out;
+
+		vm_next();
+
+	vm_case(CLEAR):
+		val_put(rv);
+		rv = val_obj(NULL);
+		vm_next();
+
+	vm_case(RAISE):
+		push_obj(ut_vm_raise(s, insn->n, insn->off));
+		vm_next();
+
+	vm_case(FORIN_LOCAL):
+		it = &iters[insn->n];
+		it->slot = &frame->slots[insn->slot];
+		goto forin;
+
+	vm_case(FORIN):
+		it = &iters[insn->n];
+		it->slot = ut_vm_lookup(s, insn);
+
+		if (!it->slot) {
+			it->key = op_at(insn->off)->val;
+			it->scope = json_object_get(s->stack.scope[0]);
+		}
+
+forin:
+		ut_iter_init(&it->iter, pop_obj());
+		vm_next();
+
+	vm_case(NEXT):
+		it = &iters[insn->n];
+
+		/* count ranges into local variables unboxed */
+		if (it->slot && it->iter.type == UT_ITER_RANGE) {
+			if (ut_iter_next_int(&it->iter, &n64))
+				val_put(ut_vm_bind(it->slot, val_int(n64)));
+			else
+				pc = insn->arg;
+
+			vm_next();
+		}
+
+		if (it->slot)
+			key = (it->slot->val.type == UT_VAL_OBJ) ? it->slot->val.u.obj : NULL;
+		else if (!json_object_object_get_ex(it->scope, json_object_get_string(it->key), &key))
+			key = NULL;
+
+		if (!ut_iter_next(s, insn->off, &it->iter, key, &obj)) {
+			pc = insn->arg;
+			vm_next();
+		}
+
+		if (ut_is_type(obj, T_EXCEPTION)) {
+			val_put(rv);
+			rv = val_obj(obj);
+			goto out;
+		}
+
+		if (it->slot)
+			val_put(ut_vm_bind(it->slot, val_obj(obj)));
+		else
+			ut_putval(ut_setval(it->scope, it->key, 0, obj));
+
+		vm_next();
+
+	vm_case(FOREND):
+		it = &iters[insn->n];
+		ut_iter_free(&it->iter);
+		json_object_put(it->scope);
+		memset(it, 0, sizeof(*it));
+		vm_next();
+
+	vm_case(RETURN):
+		val_put(rv);
+		rv = pop();
+		goto out;
+
+	vm_case(END):
+		goto out;
+
+#ifndef UT_VM_COMPUTED_GOTO
+	}
+#endif
+
+out:
+	while (sp > 0)
+		val_put(pop());
+
+	for (n = 0; n < niters; n++) {
+		ut_iter_free(&iters[n].iter);
+		json_object_put(iters[n].scope);
+	}
+
+	return val_box(rv);
+}
+
+static bool
+ut_vm_push_frame(struct ut_state *s, struct ut_frame *frame)
+{
+	struct ut_frame **tmp;
+
+	if (s->stack.nframes >= s->stack.framesize) {
+		tmp = realloc(s->stack.frames,
+		              (s->stack.framesize ? s->stack.framesize * 2 : 8) * sizeof(*tmp));
+
+		if (!tmp)
+			return false;
+
+		s->stack.frames = tmp;
+		s->stack.framesize = s->stack.framesize ? s->stack.framesize * 2 : 8;
+	}
+
+	s->stack.frames[s->stack.nframes++] = frame;
+
+	return true;
+}
+
+struct json_object *
+ut_vm_invoke(struct ut_state *s, uint32_t decl, struct json_object *argvals)
+{
+	struct ut_function *fn = ut_compile(s, decl);
+	struct json_object *rv, *arg;
+	struct ut_frame frame;
+	uint16_t n;
+
+	if (!fn)
+		return ut_exception(s, decl, UT_ERRMSG_OOM);
+
+	/* the frame puts its slots, operand stack and iterators onto the C stack */
+	if (s->stack.nframes >= ut_get_maxdepth(s) ||
+	    ut_stack_exhausted(s, (fn->nslots + 1) * sizeof(struct ut_slot) +
+	                          (fn->maxstack + 1) * sizeof(struct ut_value) +
+	                          (fn->niters + 1) * sizeof(struct ut_vm_iter)))
+		return ut_exception(s, decl, "Runtime error: Too much recursion");
+
+	struct ut_slot slots[fn->nslots + 1];
+
+	memset(slots, 0, sizeof(slots));
+
+	for (n = 0; n < fn->nparams; n++) {
+		arg = argvals ? json_object_array_get_idx(argvals, n) : NULL;
+		val_put(ut_vm_bind(&slots[fn->params[n]], val_obj(json_object_get(arg))));
+	}
+
+	frame.symbols = fn->symbols;
+	frame.slots = slots;
+	frame.nslots = fn->nslots;
+	frame.ctx = json_object_get(s->ctx);
+
+	if (ut_vm_push_frame(s, &frame)) {
+		rv = ut_vm_run(s, &frame, fn->insns, fn->maxstack, fn->niters);
+		s->stack.nframes--;
+	}
+	else {
+		rv = ut_exception(s, decl, UT_ERRMSG_OOM);
+	}
+
+	/* compiling nested functions may have moved fn, only use the frame copy */
+	for (n = 0; n < frame.nslots; n++)
+		val_put(slots[n].val);
+
+	json_object_put(frame.ctx);
+
+	return rv;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2020 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __VM_H_
+#define __VM_H_
+
+#include "ast.h"
+#include "compiler.h"
+#include "strbuf.h"
+
+enum ut_value_type {
+	UT_VAL_OBJ,
+	UT_VAL_INT,
+	UT_VAL_DOUBLE,
+	UT_VAL_BOOL,
+	UT_VAL_STR
+};
+
+/*
+ * Numbers and booleans live unboxed on the VM stack and in frame slots, they
+ * are only turned into json objects once they escape into an object, an array
+ * or a function call. Null is an object value with a NULL pointer.
+ *
+ * Results of string concatenations are kept as the first len bytes of a
+ * string buffer, so that repeated appends to the same value do not copy.
+ */
+struct ut_value {
+	union {
+		struct json_object *obj;
+		struct ut_strbuf *sb;
+		int64_t n;
+		double d;
+		bool b;
+	} u;
+	uint8_t type;
+	uint32_t len;
+};
+
+struct ut_slot {
+	struct ut_value val;
+	bool bound;
+};
+
+struct ut_frame {
+	const uint32_t *symbols;
+	struct ut_slot *slots;
+	uint16_t nslots;
+	struct json_object *ctx;
+};
+
+/*
+ * Inline cache of a property read, numbered by the compiler. It remembers
+ * the object along the prototype chain which held the key last time and the
+ * hash table entry of the key within that object.
+ */
+struct ut_propcache {
+	struct json_object *holder;
+	struct lh_entry *table;
+	struct lh_entry *entry;
+	const void *key;
+	uint32_t off;
+	uint32_t hits;
+	uint32_t misses;
+	uint8_t depth;
+};
+
+struct json_object *ut_vm_invoke(struct ut_state *s, uint32_t decl, struct json_object *argvals);
+
+#endif /* __VM_H_ */